@@ -0,0 +1,217 @@
+#!/bin/sh
+#
+# bench.sh
+#
+# Loopback benchmark suite for mspeak and httpbin, normally run with
+# "make bench", which builds both programs first.
+#
+# The syntax is:
+#
+#   sh bench.sh [results.csv]
+#
+# A fixed matrix of transfers is run over loopback on this machine and
+# each result is compared with the one in the given CSV file (bench.csv
+# by default) from the last run that passed.  The script fails if any
+# throughput dropped by more than the tolerance, so that an upgrade of
+# the programs, the compiler, or the system can be gated on measured
+# performance.  Only if the comparison passes, or there are no earlier
+# results, are the new results written to the CSV file, with the
+# earlier ones moved aside to the same path with .prev added, so that
+# a run that fails doesn't become the baseline for the next one.
+#
+# The matrix is:
+#
+#   transfer - "mspeak --bench", moving BENCH_BYTES of generated data
+#              over TCP, a Unix domain socket, and on Linux shared
+#              memory, in blocks of 4K, 64K, and 1M
+#
+#   header   - fake HTTP uploads to "mspeak srh" with request headers of
+#              256 bytes, 4K, and 15K and a 4K body, repeated so that
+#              the cost of scanning the header shows
+#
+#   httpbin  - files of 4K, 1M, and 64M served with httpbin and sent
+#              over TCP by mspeak, with the small files repeated
+#
+# Each line of the CSV file holds the test, the variant (the engine for
+# transfers), the size being varied, the bytes moved, the seconds
+# taken, and the throughput in MiB/s.  For the header and httpbin tests,
+# the seconds are the time the measured mspeak instance spent on the
+# connection, taken from --stats-json, so that starting the processes
+# isn't counted.
+#
+# Settings are taken from the environment:
+#
+#   BENCH_BYTES     - how much data each transfer moves (default 1G)
+#   BENCH_PORT      - the TCP port on 127.0.0.1 for the header and
+#                     httpbin tests (default 47000); "mspeak --bench"
+#                     picks its own
+#   BENCH_TOLERANCE - the drop in throughput in percent beyond which a
+#                     result counts as a regression (default 20)
+#   MSPEAK, HTTPBIN - the programs to run (default ./mspeak and
+#                     ./httpbin)
+#
+
+CSV=${1:-bench.csv}
+PREV=$CSV.prev
+BYTES=${BENCH_BYTES:-1G}
+PORT=${BENCH_PORT:-47000}
+TOL=${BENCH_TOLERANCE:-20}
+MSPEAK=${MSPEAK:-./mspeak}
+HTTPBIN=${HTTPBIN:-./httpbin}
+ADDR=127.0.0.1:$PORT
+
+HDRSIZES="256 4096 15360"
+HDRBODY=4096
+HDRREPS=200
+FILESIZES="4096 1048576 67108864"
+FILEBYTES=67108864
+FILEREPS=200
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/mspeak-bench.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' EXIT
+trap 'exit 1' INT TERM
+
+# Print an error, with the log of the failed run, and stop
+fail() {
+  echo "bench: $1" >&2
+  if [ -s "$TMP/log" ]; then
+    cat "$TMP/log" >&2
+  fi
+  exit 1
+}
+
+# Print the microseconds the instance that wrote the --stats-json file
+# $1 spent on the connection, and the bytes it moved
+busy() {
+  grep -q '"ok":true' "$1" || return 1
+  tr '{},' '\n\n\n' < "$1" | awk -F: '
+    $1 == "\"bytes\"" && bytes == "" { bytes = $2 }
+    $1 == "\"lookup_us\"" { us -= $2 }
+    $1 == "\"connect_us\"" { us -= $2 }
+    $1 == "\"total_us\"" { us += $2 }
+    END { print us, bytes }'
+}
+
+# Add up the busy times of repeated runs, then print a result line for
+# test $1, variant $2, and size $3
+result() {
+  awk -v t="$1" -v v="$2" -v s="$3" '
+    { us += $1; bytes += $2 }
+    END {
+      secs = us / 1000000
+      if (secs <= 0) { secs = 0.000001 }
+      printf "%s,%s,%s,%d,%.6f,%.1f\n", t, v, s, bytes, secs,
+             bytes / 1048576 / secs
+    }' "$TMP/busy"
+}
+
+for p in "$MSPEAK" "$HTTPBIN"; do
+  [ -x "$p" ] || fail "$p not found, run make first"
+done
+
+echo "test,variant,size,bytes,seconds,mib_per_s" > "$TMP/new.csv"
+
+# Socket and shared-memory transfers, through the built-in benchmark
+echo "bench: transfers of $BYTES" >&2
+"$MSPEAK" --bench --bytes="$BYTES" > "$TMP/transfer.csv" 2> "$TMP/log" ||
+  fail "mspeak --bench failed"
+sed -e '1d' -e 's/^/transfer,/' "$TMP/transfer.csv" >> "$TMP/new.csv"
+
+# Fake HTTP uploads with growing request headers
+for h in $HDRSIZES; do
+  echo "bench: fake HTTP header of $h bytes" >&2
+  awk -v h="$h" -v n="$HDRBODY" 'BEGIN {
+    head = "PUT /bench HTTP/1.1\r\nHost: 127.0.0.1\r\n" \
+           "Content-Length: " n "\r\nX-Pad: "
+    pad = h - length(head) - 4
+    for (i = 0; i < pad; i++) { head = head "a" }
+    printf "%s\r\n\r\n", head
+  }' > "$TMP/req"
+  head -c "$HDRBODY" /dev/zero >> "$TMP/req"
+
+  : > "$TMP/busy"
+  i=0
+  while [ $i -lt $HDRREPS ]; do
+    : > "$TMP/log"
+    "$MSPEAK" srh "$ADDR" --sink --stats-json="$TMP/stats.json" \
+      2>> "$TMP/log" &
+    "$MSPEAK" cw "$ADDR" --retry=5 < "$TMP/req" 2>> "$TMP/log" ||
+      fail "fake HTTP client failed"
+    wait $! || fail "fake HTTP server failed"
+    busy "$TMP/stats.json" >> "$TMP/busy" || fail "no statistics"
+    i=$((i + 1))
+  done
+  result header srh "$h" >> "$TMP/new.csv"
+done
+
+# Files served with httpbin, repeated so that each size moves about the
+# same amount of data
+for f in $FILESIZES; do
+  echo "bench: httpbin file of $f bytes" >&2
+  head -c "$f" /dev/urandom > "$TMP/file" || fail "couldn't create file"
+
+  reps=$((FILEBYTES / f))
+  if [ $reps -lt 1 ]; then
+    reps=1
+  elif [ $reps -gt $FILEREPS ]; then
+    reps=$FILEREPS
+  fi
+
+  : > "$TMP/busy"
+  i=0
+  while [ $i -lt $reps ]; do
+    : > "$TMP/log"
+    "$MSPEAK" sr "$ADDR" --sink 2>> "$TMP/log" &
+    "$HTTPBIN" "$TMP/file" 2>> "$TMP/log" |
+      "$MSPEAK" cw "$ADDR" --retry=5 --stats-json="$TMP/stats.json" \
+        2>> "$TMP/log" || fail "httpbin transfer failed"
+    wait $! || fail "httpbin reader failed"
+    busy "$TMP/stats.json" >> "$TMP/busy" || fail "no statistics"
+    i=$((i + 1))
+  done
+  result httpbin tcp "$f" >> "$TMP/new.csv"
+done
+
+# With no earlier results, the new ones become the baseline
+if [ ! -f "$CSV" ]; then
+  cp "$TMP/new.csv" "$CSV" || fail "couldn't write $CSV"
+  echo "bench: results written to $CSV" >&2
+  cat "$CSV"
+  exit 0
+fi
+
+# Compare with the earlier results, failing without touching them if
+# anything got slower than the tolerance allows
+awk -F, -v tol="$TOL" '
+  BEGIN {
+    printf "%-28s %12s %12s %8s\n", "test,variant,size", "prev MiB/s",
+           "now MiB/s", "change"
+  }
+  FNR == 1 { next }
+  NR == FNR { prev[$1 "," $2 "," $3] = $6; next }
+  {
+    key = $1 "," $2 "," $3
+    if (!(key in prev)) {
+      printf "%-28s %12s %12.1f   new\n", key, "-", $6
+      next
+    }
+    change = (prev[key] > 0) ? ($6 - prev[key]) * 100 / prev[key] : 0
+    flag = ""
+    if (change < -tol) { flag = "   REGRESSION"; bad++ }
+    printf "%-28s %12.1f %12.1f %+7.1f%%%s\n", key, prev[key], $6,
+           change, flag
+  }
+  END {
+    if (bad) {
+      printf "%d result(s) dropped by more than %s%%\n", bad, tol
+      exit 1
+    }
+  }' "$CSV" "$TMP/new.csv" || {
+  echo "bench: results not written, $CSV is unchanged" >&2
+  exit 1
+}
+
+# Keep the earlier results and install the new ones
+mv -f "$CSV" "$PREV" || fail "couldn't keep previous results"
+cp "$TMP/new.csv" "$CSV" || fail "couldn't write $CSV"
+echo "bench: results written to $CSV" >&2
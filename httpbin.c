@@ -14,7 +14,7 @@
  *
  * The syntax is:
  *
- *   httpbin myfile.bin
+ *   httpbin [options] myfile.bin
  *
  * myfile.bin is the path to a file on disk to stream to standard output
  * with the HTTP header prefixed.  To use with mspeak in fake HTTP mode,
@@ -22,6 +22,9 @@
  *
  *   httpbin myfile.bin | mspeak swh 192.168.1.10:2000
  *
+ * (mspeak can also do this by itself with its --file option, which
+ * avoids copying the file through the pipeline.)
+ *
  * Then, connect to the domain from a web browser -- any file path in
  * the domain will work because mspeak doesn't check it, but for ease of
  * use this should match the original file so that the web browser knows
@@ -34,6 +37,70 @@
  * pipeline to finish as soon as the web browser has downloaded the
  * file.
  *
+ * Options begin with "--" and may appear anywhere after the program
+ * name.  The following options are available:
+ *
+ *   --mmap
+ *
+ *     (POSIX only) Write the file body directly from a memory mapping
+ *     of the file, instead of moving it with the zero-copy system calls
+ *     or reading it into a buffer.  The file is mapped in large windows
+ *     with sequential access advice, and the system is asked to start
+ *     reading each next window in ahead of time, so that files that
+ *     aren't in the page cache yet still stream quickly.  For files
+ *     that are already in the page cache, this uses very little
+ *     processor time.  The file must not be truncated while it is being
+ *     served.
+ *
+ *   --dir=path
+ *
+ *     (POSIX only) Serve a whole directory tree instead of a single
+ *     file.  No file path is given in this mode.  Instead of writing a
+ *     single response, httpbin reads HTTP requests from standard input
+ *     and writes the responses to standard output, so standard input
+ *     and standard output should both be connected to the client, as
+ *     done by inetd, systemd socket activation, or a tool like socat:
+ *
+ *       socat TCP-LISTEN:2000,reuseaddr,fork EXEC:"httpbin --dir=pub"
+ *
+ *     The tree is scanned once at startup.  The response header fields
+ *     for every file (length, content type from the file extension,
+ *     and an entity tag derived from the inode number, length, and
+ *     modification time) are generated then and kept in a hash table
+ *     keyed by URL path, so answering a request doesn't need to look at
+ *     the file system beyond opening the file.  Files added after
+ *     startup aren't served.  A request for a directory path ending in
+ *     "/" serves the "index.html" file in that directory.  Names
+ *     beginning with a dot are never served, and symbolic links to
+ *     directories aren't followed.  Only GET and HEAD requests are
+ *     supported.  HTTP/1.1 connections are kept open for further
+ *     requests unless the client asks for them to be closed.  The
+ *     bodies are sent in the same way as in single-file mode, so with
+ *     sendfile() when standard output is a socket.
+ *
+ *     If a file has a precompressed variant next to it, named with an
+ *     extra ".zst" or ".gz" extension and modified no earlier than the
+ *     file itself, and the request's Accept-Encoding field allows that
+ *     encoding, the variant is sent instead, with the matching
+ *     Content-Encoding and the content type of the original file.
+ *     zstd is preferred over gzip when both are allowed.  Variants are
+ *     found during the startup scan, so this costs nothing per request.
+ *
+ *     A request with an If-None-Match field that matches the entity tag
+ *     of what would be sent gets a 304 (Not Modified) response without
+ *     a body, so clients that poll for a file only transfer it when it
+ *     has changed.
+ *
+ *   --precompress
+ *
+ *     (POSIX only) Only allowed with --dir.  Instead of serving the
+ *     directory tree, build the precompressed variants in it and exit.
+ *     Every text-like file (judging by its content type) that doesn't
+ *     have an up-to-date variant gets one built by running the "zstd"
+ *     and "gzip" programs, whichever are installed.  Variants that
+ *     don't come out smaller than the original are not kept.  Run this
+ *     again whenever files in the tree change.
+ *
  * Of course, the web browser has to be able to access the provided port
  * of the provided IP address for this to work, and there are some
  * serious security considerations that need to be taken into account.
@@ -41,186 +108,2727 @@
  * information.
  */
 
-#include <stddef.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+/*
+ * On Linux, request the GNU extensions so that the zero-copy system
+ * calls such as splice() are declared.  On POSIX, request 64-bit file
+ * offsets so that files over 2 GiB work on 32-bit builds.  This must
+ * come before any include.
+ */
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#ifndef _WIN32
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Windows-specific includes
+ */
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+/*
+ * POSIX-specific includes
+ */
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Linux-specific includes
+ */
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/*
+ * Constant definitions
+ * ====================
+ */
+
+/*
+ * The size of the buffer used to transfer data when the file can't be
+ * transferred with the zero-copy system calls.
+ *
+ * This is dynamically allocated, so it can be made large.
+ */
+#define IOBUFSIZE (1024 * 1024)
+
+/*
+ * (Linux only) The maximum number of bytes requested in each
+ * sendfile() or splice() call.
+ */
+#define ZCCHUNK (16 * 1024 * 1024)
+
+/*
+ * (POSIX only) The size in bytes of each window of the file that is
+ * mapped into memory at a time with the --mmap option.
+ *
+ * Mapping in windows keeps the address space needed bounded, so huge
+ * files also work on 32-bit builds.  This must be a multiple of the
+ * system page size.
+ */
+#define MMAPWINDOW (64 * 1024 * 1024)
+
+/*
+ * (POSIX only) The maximum number of bytes written from the memory
+ * mapping in a single write() call.
+ */
+#define MMAPSLICE (4 * 1024 * 1024)
+
+/*
+ * The maximum size in bytes of an HTTP request header in directory
+ * mode, including a terminating null.
+ */
+#define MAXREQSIZE 16384
+
+/*
+ * The maximum size, including terminating null, of a single decoded
+ * HTTP header field value or request method.
+ */
+#define MAXLINESIZE 256
+
+/*
+ * The maximum size, including terminating null, of a file path or URL
+ * path in directory mode.
+ */
+#define MAXPATHSIZE 4096
+
+/*
+ * The maximum size, including terminating null, of the cached response
+ * header fields for a single file in directory mode.
+ */
+#define MAXFIELDSIZE 512
+
+/*
+ * The name of the file that is served when a directory is requested in
+ * directory mode.
+ */
+#define INDEXNAME "index.html"
+
+/*
+ * The number of content encodings that precompressed variants may be
+ * served with in directory mode.  See enc_table.
+ */
+#define ENCCOUNT 2
+
+/*
+ * Types
+ * =====
+ */
+
+/*
+ * Optional settings given on the command line with "--" options.
+ *
+ * See the program documentation at the top of this source file for the
+ * meaning of each option.  A structure that is cleared to zero holds
+ * the default settings.
+ */
+typedef struct {
+  /* --mmap given -- write the body from a memory mapping */
+  int use_mmap;
+
+  /* --dir=path given -- root of the directory tree to serve, or NULL
+   * if not given */
+  const char *pDir;
+
+  /* --precompress given -- build the precompressed variants in the
+   * directory tree instead of serving it */
+  int precompress;
+} HBOPT;
+
+/*
+ * A content encoding that precompressed variants may be served with in
+ * directory mode.
+ */
+typedef struct {
+  /* Token for the encoding in Accept-Encoding and Content-Encoding */
+  const char *pToken;
+
+  /* File name extension of the variants, including the dot */
+  const char *pExt;
+
+  /* Name of the program and compression level argument used to build
+   * variants with --precompress */
+  const char *pProg;
+  const char *pLevel;
+} HBENC;
+
+/*
+ * An entry in the header cache used in directory mode.
+ */
+typedef struct HBENTRY_S {
+  /* Path of the file on disk */
+  char *pFile;
+
+  /* URL path of the file, beginning with "/" */
+  char *pUrl;
+
+  /* Hash of the URL path */
+  uint32_t hash;
+
+  /* Length of the file in bytes */
+  int64_t flen;
+
+  /* Modification time of the file */
+  int64_t mtime;
+
+  /* Entity tag of the file, including its quotes */
+  char etag[64];
+
+  /* Content type of the file, as a static string */
+  const char *pType;
+
+  /* Cached response header fields, each ending with CR+LF, and the
+   * number of characters in them */
+  char   *pFields;
+  size_t  fields_len;
+
+  /* For each encoding in enc_table, the entry of an up-to-date
+   * precompressed variant of this file, or NULL if there is none; if
+   * there is one, the cached response header fields for sending it
+   * in place of this file, and the number of characters in them */
+  const struct HBENTRY_S *pVar[ENCCOUNT];
+  char       *pVarFields[ENCCOUNT];
+  size_t      var_len[ENCCOUNT];
+
+  /* For each linked variant, the entity tag it is sent with */
+  char        var_etag[ENCCOUNT][80];
+
+  /* Non-zero if this file has any precompressed variants, so that
+   * responses need to say that they vary by Accept-Encoding */
+  int vary;
+} HBENTRY;
+
+/*
+ * The header cache used in directory mode.
+ *
+ * The entries are held in an array that grows as the directory tree is
+ * scanned.  Once the scan is complete, an open-addressing hash table of
+ * pointers into the entry array is built, with a size that is a power
+ * of two.
+ */
+typedef struct {
+  HBENTRY  *pEnt;
+  size_t    count;
+  size_t    cap;
+
+  HBENTRY **pTable;
+  size_t    tsize;
+} HBCACHE;
+
+/*
+ * Buffer for reading HTTP requests from standard input in directory
+ * mode.
+ *
+ * Bytes that have been read but not consumed yet are held from index
+ * pos (inclusive) to index lim (exclusive).
+ */
+typedef struct {
+  char buf[MAXREQSIZE];
+  int  pos;
+  int  lim;
+} HBREQBUF;
+
+/*
+ * Static data
+ * ===========
+ */
+
+/*
+ * The content encodings that precompressed variants may be served with
+ * in directory mode, in order of preference.
+ *
+ * zstd is preferred where the client supports it, since it usually
+ * produces smaller variants than gzip.
+ */
+static const HBENC enc_table[ENCCOUNT] = {
+  {"zstd", ".zst", "zstd", "-19"},
+  {"gzip", ".gz",  "gzip", "-9" }
+};
+
+/*
+ * Local function prototypes
+ * =========================
+ */
+
+/*
+ * Stream the file at the given path to standard output, preceded by
+ * HTTP headers.
+ *
+ * The file size is determined with a 64-bit file status query, so
+ * files of any size are supported.  On Linux, the body is moved to
+ * standard output with splice() if standard output is a pipe, or with
+ * sendfile() otherwise, so that the file contents are never copied into
+ * user space.  If neither works for the output, or on other platforms,
+ * the body is copied through a large buffer.
+ *
+ * If the --mmap option is set in pOpt, the body is instead written from
+ * a memory mapping of the file, as described in the program
+ * documentation at the top of this source file.
+ *
+ * Errors that occur are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pPath - pointer to the path to stream
+ *
+ *   pOpt - pointer to the option settings
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pPath or pOpt is NULL
+ *
+ * Undefined behavior:
+ *
+ *   - If the path is not null terminated
+ */
+static int httpbin(const char *pPath, const HBOPT *pOpt);
+
+/*
+ * Write part of a file to standard output as an HTTP response body.
+ *
+ * Exactly flen bytes are written from the beginning of the file, which
+ * must also be the current position of the file.  The method depends
+ * on the options and the platform, as described for the httpbin
+ * function.  Anything buffered by the standard library for standard
+ * output must have been flushed before calling this function, and
+ * standard output is flushed again before returning.
+ *
+ * Errors that occur are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   fd - the file descriptor of the file, open for reading
+ *
+ *   flen - the number of bytes to write
+ *
+ *   pOpt - pointer to the option settings
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If flen is negative
+ *
+ *   - If pOpt is NULL
+ */
+static int write_body(int fd, int64_t flen, const HBOPT *pOpt);
+
+/*
+ * (POSIX only) Write part of a file to standard output from memory
+ * mappings of the file.
+ *
+ * The file is mapped one window at a time, starting at offset zero.
+ * Each window is advised for sequential access, and the system is asked
+ * to read the following window in while the current one is written, so
+ * that the disk is kept busy for files that aren't cached.
+ *
+ * Errors that occur are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   fd - the file descriptor of the file, open for reading
+ *
+ *   flen - the number of bytes to write from the start of the file
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If flen is negative
+ */
+#ifndef _WIN32
+static int write_mapped(int fd, int64_t flen);
+#endif
+
+/*
+ * Case-insensitive comparison of the first n characters of two strings.
+ *
+ * Only the ASCII letters are folded, which is what HTTP field names and
+ * tokens require.  Comparison stops early at a null terminator that
+ * occurs in both strings at the same position.
+ *
+ * Parameters:
+ *
+ *   pA - the first string
+ *
+ *   pB - the second string
+ *
+ *   n - the maximum number of characters to compare
+ *
+ * Return:
+ *
+ *   non-zero if the strings match, zero if they differ
+ *
+ * Faults:
+ *
+ *   - If pA or pB is NULL
+ */
+static int str_ieq(const char *pA, const char *pB, size_t n);
+
+/*
+ * Find a header field in an HTTP request header.
+ *
+ * pHdr is the null-terminated header.  The first line (the request
+ * line) is skipped.  pName is the name of the field to find, without
+ * the colon, and it is matched without regard to letter case.  If the
+ * field is present, its value without leading or trailing whitespace is
+ * copied into pVal.  If the field appears more than once, the first
+ * instance is used.
+ *
+ * Parameters:
+ *
+ *   pHdr - the request header
+ *
+ *   pName - the field name
+ *
+ *   pVal - the buffer to receive the field value
+ *
+ *   maxval - the size of the value buffer, including terminating null
+ *
+ * Return:
+ *
+ *   one if the field was found, zero if it was not found, or negative
+ *   if the value was too long for the buffer
+ *
+ * Faults:
+ *
+ *   - If pHdr, pName, or pVal is NULL
+ *
+ *   - If maxval is less than one
+ */
+static int http_field(
+    const char * pHdr,
+    const char * pName,
+          char * pVal,
+          int    maxval);
+
+#ifndef _WIN32
+
+/*
+ * (POSIX only) Determine the content type to report for a file.
+ *
+ * The type is chosen from the file name extension, without regard to
+ * letter case.  Files with unknown extensions are reported as generic
+ * binary data.
+ *
+ * Parameters:
+ *
+ *   pName - the file name or path
+ *
+ * Return:
+ *
+ *   the content type, as a static string
+ *
+ * Faults:
+ *
+ *   - If pName is NULL
+ */
+static const char *content_type(const char *pName);
+
+/*
+ * (POSIX only) Add a file to the header cache.
+ *
+ * The response header fields for the file are generated from its status
+ * and stored with the entry.  The hash table is not updated, so
+ * cache_index must be called after all files have been added.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the cache
+ *
+ *   pFile - the path of the file on disk
+ *
+ *   pUrl - the URL path of the file, beginning with "/"
+ *
+ *   pst - the status of the file
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If any parameter is NULL
+ */
+static int cache_add(
+          HBCACHE     * pc,
+    const char        * pFile,
+    const char        * pUrl,
+    const struct stat * pst);
+
+/*
+ * (POSIX only) Add all the files in a directory tree to the header
+ * cache.
+ *
+ * pPath is a buffer of MAXPATHSIZE characters holding the path of the
+ * directory, which is temporarily extended with the name of each entry
+ * while the directory is walked.  urloff is the offset in pPath where
+ * the URL path begins, which is the length of the root directory path.
+ * If the root directory is the file system root, pPath is empty.
+ *
+ * Names that begin with a dot are skipped.  Symbolic links to files are
+ * followed, but symbolic links to directories are not, so that loops
+ * can't occur.  Anything that isn't a regular file or directory is
+ * skipped.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the cache
+ *
+ *   pPath - the directory path buffer
+ *
+ *   urloff - the offset of the URL path within the path buffer
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pc or pPath is NULL
+ */
+static int cache_walk(HBCACHE *pc, char *pPath, size_t urloff);
+
+/*
+ * (POSIX only) Compute the 32-bit FNV-1a hash of a string.
+ *
+ * Parameters:
+ *
+ *   pStr - the string to hash
+ *
+ * Return:
+ *
+ *   the hash value
+ *
+ * Faults:
+ *
+ *   - If pStr is NULL
+ */
+static uint32_t hash_str(const char *pStr);
+
+/*
+ * (POSIX only) Build the hash table of the header cache.
+ *
+ * This must be called after all entries have been added.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the cache
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pc is NULL
+ */
+static int cache_index(HBCACHE *pc);
+
+/*
+ * (POSIX only) Link each file in the header cache to its precompressed
+ * variants.
+ *
+ * This must be called after cache_index.  For each file and each
+ * encoding in enc_table, if the cache also holds the file name with the
+ * encoding's extension added, and that variant was modified no earlier
+ * than the file itself, the variant is linked to the file and the
+ * response header fields for sending it in place of the file are
+ * generated.  Variants that are older than the file are ignored, so a
+ * stale variant is never served.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the cache
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pc is NULL
+ */
+static int cache_link(HBCACHE *pc);
+
+/*
+ * (POSIX only) Fill a header cache with a directory tree.
+ *
+ * This scans the tree with cache_walk and then calls cache_index and
+ * cache_link.  The cache must be empty beforehand.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the cache
+ *
+ *   pRoot - the root directory
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pc or pRoot is NULL
+ */
+static int cache_load(HBCACHE *pc, const char *pRoot);
+
+/*
+ * (POSIX only) Look up a URL path in the header cache.
+ *
+ * Parameters:
+ *
+ *   pc - the cache
+ *
+ *   pUrl - the decoded URL path, beginning with "/"
+ *
+ * Return:
+ *
+ *   the cache entry, or NULL if there is no file with that URL path
+ *
+ * Faults:
+ *
+ *   - If pc or pUrl is NULL
+ */
+static const HBENTRY *cache_find(const HBCACHE *pc, const char *pUrl);
+
+/*
+ * (POSIX only) Release everything allocated by a header cache.
+ *
+ * The structure is cleared afterwards.
+ *
+ * Parameters:
+ *
+ *   pc - the cache
+ *
+ * Faults:
+ *
+ *   - If pc is NULL
+ */
+static void cache_free(HBCACHE *pc);
+
+/*
+ * (POSIX only) Read an HTTP request header from standard input.
+ *
+ * Data is consumed until two line breaks in a row are encountered,
+ * where line breaks are ASCII LF characters with any ASCII CR
+ * characters filtered out.  The header (including the final line
+ * breaks) is copied into pHdr and null terminated.  Data after the
+ * header stays in the request buffer for the next request.
+ *
+ * Parameters:
+ *
+ *   pr - the request buffer
+ *
+ *   pHdr - the buffer to receive the header, which must have room for
+ *   MAXREQSIZE characters
+ *
+ * Return:
+ *
+ *   one if a header was read, zero if standard input ended before any
+ *   data, or negative if there was a read error, standard input ended
+ *   in the middle of a header, or the header was too long
+ *
+ * Faults:
+ *
+ *   - If pr or pHdr is NULL
+ */
+static int read_request(HBREQBUF *pr, char *pHdr);
+
+/*
+ * (POSIX only) Decode the request line of an HTTP request header.
+ *
+ * The method is copied into pMethod.  The path of the request target,
+ * without any query string and with percent escapes decoded, is copied
+ * into pUrl.  The HTTP version of the request is returned, encoded as
+ * ten times the major version plus the minor version, so 10 for
+ * HTTP/1.0 and 11 for HTTP/1.1.
+ *
+ * Parameters:
+ *
+ *   pHdr - the request header
+ *
+ *   pMethod - the buffer to receive the method, with room for
+ *   MAXLINESIZE characters
+ *
+ *   pUrl - the buffer to receive the URL path, with room for
+ *   MAXPATHSIZE characters
+ *
+ * Return:
+ *
+ *   the encoded HTTP version, or zero if the request line couldn't be
+ *   decoded
+ *
+ * Faults:
+ *
+ *   - If any parameter is NULL
+ */
+static int http_request(const char *pHdr, char *pMethod, char *pUrl);
+
+/*
+ * (POSIX only) Check whether an Accept-Encoding field value allows a
+ * content encoding.
+ *
+ * The encoding is allowed if its token or the "*" wildcard is listed
+ * without a quality value of zero.  An explicit listing of the token
+ * takes precedence over the wildcard.
+ *
+ * Parameters:
+ *
+ *   pVal - the Accept-Encoding field value
+ *
+ *   pToken - the token of the content encoding
+ *
+ * Return:
+ *
+ *   non-zero if the encoding is allowed, zero if not
+ *
+ * Faults:
+ *
+ *   - If pVal or pToken is NULL
+ */
+static int accepts_encoding(const char *pVal, const char *pToken);
+
+/*
+ * (POSIX only) Check whether an If-None-Match field value matches an
+ * entity tag.
+ *
+ * pList is the field value, which is either "*" or a comma-separated
+ * list of entity tags.  pTag is the current entity tag of the file,
+ * including its quotes.  Tags are compared with the weak comparison
+ * that HTTP requires for If-None-Match, so a "W/" prefix on a tag in
+ * the list is ignored.
+ *
+ * Parameters:
+ *
+ *   pList - the If-None-Match field value
+ *
+ *   pTag - the current entity tag
+ *
+ * Return:
+ *
+ *   non-zero if the list matches the tag, zero if not
+ *
+ * Faults:
+ *
+ *   - If pList or pTag is NULL
+ */
+static int etag_match(const char *pList, const char *pTag);
+
+/*
+ * (POSIX only) Check whether a file of the given content type is worth
+ * precompressing.
+ *
+ * Parameters:
+ *
+ *   pType - the content type
+ *
+ * Return:
+ *
+ *   non-zero if the type is worth compressing, zero if not
+ *
+ * Faults:
+ *
+ *   - If pType is NULL
+ */
+static int compressible(const char *pType);
+
+/*
+ * (POSIX only) Build a precompressed variant of a file.
+ *
+ * The compression program of the encoding is run with the file as its
+ * standard input and a temporary file next to pDst as its standard
+ * output.  If it succeeds and the result is smaller than the original
+ * file, the temporary file is renamed to pDst; otherwise, it is
+ * removed.
+ *
+ * Parameters:
+ *
+ *   pEnc - the encoding
+ *
+ *   pSrc - the path of the file to compress
+ *
+ *   pDst - the path of the variant to build
+ *
+ *   flen - the length of the file to compress
+ *
+ * Return:
+ *
+ *   one if the variant was built, zero if it wasn't worth keeping, -1
+ *   if the compression failed, or -2 if the compression program isn't
+ *   available
+ *
+ * Faults:
+ *
+ *   - If pEnc, pSrc, or pDst is NULL
+ */
+static int run_compressor(
+    const HBENC * pEnc,
+    const char  * pSrc,
+    const char  * pDst,
+          int64_t flen);
+
+/*
+ * (POSIX only) Build the precompressed variants in a directory tree.
+ *
+ * For each file in the tree that is worth compressing and isn't itself
+ * a variant, each encoding in enc_table gets a variant built unless an
+ * up-to-date one already exists.  Encodings whose compression program
+ * isn't available are skipped with a warning.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pRoot - the root directory
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pRoot is NULL
+ */
+static int precompress_dir(const char *pRoot);
+
+/*
+ * (POSIX only) Write several blocks of data completely to standard
+ * output, in order, with a single vectored write where possible.
+ *
+ * The block array may be modified by this function.
+ *
+ * Parameters:
+ *
+ *   piov - the array of blocks to write
+ *
+ *   n - the number of blocks
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If piov is NULL
+ */
+static int write_vec(struct iovec *piov, int n);
+
+/*
+ * (POSIX only) Serve the files in a directory tree over standard input
+ * and standard output.
+ *
+ * The tree is scanned once at startup and the response header for each
+ * file is cached.  Then, HTTP requests are read from standard input and
+ * answered on standard output until standard input ends or the client
+ * asks for the connection to be closed.  See the program documentation
+ * at the top of this source file for further information.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pRoot - the root directory to serve
+ *
+ *   pOpt - pointer to the option settings
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pRoot or pOpt is NULL
+ */
+static int serve_dir(const char *pRoot, const HBOPT *pOpt);
+
+#endif
+
+/*
+ * Interpret a "--" option from the command line.
+ *
+ * pArg is the whole command-line argument, including the leading "--".
+ * Options that take a value have the form "--name=value".  The setting
+ * is stored in the options structure.  Errors are reported directly to
+ * stderr.
+ *
+ * Parameters:
+ *
+ *   pArg - the command-line argument
+ *
+ *   pOpt - the options structure to update
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if the option is not recognized or its
+ *   value is not valid
+ *
+ * Faults:
+ *
+ *   - If pArg or pOpt is NULL
+ */
+static int parse_option(const char *pArg, HBOPT *pOpt);
+
+/*
+ * Local function implementations
+ * ==============================
+ */
+
+/*
+ * httpbin function.
+ */
+static int httpbin(const char *pPath, const HBOPT *pOpt) {
+  int             status = 1   ;
+  int             fd     = -1  ;
+  int64_t         flen   = 0   ;
+#ifdef _WIN32
+/* WIN32-specific --------------------------------------------------- */
+  struct _stati64 st           ;
+/* ================================================================== */
+#else
+/* POSIX-specific --------------------------------------------------- */
+  struct stat     st           ;
+/* ================================================================== */
+#endif
+
+  /* Initialize structures */
+  memset(&st, 0, sizeof(st));
+
+  /* Check parameters */
+  if ((pPath == NULL) || (pOpt == NULL)) {
+    abort();
+  }
+
+  /* First of all, open the path for reading */
+  if (status) {
+#ifdef _WIN32
+    fd = _open(pPath, _O_RDONLY | _O_BINARY);
+#else
+    fd = open(pPath, O_RDONLY);
+#endif
+    if (fd == -1) {
+      fprintf(stderr, "Couldn't open input file!\n");
+      status = 0;
+    }
+  }
+
+  /* Next, get the file size from the file status, which uses a 64-bit
+   * size so that files of any size work */
+  if (status) {
+#ifdef _WIN32
+    if (_fstati64(fd, &st)) {
+#else
+    if (fstat(fd, &st)) {
+#endif
+      fprintf(stderr, "Error determining file length!\n");
+      status = 0;
+    }
+
+    if (status) {
+      flen = (int64_t) st.st_size;
+      if (flen < 0) {
+        fprintf(stderr, "Error determining file length!\n");
+        status = 0;
+      }
+    }
+  }
+
+  /* Next, transmit the HTTP header, with the file length filled in,
+   * and using CR+LF linebreaks even on platforms where LF-only
+   * linebreaks are customary; flush it, since the body may be written
+   * directly to the output file descriptor */
+  if (status) {
+    if (printf(
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Length: %lld\r\n"
+        "\r\n",
+        (long long) flen) < 0) {
+      fprintf(stderr, "Error printing HTTP header!\n");
+      status = 0;
+    }
+
+    if (status) {
+      if (fflush(stdout)) {
+        fprintf(stderr, "Error printing HTTP header!\n");
+        status = 0;
+      }
+    }
+  }
+
+  /* Finally, echo the entire input file to standard output */
+  if (status) {
+    status = write_body(fd, flen, pOpt);
+  }
+
+  /* Close the input file if it is open */
+  if (fd != -1) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * write_body function.
+ */
+static int write_body(int fd, int64_t flen, const HBOPT *pOpt) {
+  int             status = 1   ;
+  int             use_zc = 0   ;
+  char          * pBuf   = NULL;
+  int             rcount = 0   ;
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+  struct stat     ost          ;
+  int             is_fifo = 0  ;
+  ssize_t         moved  = 0   ;
+  size_t          want   = 0   ;
+/* ================================================================== */
+#endif
+
+  /* Initialize structures */
+#ifdef __linux__
+  memset(&ost, 0, sizeof(ost));
+#endif
+
+  /* Check parameters */
+  if ((flen < 0) || (pOpt == NULL)) {
+    abort();
+  }
+
+#ifndef _WIN32
+/* POSIX-specific --------------------------------------------------- */
+
+  /* If requested, write the body from memory mappings of the file */
+  if (status && pOpt->use_mmap && (flen > 0)) {
+    status = write_mapped(fd, flen);
+    flen = 0;
+  }
+
+/* ================================================================== */
+#endif
+
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+
+  /* Try to move the body without copying -- splice() into a pipe, or
+   * sendfile() into anything else -- and fall back to copying if the
+   * first call reports that the output doesn't support it */
+  if (status && (flen > 0)) {
+    use_zc = 1;
+    if (fstat(STDOUT_FILENO, &ost) == 0) {
+      if (S_ISFIFO(ost.st_mode)) {
+        is_fifo = 1;
+      }
+    }
+  }
+
+  while (status && use_zc && (flen > 0)) {
+    want = ZCCHUNK;
+    if (flen < (int64_t) want) {
+      want = (size_t) flen;
+    }
+
+    if (is_fifo) {
+      moved = splice(fd, NULL, STDOUT_FILENO, NULL, want, SPLICE_F_MORE);
+    } else {
+      moved = sendfile(STDOUT_FILENO, fd, NULL, want);
+    }
+
+    if (moved < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (((errno == EINVAL) || (errno == ENOSYS)) &&
+                  (use_zc == 1)) {
+        use_zc = 0;
+        break;
+      }
+      fprintf(stderr, "Error writing to output!\n");
+      status = 0;
+      break;
+
+    } else if (moved == 0) {
+      fprintf(stderr, "Error reading from file!\n");
+      status = 0;
+      break;
+    }
+
+    use_zc = 2;
+    flen -= (int64_t) moved;
+  }
+
+/* ================================================================== */
+#endif
+
+  /* Next, allocate the I/O buffer if the rest has to be copied */
+  if (status && (!use_zc) && (flen > 0)) {
+    pBuf = (char *) malloc(IOBUFSIZE);
+    if (pBuf == NULL) {
+      fprintf(stderr, "Couldn't allocate I/O buffer!\n");
+      status = 0;
+    }
+  }
+
+  /* Echo whatever is left of the input file to standard output */
+  while (status && (!use_zc) && (flen > 0)) {
+    /* Read as much as fits in the buffer */
+    rcount = IOBUFSIZE;
+    if (flen < (int64_t) rcount) {
+      rcount = (int) flen;
+    }
+
+#ifdef _WIN32
+    rcount = _read(fd, pBuf, (unsigned int) rcount);
+#else
+    rcount = (int) read(fd, pBuf, (size_t) rcount);
+    if ((rcount < 0) && (errno == EINTR)) {
+      continue;
+    }
+#endif
+    if (rcount < 1) {
+      fprintf(stderr, "Error reading from file!\n");
+      status = 0;
+      break;
+    }
+
+    /* Write it out */
+    if (fwrite(pBuf, 1, (size_t) rcount, stdout) != (size_t) rcount) {
+      fprintf(stderr, "Error writing to output!\n");
+      status = 0;
+      break;
+    }
+
+    /* Reduce remaining file length */
+    flen -= (int64_t) rcount;
+  }
+
+  /* Make sure everything is written out */
+  if (status) {
+    if (fflush(stdout)) {
+      fprintf(stderr, "Error writing to output!\n");
+      status = 0;
+    }
+  }
+
+  /* Free the I/O buffer if allocated */
+  if (pBuf != NULL) {
+    free(pBuf);
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * write_mapped function.
+ */
+#ifndef _WIN32
+static int write_mapped(int fd, int64_t flen) {
+  int       status = 1         ;
+  char    * pMap   = MAP_FAILED;
+  size_t    mlen   = 0         ;
+  size_t    done   = 0         ;
+  size_t    want   = 0         ;
+  ssize_t   wcount = 0         ;
+  int64_t   off    = 0         ;
+
+  /* Check parameters */
+  if (flen < 0) {
+    abort();
+  }
+
+  /* Tell the system the whole file will be read sequentially */
+#ifdef POSIX_FADV_SEQUENTIAL
+  (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  /* Go through the file one window at a time */
+  while (status && (off < flen)) {
+    /* Map the current window */
+    mlen = MMAPWINDOW;
+    if (flen - off < (int64_t) mlen) {
+      mlen = (size_t) (flen - off);
+    }
+
+    pMap = (char *) mmap(NULL, mlen, PROT_READ, MAP_SHARED, fd,
+                          (off_t) off);
+    if (pMap == MAP_FAILED) {
+      fprintf(stderr, "Couldn't map input file!\n");
+      status = 0;
+      break;
+    }
+
+    /* Advise sequential access on this window, and ask for the next
+     * window to be read in while this one is written out -- for files
+     * that are already cached, these hints cost next to nothing */
+    (void) madvise(pMap, mlen, MADV_SEQUENTIAL);
+    (void) madvise(pMap, mlen, MADV_WILLNEED);
+#ifdef POSIX_FADV_WILLNEED
+    if (off + (int64_t) mlen < flen) {
+      (void) posix_fadvise(fd, (off_t) (off + (int64_t) mlen),
+                            MMAPWINDOW, POSIX_FADV_WILLNEED);
+    }
+#endif
+
+    /* Write the window out in large slices */
+    done = 0;
+    while (done < mlen) {
+      want = mlen - done;
+      if (want > MMAPSLICE) {
+        want = MMAPSLICE;
+      }
+
+      wcount = write(STDOUT_FILENO, pMap + done, want);
+      if (wcount < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fprintf(stderr, "Error writing to output!\n");
+        status = 0;
+        break;
+      }
+
+      done += (size_t) wcount;
+    }
+
+    /* Release the window and move to the next one */
+    if (munmap(pMap, mlen)) {
+      fprintf(stderr, "Warning:  problem unmapping input file.\n");
+    }
+    pMap = MAP_FAILED;
+
+    off += (int64_t) mlen;
+  }
+
+  /* Return status */
+  return status;
+}
+#endif
+
+/*
+ * str_ieq function.
+ */
+static int str_ieq(const char *pA, const char *pB, size_t n) {
+  int    result = 1;
+  int    ca     = 0;
+  int    cb     = 0;
+  size_t i      = 0;
+
+  /* Check parameters */
+  if ((pA == NULL) || (pB == NULL)) {
+    abort();
+  }
+
+  /* Compare each character, folding ASCII uppercase to lowercase */
+  for(i = 0; i < n; i++) {
+    ca = (int) (unsigned char) pA[i];
+    cb = (int) (unsigned char) pB[i];
+
+    if ((ca >= 'A') && (ca <= 'Z')) {
+      ca = ca - 'A' + 'a';
+    }
+    if ((cb >= 'A') && (cb <= 'Z')) {
+      cb = cb - 'A' + 'a';
+    }
+
+    if (ca != cb) {
+      result = 0;
+      break;
+    }
+
+    if (ca == 0) {
+      break;
+    }
+  }
+
+  /* Return result */
+  return result;
+}
+
+/*
+ * http_field function.
+ */
+static int http_field(
+    const char * pHdr,
+    const char * pName,
+          char * pVal,
+          int    maxval) {
+
+  int          result = 0   ;
+  size_t       nlen   = 0   ;
+  const char * pc     = NULL;
+  const char * pe     = NULL;
+
+  /* Check parameters */
+  if ((pHdr == NULL) || (pName == NULL) || (pVal == NULL) ||
+      (maxval < 1)) {
+    abort();
+  }
+
+  /* Clear the value */
+  pVal[0] = 0;
+  nlen = strlen(pName);
+
+  /* Skip the request line */
+  pc = strchr(pHdr, '\n');
+
+  /* Go through each header line */
+  while ((pc != NULL) && (!result)) {
+    /* Move past the line break to the start of the line */
+    pc++;
+
+    /* Check whether this line is the field we want */
+    if (str_ieq(pc, pName, nlen) && (pc[nlen] == ':')) {
+      /* Found it -- skip leading whitespace in the value */
+      result = 1;
+      pc += nlen + 1;
+      while ((*pc == ' ') || (*pc == '\t')) {
+        pc++;
+      }
+
+      /* Find the end of the value, not including trailing
+       * whitespace */
+      pe = pc;
+      while ((*pe != 0) && (*pe != '\n')) {
+        pe++;
+      }
+      while ((pe > pc) && ((pe[-1] == '\r') || (pe[-1] == ' ') ||
+              (pe[-1] == '\t'))) {
+        pe--;
+      }
+
+      /* Copy the value if it fits */
+      if (pe - pc < maxval) {
+        memcpy(pVal, pc, (size_t) (pe - pc));
+        pVal[pe - pc] = 0;
+      } else {
+        result = -1;
+      }
+
+    } else {
+      /* Not the field we want -- go to the next line */
+      pc = strchr(pc, '\n');
+    }
+  }
+
+  /* Return result */
+  return result;
+}
+
+#ifndef _WIN32
+
+/*
+ * content_type function.
+ */
+static const char *content_type(const char *pName) {
+  /* Table of extensions (including the dot) and content types */
+  static const char *type_table[] = {
+    ".html", "text/html; charset=utf-8",
+    ".htm",  "text/html; charset=utf-8",
+    ".txt",  "text/plain; charset=utf-8",
+    ".log",  "text/plain; charset=utf-8",
+    ".md",   "text/plain; charset=utf-8",
+    ".c",    "text/plain; charset=utf-8",
+    ".h",    "text/plain; charset=utf-8",
+    ".csv",  "text/csv; charset=utf-8",
+    ".css",  "text/css; charset=utf-8",
+    ".js",   "text/javascript; charset=utf-8",
+    ".json", "application/json",
+    ".xml",  "application/xml",
+    ".svg",  "image/svg+xml",
+    ".png",  "image/png",
+    ".jpg",  "image/jpeg",
+    ".jpeg", "image/jpeg",
+    ".gif",  "image/gif",
+    ".webp", "image/webp",
+    ".ico",  "image/x-icon",
+    ".pdf",  "application/pdf",
+    ".wasm", "application/wasm",
+    ".zip",  "application/zip",
+    ".gz",   "application/gzip",
+    ".tgz",  "application/gzip",
+    ".zst",  "application/zstd",
+    ".xz",   "application/x-xz",
+    ".tar",  "application/x-tar",
+    ".iso",  "application/x-iso9660-image",
+    NULL, NULL
+  };
+
+  const char * pExt   = NULL;
+  const char * pType  = "application/octet-stream";
+  size_t       i      = 0;
+
+  /* Check parameters */
+  if (pName == NULL) {
+    abort();
+  }
+
+  /* Find the extension, which must be in the last path component */
+  pExt = strrchr(pName, '.');
+  if (pExt != NULL) {
+    if (strchr(pExt, '/') != NULL) {
+      pExt = NULL;
+    }
+  }
+
+  /* Look it up */
+  if (pExt != NULL) {
+    for(i = 0; type_table[i] != NULL; i += 2) {
+      if (str_ieq(pExt, type_table[i], strlen(type_table[i]) + 1)) {
+        pType = type_table[i + 1];
+        break;
+      }
+    }
+  }
+
+  /* Return the type */
+  return pType;
+}
+
+/*
+ * cache_add function.
+ */
+static int cache_add(
+          HBCACHE     * pc,
+    const char        * pFile,
+    const char        * pUrl,
+    const struct stat * pst) {
+
+  int       status = 1   ;
+  size_t    ncap   = 0   ;
+  HBENTRY * pNew   = NULL;
+  HBENTRY * pe     = NULL;
+  char      fields[MAXFIELDSIZE];
+
+  /* Initialize buffers */
+  memset(fields, 0, MAXFIELDSIZE);
+
+  /* Check parameters */
+  if ((pc == NULL) || (pFile == NULL) || (pUrl == NULL) ||
+      (pst == NULL)) {
+    abort();
+  }
+
+  /* Grow the entry array if it is full */
+  if (status && (pc->count >= pc->cap)) {
+    ncap = (pc->cap > 0) ? (pc->cap * 2) : 64;
+    pNew = (HBENTRY *) realloc(pc->pEnt, ncap * sizeof(HBENTRY));
+    if (pNew == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      status = 0;
+    }
+    if (status) {
+      pc->pEnt = pNew;
+      pc->cap = ncap;
+    }
+  }
+
+  /* Generate the entity tag and the response header fields -- the tag
+   * is derived from the inode number, length, and modification time,
+   * so it changes whenever the file is modified or replaced */
+  if (status) {
+    pe = &(pc->pEnt[pc->count]);
+    memset(pe, 0, sizeof(HBENTRY));
+
+    sprintf(pe->etag, "\"%llx-%llx-%llx\"",
+      (unsigned long long) pst->st_ino,
+      (unsigned long long) pst->st_size,
+      (unsigned long long) pst->st_mtime);
+
+    sprintf(fields,
+      "Content-Type: %s\r\n"
+      "Content-Length: %lld\r\n"
+      "ETag: %s\r\n",
+      content_type(pUrl),
+      (long long) pst->st_size,
+      pe->etag);
+  }
+
+  /* Fill in the new entry */
+  if (status) {
+
+    pe->flen       = (int64_t) pst->st_size;
+    pe->mtime      = (int64_t) pst->st_mtime;
+    pe->pType      = content_type(pUrl);
+    pe->fields_len = strlen(fields);
+    pe->pFile      = (char *) malloc(strlen(pFile) + 1);
+    pe->pUrl       = (char *) malloc(strlen(pUrl) + 1);
+    pe->pFields    = (char *) malloc(pe->fields_len + 1);
+
+    if ((pe->pFile == NULL) || (pe->pUrl == NULL) ||
+        (pe->pFields == NULL)) {
+      fprintf(stderr, "Out of memory!\n");
+      free(pe->pFile);
+      free(pe->pUrl);
+      free(pe->pFields);
+      status = 0;
+    }
+
+    if (status) {
+      strcpy(pe->pFile, pFile);
+      strcpy(pe->pUrl, pUrl);
+      strcpy(pe->pFields, fields);
+      (pc->count)++;
+    }
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * cache_walk function.
+ */
+static int cache_walk(HBCACHE *pc, char *pPath, size_t urloff) {
+  int             status = 1   ;
+  size_t          plen   = 0   ;
+  size_t          nlen   = 0   ;
+  DIR           * pDir   = NULL;
+  struct dirent * pd     = NULL;
+  struct stat     st           ;
+
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+
+  /* Check parameters */
+  if ((pc == NULL) || (pPath == NULL)) {
+    abort();
+  }
+
+  /* Open the directory */
+  plen = strlen(pPath);
+  pDir = opendir((plen > 0) ? pPath : "/");
+  if (pDir == NULL) {
+    fprintf(stderr, "Couldn't open directory %s!\n", pPath);
+    status = 0;
+  }
+
+  /* Go through each entry */
+  while (status) {
+    pd = readdir(pDir);
+    if (pd == NULL) {
+      break;
+    }
+
+    /* Skip hidden entries, including "." and ".." */
+    if (pd->d_name[0] == '.') {
+      continue;
+    }
+
+    /* Extend the path with the entry name */
+    nlen = strlen(pd->d_name);
+    if (plen + 1 + nlen >= MAXPATHSIZE) {
+      fprintf(stderr, "Path too long under %s!\n", pPath);
+      status = 0;
+      break;
+    }
+    pPath[plen] = '/';
+    memcpy(pPath + plen + 1, pd->d_name, nlen + 1);
+
+    /* Files are added and directories are walked; symbolic links to
+     * files are followed, but not symbolic links to directories */
+    if (lstat(pPath, &st) == 0) {
+      if (S_ISLNK(st.st_mode)) {
+        if (stat(pPath, &st) == 0) {
+          if (S_ISREG(st.st_mode)) {
+            status = cache_add(pc, pPath, pPath + urloff, &st);
+          }
+        }
+      } else if (S_ISREG(st.st_mode)) {
+        status = cache_add(pc, pPath, pPath + urloff, &st);
+      } else if (S_ISDIR(st.st_mode)) {
+        status = cache_walk(pc, pPath, urloff);
+      }
+    }
+
+    /* Restore the directory path */
+    pPath[plen] = 0;
+  }
+
+  /* Close the directory */
+  if (pDir != NULL) {
+    closedir(pDir);
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * hash_str function.
+ */
+static uint32_t hash_str(const char *pStr) {
+  uint32_t h = (uint32_t) 2166136261UL;
+
+  /* Check parameters */
+  if (pStr == NULL) {
+    abort();
+  }
+
+  /* Fold in each character */
+  for( ; *pStr != 0; pStr++) {
+    h ^= (uint32_t) (unsigned char) *pStr;
+    h *= (uint32_t) 16777619UL;
+  }
+
+  /* Return hash */
+  return h;
+}
+
+/*
+ * cache_index function.
+ */
+static int cache_index(HBCACHE *pc) {
+  int    status = 1;
+  size_t i      = 0;
+  size_t j      = 0;
+
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+
+  /* Size the table to a power of two that keeps the load factor at
+   * one half or less */
+  pc->tsize = 16;
+  while (pc->tsize < pc->count * 2) {
+    pc->tsize *= 2;
+  }
+
+  pc->pTable = (HBENTRY **) calloc(pc->tsize, sizeof(HBENTRY *));
+  if (pc->pTable == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    status = 0;
+  }
+
+  /* Insert each entry with linear probing */
+  if (status) {
+    for(i = 0; i < pc->count; i++) {
+      pc->pEnt[i].hash = hash_str(pc->pEnt[i].pUrl);
+      j = (size_t) pc->pEnt[i].hash & (pc->tsize - 1);
+      while (pc->pTable[j] != NULL) {
+        j = (j + 1) & (pc->tsize - 1);
+      }
+      pc->pTable[j] = &(pc->pEnt[i]);
+    }
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * cache_link function.
+ */
+static int cache_link(HBCACHE *pc) {
+  int             status = 1   ;
+  int             k      = 0   ;
+  size_t          i      = 0   ;
+  size_t          ulen   = 0   ;
+  HBENTRY       * pe     = NULL;
+  const HBENTRY * pv     = NULL;
+  char          * pUrl   = NULL;
+  char            fields[MAXFIELDSIZE];
+
+  /* Initialize buffers */
+  memset(fields, 0, MAXFIELDSIZE);
+
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+
+  /* Allocate a buffer for building variant URL paths */
+  pUrl = (char *) malloc(MAXPATHSIZE + 8);
+  if (pUrl == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    status = 0;
+  }
+
+  /* Look for the variants of each file */
+  for(i = 0; status && (i < pc->count); i++) {
+    pe = &(pc->pEnt[i]);
+    ulen = strlen(pe->pUrl);
+
+    for(k = 0; k < ENCCOUNT; k++) {
+      /* Find an up-to-date variant with this encoding */
+      memcpy(pUrl, pe->pUrl, ulen);
+      strcpy(pUrl + ulen, enc_table[k].pExt);
+      pv = cache_find(pc, pUrl);
+      if (pv == NULL) {
+        continue;
+      }
+      if (pv->mtime < pe->mtime) {
+        continue;
+      }
+
+      /* Generate the header fields for sending the variant, which
+       * keep the content type of the original file; the entity tag is
+       * the variant file's own tag with the encoding added, so that it
+       * differs from the tag of the variant served by its own name */
+      sprintf(pe->var_etag[k], "%.*s-%s\"",
+        (int) (strlen(pv->etag) - 1),
+        pv->etag,
+        enc_table[k].pToken);
+
+      sprintf(fields,
+        "Content-Type: %s\r\n"
+        "Content-Encoding: %s\r\n"
+        "Content-Length: %lld\r\n"
+        "ETag: %s\r\n"
+        "Vary: Accept-Encoding\r\n",
+        pe->pType,
+        enc_table[k].pToken,
+        (long long) pv->flen,
+        pe->var_etag[k]);
+
+      pe->pVarFields[k] = (char *) malloc(strlen(fields) + 1);
+      if (pe->pVarFields[k] == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        status = 0;
+        break;
+      }
+      strcpy(pe->pVarFields[k], fields);
+      pe->var_len[k] = strlen(fields);
+      pe->pVar[k] = pv;
+      pe->vary = 1;
+    }
+  }
+
+  /* Free the URL buffer */
+  free(pUrl);
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * cache_load function.
+ */
+static int cache_load(HBCACHE *pc, const char *pRoot) {
+  int    status = 1   ;
+  size_t rlen   = 0   ;
+  char * pPath  = NULL;
+
+  /* Check parameters */
+  if ((pc == NULL) || (pRoot == NULL)) {
+    abort();
+  }
+
+  /* Allocate the path buffer */
+  pPath = (char *) malloc(MAXPATHSIZE);
+  if (pPath == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    status = 0;
+  }
+
+  /* Copy the root directory into the path buffer, without trailing
+   * slashes, so that URL paths start right after it */
+  if (status) {
+    rlen = strlen(pRoot);
+    while ((rlen > 1) && (pRoot[rlen - 1] == '/')) {
+      rlen--;
+    }
+    if ((rlen == 1) && (pRoot[0] == '/')) {
+      rlen = 0;
+    }
+    if (rlen >= MAXPATHSIZE) {
+      fprintf(stderr, "Path too long!\n");
+      status = 0;
+    }
+  }
+
+  /* Scan the directory tree and build the lookup structures */
+  if (status) {
+    memcpy(pPath, pRoot, rlen);
+    pPath[rlen] = 0;
+    status = cache_walk(pc, pPath, rlen);
+  }
+
+  if (status) {
+    status = cache_index(pc);
+  }
+
+  if (status) {
+    status = cache_link(pc);
+  }
+
+  /* Free the path buffer */
+  free(pPath);
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * cache_find function.
+ */
+static const HBENTRY *cache_find(const HBCACHE *pc, const char *pUrl) {
+  const HBENTRY * pResult = NULL;
+  uint32_t        h       = 0;
+  size_t          j       = 0;
+
+  /* Check parameters */
+  if ((pc == NULL) || (pUrl == NULL)) {
+    abort();
+  }
+
+  /* Probe the table until the entry or an empty slot is found */
+  if (pc->pTable != NULL) {
+    h = hash_str(pUrl);
+    j = (size_t) h & (pc->tsize - 1);
+    while (pc->pTable[j] != NULL) {
+      if ((pc->pTable[j]->hash == h) &&
+          (strcmp(pc->pTable[j]->pUrl, pUrl) == 0)) {
+        pResult = pc->pTable[j];
+        break;
+      }
+      j = (j + 1) & (pc->tsize - 1);
+    }
+  }
+
+  /* Return result */
+  return pResult;
+}
+
+/*
+ * cache_free function.
+ */
+static void cache_free(HBCACHE *pc) {
+  size_t i = 0;
+  int    k = 0;
+
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+
+  /* Free each entry and then the arrays */
+  for(i = 0; i < pc->count; i++) {
+    free(pc->pEnt[i].pFile);
+    free(pc->pEnt[i].pUrl);
+    free(pc->pEnt[i].pFields);
+    for(k = 0; k < ENCCOUNT; k++) {
+      free(pc->pEnt[i].pVarFields[k]);
+    }
+  }
+
+  free(pc->pEnt);
+  free(pc->pTable);
+  memset(pc, 0, sizeof(HBCACHE));
+}
+
+/*
+ * read_request function.
+ */
+static int read_request(HBREQBUF *pr, char *pHdr) {
+  int     result = 0;
+  int     hlen   = 0;
+  int     lf_flg = 0;
+  ssize_t rcount = 0;
+  char    c      = 0;
+
+  /* Check parameters */
+  if ((pr == NULL) || (pHdr == NULL)) {
+    abort();
+  }
+
+  /* Consume characters until end of header, end of data, or error */
+  while (!result) {
+    /* Refill the buffer if all of it has been consumed */
+    if (pr->pos >= pr->lim) {
+      pr->pos = 0;
+      pr->lim = 0;
+      rcount = read(STDIN_FILENO, pr->buf, MAXREQSIZE);
+      if ((rcount < 0) && (errno == EINTR)) {
+        continue;
+      }
+      if (rcount < 1) {
+        result = ((rcount == 0) && (hlen == 0)) ? 0 : -1;
+        break;
+      }
+      pr->lim = (int) rcount;
+    }
+
+    /* Consume the next character */
+    c = pr->buf[pr->pos];
+    (pr->pos)++;
+
+    if (hlen < MAXREQSIZE - 1) {
+      pHdr[hlen] = c;
+      hlen++;
+    } else {
+      result = -1;
+      break;
+    }
+
+    /* Two LF characters in a row, ignoring CR, end the header; empty
+     * lines before the request line are skipped */
+    if (c == '\r') {
+      continue;
+    } else if (c == '\n') {
+      if (hlen <= 2) {
+        hlen = 0;
+      } else if (lf_flg) {
+        result = 1;
+      } else {
+        lf_flg = 1;
+      }
+    } else {
+      lf_flg = 0;
+    }
+  }
+
+  /* Terminate the header */
+  pHdr[hlen] = 0;
+
+  /* Return result */
+  return result;
+}
+
+/*
+ * http_request function.
+ */
+static int http_request(const char *pHdr, char *pMethod, char *pUrl) {
+  int          result = 0   ;
+  int          len    = 0   ;
+  int          d      = 0   ;
+  int          i      = 0   ;
+  const char * pc     = NULL;
+
+  /* Check parameters */
+  if ((pHdr == NULL) || (pMethod == NULL) || (pUrl == NULL)) {
+    abort();
+  }
+
+  pMethod[0] = 0;
+  pUrl[0] = 0;
+
+  /* Copy the method, which is everything up to the first space */
+  for(pc = pHdr; (*pc > ' ') && (*pc <= '~'); pc++) {
+    if (len >= MAXLINESIZE - 1) {
+      break;
+    }
+    pMethod[len] = *pc;
+    len++;
+  }
+  pMethod[len] = 0;
+
+  /* The method must be followed by a space and then a path */
+  if ((len > 0) && (pc[0] == ' ') && (pc[1] == '/')) {
+    result = 1;
+    pc++;
+  }
+
+  /* Decode the path up to the end of the target or the query string,
+   * refusing encoded null characters */
+  len = 0;
+  while (result && (*pc > ' ') && (*pc <= '~') && (*pc != '?')) {
+    if (len >= MAXPATHSIZE - 1) {
+      result = 0;
+      break;
+    }
+
+    if (*pc == '%') {
+      d = 0;
+      for(i = 1; i <= 2; i++) {
+        d *= 16;
+        if ((pc[i] >= '0') && (pc[i] <= '9')) {
+          d += pc[i] - '0';
+        } else if ((pc[i] >= 'a') && (pc[i] <= 'f')) {
+          d += pc[i] - 'a' + 10;
+        } else if ((pc[i] >= 'A') && (pc[i] <= 'F')) {
+          d += pc[i] - 'A' + 10;
+        } else {
+          result = 0;
+          break;
+        }
+      }
+      if (d == 0) {
+        result = 0;
+      }
+      if (!result) {
+        break;
+      }
+      pUrl[len] = (char) d;
+      pc += 3;
+    } else {
+      pUrl[len] = *pc;
+      pc++;
+    }
+    len++;
+  }
+  pUrl[len] = 0;
+
+  /* Skip the query string */
+  while (result && (*pc > ' ') && (*pc <= '~')) {
+    pc++;
+  }
+
+  /* Decode the version */
+  if (result) {
+    if ((strncmp(pc, " HTTP/", 6) == 0) &&
+        (pc[6] >= '0') && (pc[6] <= '9') && (pc[7] == '.') &&
+        (pc[8] >= '0') && (pc[8] <= '9')) {
+      result = ((pc[6] - '0') * 10) + (pc[8] - '0');
+    } else {
+      result = 0;
+    }
+  }
+
+  /* Return result */
+  return result;
+}
+
+/*
+ * accepts_encoding function.
+ */
+static int accepts_encoding(const char *pVal, const char *pToken) {
+  int          result = 0   ;
+  int          wild   = 0   ;
+  int          zeroq  = 0   ;
+  size_t       tlen   = 0   ;
+  size_t       ilen   = 0   ;
+  const char * pc     = NULL;
+  const char * pi     = NULL;
+
+  /* Check parameters */
+  if ((pVal == NULL) || (pToken == NULL)) {
+    abort();
+  }
+
+  tlen = strlen(pToken);
+
+  /* Go through each comma-separated item */
+  pc = pVal;
+  while (*pc != 0) {
+    /* Skip separators and whitespace */
+    while ((*pc == ',') || (*pc == ' ') || (*pc == '\t')) {
+      pc++;
+    }
+    if (*pc == 0) {
+      break;
+    }
+
+    /* Get the coding token of the item */
+    pi = pc;
+    while ((*pc != 0) && (*pc != ',') && (*pc != ';') && (*pc != ' ') &&
+            (*pc != '\t')) {
+      pc++;
+    }
+    ilen = (size_t) (pc - pi);
+
+    /* Check for a quality value of zero, which refuses the coding */
+    zeroq = 0;
+    while ((*pc != 0) && (*pc != ',')) {
+      if ((*pc == 'q') || (*pc == 'Q')) {
+        if ((pc[1] == '=') && (pc[2] == '0')) {
+          zeroq = 1;
+          pc += 3;
+          if (*pc == '.') {
+            pc++;
+            while (*pc == '0') {
+              pc++;
+            }
+            if ((*pc >= '1') && (*pc <= '9')) {
+              zeroq = 0;
+            }
+          }
+          continue;
+        }
+      }
+      pc++;
+    }
+
+    /* An explicit listing decides right away, while the wildcard only
+     * counts if there is no explicit listing */
+    if ((ilen == tlen) && str_ieq(pi, pToken, tlen)) {
+      result = zeroq ? -1 : 1;
+      break;
+    } else if ((ilen == 1) && (*pi == '*')) {
+      wild = zeroq ? -1 : 1;
+    }
+  }
+
+  /* Fall back to the wildcard */
+  if (result == 0) {
+    result = wild;
+  }
+
+  /* Return result */
+  return (result > 0) ? 1 : 0;
+}
+
+/*
+ * etag_match function.
+ */
+static int etag_match(const char *pList, const char *pTag) {
+  int          result = 0   ;
+  size_t       tlen   = 0   ;
+  const char * pe     = NULL;
+
+  /* Check parameters */
+  if ((pList == NULL) || (pTag == NULL)) {
+    abort();
+  }
+
+  tlen = strlen(pTag);
+
+  /* Go through each element of the list */
+  while ((*pList != 0) && (!result)) {
+    /* Skip separators */
+    if ((*pList == ',') || (*pList == ' ') || (*pList == '\t')) {
+      pList++;
+      continue;
+    }
+
+    /* A wildcard matches any current file */
+    if (*pList == '*') {
+      result = 1;
+      break;
+    }
+
+    /* Ignore the weak indicator */
+    if ((pList[0] == 'W') && (pList[1] == '/')) {
+      pList += 2;
+    }
 
-/*
- * Constant definitions
- * ====================
- */
+    /* Anything else must be a quoted tag; stop at garbage */
+    if (*pList != '"') {
+      break;
+    }
+    pe = strchr(pList + 1, '"');
+    if (pe == NULL) {
+      break;
+    }
+    pe++;
 
-/*
- * The size of the buffer used to transfer data.
- *
- * This is dynamically allocated, so it can be made large.
- */
-#define IOBUFSIZE 4096
+    /* Compare it, quotes included */
+    if (((size_t) (pe - pList) == tlen) &&
+        (memcmp(pList, pTag, tlen) == 0)) {
+      result = 1;
+    }
+    pList = pe;
+  }
 
-/*
- * Local function prototypes
- * =========================
- */
+  /* Return result */
+  return result;
+}
 
 /*
- * Stream the file at the given path to standard output, preceded by
- * HTTP headers.
- *
- * Errors that occur are reported directly to stderr.
- *
- * Parameters:
- *
- *   pPath - pointer to the path to stream
- *
- * Return:
- *
- *   non-zero if successful, zero if failure
- *
- * Faults:
- *
- *   - If pPath is NULL
- *
- * Undefined behavior:
- *
- *   - If the path is not null terminated
+ * compressible function.
  */
-static int httpbin(const char *pPath);
+static int compressible(const char *pType) {
+  int result = 0;
+
+  /* Check parameters */
+  if (pType == NULL) {
+    abort();
+  }
+
+  /* Text, structured text, and uncompressed archives compress well;
+   * most other binary formats are already compressed */
+  if ((strncmp(pType, "text/", 5) == 0) ||
+      (strcmp(pType, "application/json") == 0) ||
+      (strcmp(pType, "application/xml") == 0) ||
+      (strcmp(pType, "image/svg+xml") == 0) ||
+      (strcmp(pType, "application/wasm") == 0) ||
+      (strcmp(pType, "application/x-tar") == 0)) {
+    result = 1;
+  }
+
+  /* Return result */
+  return result;
+}
 
 /*
- * Local function implementations
- * ==============================
+ * run_compressor function.
  */
+static int run_compressor(
+    const HBENC * pEnc,
+    const char  * pSrc,
+    const char  * pDst,
+          int64_t flen) {
+
+  int         result = 1   ;
+  int         wstat  = 0   ;
+  int         ifd    = -1  ;
+  int         ofd    = -1  ;
+  pid_t       pid    = -1  ;
+  char      * pTmp   = NULL;
+  struct stat st           ;
+
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+
+  /* Check parameters */
+  if ((pEnc == NULL) || (pSrc == NULL) || (pDst == NULL)) {
+    abort();
+  }
+
+  /* Build the temporary file name */
+  pTmp = (char *) malloc(strlen(pDst) + 5);
+  if (pTmp == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    result = -1;
+  }
+  if (result > 0) {
+    strcpy(pTmp, pDst);
+    strcat(pTmp, ".tmp");
+  }
+
+  /* Open the input and the temporary output */
+  if (result > 0) {
+    ifd = open(pSrc, O_RDONLY | O_CLOEXEC);
+    ofd = open(pTmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ((ifd == -1) || (ofd == -1)) {
+      fprintf(stderr, "Couldn't open %s for compression!\n", pSrc);
+      result = -1;
+    }
+  }
+
+  /* Run the compression program as a filter from the input to the
+   * temporary output */
+  if (result > 0) {
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == -1) {
+      fprintf(stderr, "Couldn't start compression program!\n");
+      result = -1;
+
+    } else if (pid == 0) {
+      if ((dup2(ifd, STDIN_FILENO) == -1) ||
+          (dup2(ofd, STDOUT_FILENO) == -1)) {
+        _exit(127);
+      }
+      execlp(pEnc->pProg, pEnc->pProg, pEnc->pLevel, "-q", "-c",
+              (char *) NULL);
+      _exit(127);
+    }
+  }
+
+  /* Wait for it to finish */
+  if (result > 0) {
+    while (waitpid(pid, &wstat, 0) == -1) {
+      if (errno != EINTR) {
+        wstat = -1;
+        break;
+      }
+    }
+    if ((wstat != -1) && WIFEXITED(wstat) &&
+        (WEXITSTATUS(wstat) == 127)) {
+      result = -2;
+    } else if ((wstat == -1) || (!WIFEXITED(wstat)) ||
+                (WEXITSTATUS(wstat) != 0)) {
+      result = -1;
+    }
+  }
+
+  /* Keep the result only if it is smaller than the original */
+  if (result > 0) {
+    if (fstat(ofd, &st)) {
+      result = -1;
+    } else if ((int64_t) st.st_size >= flen) {
+      result = 0;
+    }
+  }
+
+  /* Close the files */
+  if (ifd != -1) {
+    close(ifd);
+  }
+  if (ofd != -1) {
+    close(ofd);
+  }
+
+  /* Move the temporary file into place, or remove it */
+  if (pTmp != NULL) {
+    if (result > 0) {
+      if (rename(pTmp, pDst)) {
+        fprintf(stderr, "Couldn't rename %s!\n", pTmp);
+        result = -1;
+      }
+    }
+    if (result < 1) {
+      (void) unlink(pTmp);
+    }
+    free(pTmp);
+  }
+
+  /* Return result */
+  return result;
+}
 
 /*
- * httpbin function.
+ * precompress_dir function.
  */
-static int httpbin(const char *pPath) {
-  int    status = 1   ;
-  FILE * pFile  = NULL;
-  long   flen   = 0   ;
-  char * pBuf   = NULL;
-  long   rcount = 0   ;
+static int precompress_dir(const char *pRoot) {
+  int             status = 1   ;
+  int             k      = 0   ;
+  int             r      = 0   ;
+  int             isvar  = 0   ;
+  int             skip[ENCCOUNT];
+  size_t          i      = 0   ;
+  size_t          ulen   = 0   ;
+  size_t          elen   = 0   ;
+  const HBENTRY * pe     = NULL;
+  char          * pDst   = NULL;
+  HBCACHE         cache        ;
 
-  /* First of all, open the path for reading */
+  /* Initialize structures */
+  memset(&cache, 0, sizeof(HBCACHE));
+  memset(skip, 0, sizeof(skip));
+
+  /* Check parameters */
+  if (pRoot == NULL) {
+    abort();
+  }
+
+  /* Load the tree, which also finds the variants that already exist
+   * and are up to date */
   if (status) {
-    pFile = fopen(pPath, "r");
-    if (pFile == NULL) {
-      fprintf(stderr, "Couldn't open input file!\n");
-      status = 0;
-    }
+    status = cache_load(&cache, pRoot);
   }
 
-  /* Next, get the file size by going to the end of the file and
-   * reading the location -- we're using the classic long method which
-   * may fail due to overflow for files that are multiple gigabytes in
-   * size, but this program isn't designed for transferring such large
-   * files anyway; after performing this operation, rewind back to the
-   * beginning */
+  /* Allocate a buffer for variant paths */
   if (status) {
-    if (fseek(pFile, 0, SEEK_END)) {
-      fprintf(stderr, "Error seeking to end of file!\n");
+    pDst = (char *) malloc(MAXPATHSIZE + 8);
+    if (pDst == NULL) {
+      fprintf(stderr, "Out of memory!\n");
       status = 0;
     }
+  }
 
-    if (status) {
-      flen = ftell(pFile);
-      if (flen < 0) {
-        fprintf(stderr, "Error determining file length!\n");
-        status = 0;
+  /* Go through each file */
+  for(i = 0; status && (i < cache.count); i++) {
+    pe = &(cache.pEnt[i]);
+
+    /* Skip files that aren't worth compressing */
+    if (!compressible(pe->pType)) {
+      continue;
+    }
+
+    /* Skip files that are themselves variants */
+    isvar = 0;
+    ulen = strlen(pe->pUrl);
+    for(k = 0; k < ENCCOUNT; k++) {
+      elen = strlen(enc_table[k].pExt);
+      if ((ulen > elen) &&
+          (strcmp(pe->pUrl + ulen - elen, enc_table[k].pExt) == 0)) {
+        isvar = 1;
       }
     }
+    if (isvar) {
+      continue;
+    }
 
-    if (status) {
-      if (fseek(pFile, 0, SEEK_SET)) {
-        fprintf(stderr, "Error rewinding the file!\n");
-        status = 0;
+    /* Build each missing or stale variant */
+    for(k = 0; k < ENCCOUNT; k++) {
+      if (skip[k] || (pe->pVar[k] != NULL)) {
+        continue;
+      }
+
+      strcpy(pDst, pe->pFile);
+      strcat(pDst, enc_table[k].pExt);
+
+      r = run_compressor(&(enc_table[k]), pe->pFile, pDst, pe->flen);
+      if (r == -2) {
+        fprintf(stderr,
+          "Warning:  %s not available, skipping %s variants.\n",
+          enc_table[k].pProg, enc_table[k].pToken);
+        skip[k] = 1;
+      } else if (r < 0) {
+        fprintf(stderr, "Warning:  couldn't compress %s.\n", pe->pFile);
       }
     }
   }
 
-  /* Next, allocate the I/O buffer */
-  if (status) {
-    pBuf = (char *) malloc(IOBUFSIZE);
-    if (pBuf == NULL) {
-      fprintf(stderr, "Couldn't allocate I/O buffer!\n");
-      status = 0;
+  /* Release everything */
+  free(pDst);
+  cache_free(&cache);
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * write_vec function.
+ */
+static int write_vec(struct iovec *piov, int n) {
+  int     status = 1;
+  int     first  = 0;
+  ssize_t wcount = 0;
+
+  /* Check parameters */
+  if (piov == NULL) {
+    abort();
+  }
+
+  /* Keep writing until all blocks have been written */
+  while (status) {
+    /* Skip blocks that have been completely written */
+    while ((first < n) && (piov[first].iov_len < 1)) {
+      first++;
     }
-    if (status) {
-      memset(pBuf, 0, IOBUFSIZE);
+    if (first >= n) {
+      break;
+    }
+
+    /* Write as much as possible */
+    wcount = writev(STDOUT_FILENO, piov + first, n - first);
+    if (wcount < 0) {
+      if (errno != EINTR) {
+        status = 0;
+      }
+      continue;
+    }
+
+    /* Advance past whatever was written */
+    while ((first < n) && (wcount > 0)) {
+      if ((size_t) wcount >= piov[first].iov_len) {
+        wcount -= (ssize_t) piov[first].iov_len;
+        piov[first].iov_len = 0;
+        first++;
+      } else {
+        piov[first].iov_base = (char *) piov[first].iov_base + wcount;
+        piov[first].iov_len -= (size_t) wcount;
+        wcount = 0;
+      }
     }
   }
 
-  /* Next, transmit the HTTP header, with the file length filled in,
-   * and using CR+LF linebreaks even on platforms where LF-only
-   * linebreaks are customary */
+  /* Return status */
+  return status;
+}
+
+/*
+ * serve_dir function.
+ */
+static int serve_dir(const char *pRoot, const HBOPT *pOpt) {
+  int             status  = 1   ;
+  int             r       = 0   ;
+  int             version = 0   ;
+  int             keep    = 0   ;
+  int             head    = 0   ;
+  int             fd      = -1  ;
+  int             n       = 0   ;
+  int             k       = 0   ;
+  int             enc     = -1  ;
+  int             notmod  = 0   ;
+  const HBENTRY * pe      = NULL;
+  const HBENTRY * pSend   = NULL;
+  const char    * pStatus = NULL;
+  const char    * pConn   = NULL;
+  HBCACHE         cache         ;
+  HBREQBUF      * pr      = NULL;
+  char          * pHdr    = NULL;
+  char          * pUrl    = NULL;
+  char            method[MAXLINESIZE];
+  char            val[MAXLINESIZE];
+  char            tagf[MAXLINESIZE];
+  struct iovec    iov[5]        ;
+
+  /* Initialize structures */
+  memset(&cache, 0, sizeof(HBCACHE));
+  memset(method, 0, MAXLINESIZE);
+  memset(val, 0, MAXLINESIZE);
+  memset(tagf, 0, MAXLINESIZE);
+  memset(iov, 0, sizeof(iov));
+
+  /* Check parameters */
+  if ((pRoot == NULL) || (pOpt == NULL)) {
+    abort();
+  }
+
+  /* Allocate the buffers */
   if (status) {
-    if (printf(
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: application/octet-stream\r\n"
-        "Content-Length: %ld\r\n"
-        "\r\n",
-        flen) < 0) {
-      fprintf(stderr, "Error printing HTTP header!\n");
+    pr    = (HBREQBUF *) calloc(1, sizeof(HBREQBUF));
+    pHdr  = (char *) malloc(MAXREQSIZE);
+    pUrl  = (char *) malloc(MAXPATHSIZE + sizeof(INDEXNAME));
+    if ((pr == NULL) || (pHdr == NULL) || (pUrl == NULL)) {
+      fprintf(stderr, "Out of memory!\n");
       status = 0;
     }
   }
 
-  /* Finally, echo the entire input file to standard output */
+  /* Scan the directory tree and build the header cache */
   if (status) {
-    /* Transfer full buffers until the rest of the file will fit in
-     * a buffer */
-    while(flen > IOBUFSIZE) {
-      /* Read a full buffer */
-      if (fread(pBuf, 1, IOBUFSIZE, pFile) != IOBUFSIZE) {
-        fprintf(stderr, "Error reading from file!\n");
-        status = 0;
-      }
+    status = cache_load(&cache, pRoot);
+  }
 
-      /* Write a full buffer */
-      if (status) {
-        if (fwrite(pBuf, 1, IOBUFSIZE, stdout) != IOBUFSIZE) {
-          fprintf(stderr, "Error writing to output!\n");
-          status = 0;
-        }
+  /* Answer requests until the input ends or the connection is to be
+   * closed */
+  keep = 1;
+  while (status && keep) {
+    /* Read the next request, stopping quietly at the end of input */
+    r = read_request(pr, pHdr);
+    if (r == 0) {
+      break;
+    }
+
+    /* Decode the request */
+    version = 0;
+    if (r > 0) {
+      version = http_request(pHdr, method, pUrl);
+    }
+
+    /* HTTP/1.1 connections stay open unless the client says otherwise,
+     * while anything older is closed after the response */
+    keep = 0;
+    if (version >= 11) {
+      keep = 1;
+      r = http_field(pHdr, "Connection", val, MAXLINESIZE);
+      if ((r != 0) && str_ieq(val, "close", 6)) {
+        keep = 0;
       }
+    }
 
-      /* Break if there was a problem */
-      if (!status) {
-        break;
+    /* Find the file -- directory paths map to their index file */
+    pe = NULL;
+    head = 0;
+    if (version < 1) {
+      pStatus = "HTTP/1.1 400 Bad Request\r\n";
+      keep = 0;
+    } else if ((strcmp(method, "GET") != 0) &&
+                (strcmp(method, "HEAD") != 0)) {
+      pStatus = "HTTP/1.1 405 Method Not Allowed\r\n";
+      keep = 0;
+    } else {
+      if (strcmp(method, "HEAD") == 0) {
+        head = 1;
       }
+      if (pUrl[strlen(pUrl) - 1] == '/') {
+        strcat(pUrl, INDEXNAME);
+      }
+      pe = cache_find(&cache, pUrl);
+      pStatus = (pe != NULL) ? "HTTP/1.1 200 OK\r\n"
+                              : "HTTP/1.1 404 Not Found\r\n";
+    }
 
-      /* Otherwise, reduce remaining file length by IOBUFSIZE */
-      flen -= IOBUFSIZE;
+    /* If the file has precompressed variants, pick the most preferred
+     * one that the client accepts, if any */
+    enc = -1;
+    pSend = pe;
+    if ((pe != NULL) && pe->vary) {
+      r = http_field(pHdr, "Accept-Encoding", val, MAXLINESIZE);
+      for(k = 0; (r > 0) && (k < ENCCOUNT); k++) {
+        if ((pe->pVar[k] != NULL) &&
+            accepts_encoding(val, enc_table[k].pToken)) {
+          enc = k;
+          pSend = pe->pVar[k];
+          break;
+        }
+      }
     }
 
-    /* The rest fits in a single buffer, so transfer all the rest */
-    if (status) {
-      /* Read the rest */
-      if (fread(pBuf, 1, (size_t) flen, pFile) != (size_t) flen) {
-        fprintf(stderr, "Error reading from file!\n");
-        status = 0;
+    /* If the client already has the current version of what would be
+     * sent, answer with just its entity tag (and Vary, which must match
+     * the full response); an If-None-Match value too long for the
+     * buffer is ignored */
+    notmod = 0;
+    if (pe != NULL) {
+      r = http_field(pHdr, "If-None-Match", val, MAXLINESIZE);
+      if ((r > 0) &&
+          etag_match(val, (enc >= 0) ? pe->var_etag[enc] : pe->etag)) {
+        notmod = 1;
+        pStatus = "HTTP/1.1 304 Not Modified\r\n";
+        sprintf(tagf, "ETag: %s\r\n%s",
+          (enc >= 0) ? pe->var_etag[enc] : pe->etag,
+          pe->vary ? "Vary: Accept-Encoding\r\n" : "");
       }
+    }
 
-      /* Write the rest */
-      if (status) {
-        if (fwrite(pBuf, 1, (size_t) flen, stdout) !=
-            (size_t) flen) {
-          fprintf(stderr, "Error writing to output!\n");
-          status = 0;
-        }
+    /* Open the file before committing to a successful response */
+    fd = -1;
+    if ((pSend != NULL) && (!head) && (!notmod)) {
+      fd = open(pSend->pFile, O_RDONLY | O_CLOEXEC);
+      if (fd == -1) {
+        pe = NULL;
+        pSend = NULL;
+        pStatus = "HTTP/1.1 404 Not Found\r\n";
       }
     }
+
+    /* Send the status line, the cached header fields (or an empty body
+     * for errors), and the connection field in a single write */
+    pConn = keep ? "\r\n" : "Connection: close\r\n\r\n";
+
+    n = 0;
+    iov[n].iov_base = (void *) pStatus;
+    iov[n].iov_len  = strlen(pStatus);
+    n++;
+    if (notmod) {
+      iov[n].iov_base = (void *) tagf;
+      iov[n].iov_len  = strlen(tagf);
+    } else if ((pe != NULL) && (enc >= 0)) {
+      iov[n].iov_base = (void *) pe->pVarFields[enc];
+      iov[n].iov_len  = pe->var_len[enc];
+    } else if (pe != NULL) {
+      iov[n].iov_base = (void *) pe->pFields;
+      iov[n].iov_len  = pe->fields_len;
+    } else {
+      iov[n].iov_base = (void *) "Content-Length: 0\r\n";
+      iov[n].iov_len  = strlen((const char *) iov[n].iov_base);
+    }
+    n++;
+    if ((pe != NULL) && pe->vary && (enc < 0) && (!notmod)) {
+      iov[n].iov_base = (void *) "Vary: Accept-Encoding\r\n";
+      iov[n].iov_len  = strlen((const char *) iov[n].iov_base);
+      n++;
+    }
+    iov[n].iov_base = (void *) pConn;
+    iov[n].iov_len  = strlen(pConn);
+    n++;
+
+    if (!write_vec(iov, n)) {
+      fprintf(stderr, "Error writing to output!\n");
+      status = 0;
+    }
+
+    /* Send the body */
+    if (status && (fd != -1)) {
+      status = write_body(fd, pSend->flen, pOpt);
+    }
+
+    if (fd != -1) {
+      close(fd);
+      fd = -1;
+    }
   }
 
-  /* Free the I/O buffer if allocated */
-  if (pBuf != NULL) {
-    free(pBuf);
+  /* Release everything */
+  cache_free(&cache);
+  free(pr);
+  free(pHdr);
+  free(pUrl);
+
+  /* Return status */
+  return status;
+}
+
+#endif
+
+/*
+ * parse_option function.
+ */
+static int parse_option(const char *pArg, HBOPT *pOpt) {
+  int          status = 1   ;
+  size_t       nlen   = 0   ;
+  const char * pVal   = NULL;
+
+  /* Check parameters */
+  if ((pArg == NULL) || (pOpt == NULL)) {
+    abort();
   }
 
-  /* Close the input file if it is open */
-  if (pFile != NULL) {
-    fclose(pFile);
+  /* Skip the leading dashes and split off the value, if any */
+  if (strncmp(pArg, "--", 2) == 0) {
+    pArg += 2;
+  }
+
+  pVal = strchr(pArg, '=');
+  if (pVal != NULL) {
+    nlen = (size_t) (pVal - pArg);
+    pVal++;
+  } else {
+    nlen = strlen(pArg);
+  }
+
+  /* Interpret the option */
+  if ((nlen == 4) && (strncmp(pArg, "mmap", nlen) == 0)) {
+    /* --mmap takes no value and is only available on POSIX */
+    if (pVal != NULL) {
+      fprintf(stderr, "Option --mmap does not take a value!\n");
+      status = 0;
+    }
+#ifdef _WIN32
+    if (status) {
+      fprintf(stderr, "Option --mmap not supported on this platform!\n");
+      status = 0;
+    }
+#endif
+    if (status) {
+      pOpt->use_mmap = 1;
+    }
+
+  } else if ((nlen == 11) && (strncmp(pArg, "precompress", nlen) == 0)) {
+    /* --precompress takes no value */
+    if (pVal != NULL) {
+      fprintf(stderr, "Option --precompress does not take a value!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->precompress = 1;
+    }
+
+  } else if ((nlen == 3) && (strncmp(pArg, "dir", nlen) == 0)) {
+    /* --dir requires a path and is only available on POSIX */
+    if ((pVal == NULL) || (*pVal == 0)) {
+      fprintf(stderr, "Option --dir requires a path!\n");
+      status = 0;
+    }
+#ifdef _WIN32
+    if (status) {
+      fprintf(stderr, "Option --dir not supported on this platform!\n");
+      status = 0;
+    }
+#endif
+    if (status) {
+      pOpt->pDir = pVal;
+    }
+
+  } else {
+    fprintf(stderr, "Unrecognized option!\n");
+    status = 0;
   }
 
   /* Return status */
@@ -238,14 +2846,21 @@ static int httpbin(const char *pPath) {
  * argc must be the number of arguments, and argv must be an array of
  * pointers to the null-terminated arguments.
  *
- * There must be exactly two arguments.  The first argument is the
- * conventional module name, and the second argument is the command-line
- * parameter.  The first argument is ignored.  The second argument must
- * be a path to the file to stream.
+ * Apart from "--" options, there must be exactly two arguments.  The
+ * first argument is the conventional module name, and the second
+ * argument is the command-line parameter.  The first argument is
+ * ignored.  The second argument must be a path to the file to stream.
  *
- * If there are not exactly two arguments, an error message is displayed
- * and the function returns failure.  Otherwise, the function calls
- * through to httpbin with the argument from the command line.
+ * Any argument that begins with "--" is an option rather than the
+ * parameter described above.  Options may appear anywhere after the
+ * module name.
+ *
+ * If there are not exactly two arguments, or an option can't be
+ * parsed, an error message is displayed and the function returns
+ * failure.  Otherwise, the function calls through to httpbin with the
+ * argument from the command line.  In directory mode (the --dir
+ * option), the file path must be left out, and the function calls
+ * through to serve_dir instead.
  *
  * If less than two arguments are passed (that is, no extra command line
  * parameters), a short help screen is displayed and the program returns
@@ -269,7 +2884,7 @@ static int httpbin(const char *pPath) {
  *
  *   - If argv is NULL
  *
- *   - If argc is two and the second parameter is NULL
+ *   - If any parameter after the first is NULL
  *
  * Undefined behavior:
  *
@@ -279,7 +2894,13 @@ static int httpbin(const char *pPath) {
  *     by argc
  */
 int main(int argc, char *argv[]) {
-  int status = 1;
+  int          status =  1  ;
+  int          i      =  0  ;
+  const char * pPath  = NULL;
+  HBOPT        opt          ;
+
+  /* Initialize structures */
+  memset(&opt, 0, sizeof(HBOPT));
 
   /* Check parameters */
   if (argv == NULL) {
@@ -291,35 +2912,100 @@ int main(int argc, char *argv[]) {
    */
   if (argc < 2) {
     fprintf(stderr,
-"Syntax: httpbin [path]\n"
+"Syntax: httpbin [options] [path]\n"
 "\n"
 "path is the path to the file to stream in an HTTP\n"
 "response container.\n"
 "\n"
+"Options are:\n"
+"\n"
+"  --mmap     - write the file from a memory mapping\n"
+"  --dir=path - serve a directory tree over stdin/stdout\n"
+"               (no file path is given in this case)\n"
+"  --precompress - with --dir, build .gz/.zst variants\n"
+"                  of compressible files and exit\n"
+"\n"
 "See source file for further information.\n"
     );
     status = 0;
   }
 
-  /* Fail if not exactly two arguments */
+  /* Separate the options from the path, interpreting each option as it
+   * is encountered */
   if (status) {
-    if (argc != 2) {
+    for(i = 1; i < argc; i++) {
+      /* Check argument */
+      if (argv[i] == NULL) {
+        abort();
+      }
+
+      /* Options begin with "--" and the rest is the path */
+      if (strncmp(argv[i], "--", 2) == 0) {
+        status = parse_option(argv[i], &opt);
+      } else if (pPath == NULL) {
+        pPath = argv[i];
+      } else {
+        pPath = NULL;
+        break;
+      }
+
+      /* Break if there was an error */
+      if (!status) {
+        break;
+      }
+    }
+  }
+
+  /* Fail if not exactly one parameter, or in directory mode, if there
+   * are any parameters */
+  if (status && (opt.pDir == NULL)) {
+    if (pPath == NULL) {
       fprintf(stderr, "Expecting one additional argument!\n");
       status = 0;
     }
+  } else if (status) {
+    if ((pPath != NULL) || (i < argc)) {
+      fprintf(stderr, "No file path allowed with --dir!\n");
+      status = 0;
+    }
+  }
+
+#ifdef _WIN32
+/* WIN32-specific --------------------------------------------------- */
+
+  /* (Windows only) Set stdout to binary mode to disable automatic
+   * CR+LF translation */
+  if (status) {
+    if (_setmode(_fileno(stdout), _O_BINARY) == -1) {
+      status = 0;
+    }
   }
 
-  /* Check argument */
+/* ================================================================== */
+#endif
+
+  /* --precompress only makes sense for a directory tree */
   if (status) {
-    if (argv[1] == NULL) {
-      abort();
+    if (opt.precompress && (opt.pDir == NULL)) {
+      fprintf(stderr, "Option --precompress requires --dir!\n");
+      status = 0;
     }
   }
 
   /* Call function */
+#ifndef _WIN32
+  if (status && (opt.pDir != NULL) && opt.precompress) {
+    status = precompress_dir(opt.pDir);
+  } else if (status && (opt.pDir != NULL)) {
+    status = serve_dir(opt.pDir, &opt);
+  } else if (status) {
+    status = httpbin(pPath, &opt);
+  }
+#else
   if (status) {
-    status = httpbin(argv[1]);
+    status = httpbin(pPath, &opt);
   }
+#endif
 
   /* Invert status and return it */
   if (status) {
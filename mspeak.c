@@ -54,7 +54,9 @@
  *     instance must be in "server" mode.
  *
  * (4) The "server" instance must be started and listening for a
- *     connection before the "client" instance is started.
+ *     connection before the "client" instance is started, unless the
+ *     "client" instance is given --retry, in which case the order
+ *     doesn't matter.
  *
  * (5) The "server" instance must be listening on an IP address and port
  *     that is valid on the server machine and accessible to the
@@ -98,18 +100,431 @@
  * it won't correctly handle an HTTP/0.9 request.  See the application
  * "httpbin" for a way to frame binary data within an HTTP response.
  *
+ * In fake HTTP read mode ("srh"), the server will read the HTTP request
+ * header from the client in the same way, but then it will interpret
+ * the "Content-Length" or "Transfer-Encoding: chunked" header fields to
+ * determine the extent of the request body.  The request body is
+ * written to standard output, and then a minimal "200 OK" response is
+ * sent back to the client.  This allows a file to be uploaded to mspeak
+ * with a simple HTTP client, for example:
+ *
+ *   curl -T myfile.bin http://192.168.1.10:2000/
+ *
+ * The method and path of the request are ignored.  Note that the body
+ * is written exactly as it is received, so an upload from an HTML form
+ * in a web browser will be written with its multipart framing intact.
+ * If the client asks for "Expect: 100-continue", an interim "100
+ * Continue" response is sent so that the client doesn't pause before
+ * sending the body.
+ *
+ * Options that adjust the operation of mspeak may be given as extra
+ * arguments beginning with "--", anywhere on the command line after
+ * the program name.  Options that take a value are written as
+ * "--name=value".  The following options are available:
+ *
+ *   --chunked
+ *
+ *     Only allowed in fake HTTP write mode ("swh").  Instead of
+ *     expecting standard input to begin with HTTP headers, mspeak
+ *     generates the response header itself and sends standard input as
+ *     the response body with "Transfer-Encoding: chunked" framing.  The
+ *     length of the data doesn't need to be known in advance, so this
+ *     can serve data that is still being generated, for example:
+ *
+ *       tar -c mydir | mspeak swh 192.168.1.10:2000 --chunked
+ *
+ *     HTTP/1.0 clients don't understand chunked framing, so they get
+ *     the data unframed, with the end of the data marked by closing the
+ *     connection.
+ *
+ *   --file=path
+ *
+ *     Only allowed in fake HTTP write mode ("swh"), and can't be
+ *     combined with --chunked.  Instead of reading standard input,
+ *     mspeak serves the given file, generating the HTTP response header
+ *     itself.  This does the same thing as piping the output of
+ *     "httpbin" into mspeak, but on Linux the file is transmitted with
+ *     sendfile() so that its contents are never copied through user
+ *     space, which matters for very large files:
+ *
+ *       mspeak swh 192.168.1.10:2000 --file=myfile.bin
+ *
+ *     The response carries an entity tag (ETag) built from the file's
+ *     inode number, length, and modification time.  A client that sends
+ *     the tag back in an If-None-Match field gets a short 304 (Not
+ *     Modified) response instead of the whole file, so clients that
+ *     poll for the file only transfer it when it has changed.
+ *
+ *   --retry=SECONDS
+ *
+ *     Only allowed in client mode, or with --relay (see below).  If
+ *     the server isn't there yet, keep trying to connect for up to the
+ *     given number of seconds instead of failing right away, so that
+ *     the server and client can be started at the same time.  The
+ *     attempts start 10 milliseconds apart, and the delay doubles after
+ *     each one up to a quarter of a second, so the client connects very
+ *     soon after the server is ready:
+ *
+ *       mspeak cr 192.168.1.10:2000 --retry=30 > myfile.bin
+ *
+ *   --fastopen
+ *
+ *     Only allowed with TCP addresses.  Save a round trip on short
+ *     transfers with TCP Fast Open, where the system supports it and
+ *     has it enabled (on Linux, the net.ipv4.tcp_fastopen setting must
+ *     include 1 for clients and 2 for servers).  A server accepts data
+ *     sent along with the client's handshake.  A client in write mode
+ *     sends its first data with the handshake once it has connected to
+ *     the server before; in read mode the client has nothing to send,
+ *     so this has no effect.  Since a client using Fast Open only finds
+ *     out whether the server is there when it sends, the client doesn't
+ *     use it when the server's name has several addresses to try or
+ *     when --retry is given.  On Linux, a server in read mode or fake
+ *     HTTP mode, where the client speaks first, also isn't woken to
+ *     accept the connection until the client's first data has arrived.
+ *
+ *       mspeak sr 192.168.1.10:2000 --fastopen > key.pem
+ *       mspeak cw 192.168.1.10:2000 --fastopen < key.pem
+ *
+ *   --sndbuf=SIZE
+ *   --rcvbuf=SIZE
+ *
+ *     Only allowed with TCP addresses.  Set the size of the socket's
+ *     send or receive buffer, in bytes, instead of leaving it to the
+ *     system.  SIZE may end in K, M, or G for kibibytes, mebibytes, or
+ *     gibibytes, up to 1G.  On paths with a large bandwidth-delay
+ *     product, such as long-distance links, the default buffers can
+ *     hold the transfer to a fraction of the available bandwidth; the
+ *     buffers then need to be at least the rate times the round-trip
+ *     time.  The system may limit the size (on Linux, to the
+ *     net.core.wmem_max and net.core.rmem_max settings), in which case
+ *     a warning is given.  Setting a size turns off the automatic
+ *     tuning that some systems do for that buffer.
+ *
+ *       mspeak sw 192.168.1.10:2000 --sndbuf=16M < myfile.bin
+ *
+ *   --congestion=NAME
+ *
+ *     (Linux and some BSDs only) Only allowed with TCP addresses.  Use
+ *     the named TCP congestion control algorithm for the connection,
+ *     such as bbr or cubic, which must be available on the system.
+ *     This matters most on the sending side:
+ *
+ *       mspeak sw 192.168.1.10:2000 --congestion=bbr < myfile.bin
+ *
+ *   --notsent-lowat=SIZE
+ *
+ *     (Linux and macOS only) Only allowed with TCP addresses.  Limit
+ *     how much data that hasn't been sent yet may wait in the send
+ *     buffer to SIZE bytes, which may end in K, M, or G as with
+ *     --sndbuf.  This keeps a large send buffer from also becoming a
+ *     large queue of unsent data, at little cost to throughput.
+ *
+ *   --autobuf=RATE
+ *
+ *     (Linux only) Only allowed with TCP addresses.  Size the socket
+ *     buffers for a target transfer rate of RATE bytes per second,
+ *     which may end in K, M, or G as with --sndbuf.  Once the
+ *     connection is up, the round-trip time measured for it is read
+ *     back from the system, and the send buffer of a writer or the
+ *     receive buffer of a reader is grown to twice the rate times the
+ *     round-trip time, up to 1G.  A buffer is never shrunk, and one
+ *     given with --sndbuf or --rcvbuf is left alone.  Setting a size
+ *     turns off the system's own autotuning of the buffer, so if the
+ *     size, after the system's limit on sizes set by programs
+ *     (net.core.wmem_max or rmem_max), is no larger than autotuning
+ *     can reach (the last value of net.ipv4.tcp_wmem or tcp_rmem),
+ *     the buffer is left to autotuning, with a warning.  Give it to
+ *     both instances, so that both ends of the connection keep up:
+ *
+ *       mspeak sw 192.168.1.10:2000 --autobuf=100M < myfile.bin
+ *       mspeak cr 192.168.1.10:2000 --autobuf=100M > myfile.bin
+ *
+ *   --rate=RATE[:BURST]
+ *
+ *     Not allowed with --pass-fd or a "shm:" address.  Hold the
+ *     transfer through the socket to at most RATE bytes per second, so
+ *     that a long transfer can run alongside other traffic on a shared
+ *     link without swamping it.  RATE and BURST may end in K, M, or G
+ *     as with --sndbuf.  The rate is enforced with a token bucket of
+ *     BURST bytes (a tenth of a second's worth if not given): up to
+ *     that much may be moved at once, after which the transfer is
+ *     held back to the rate.  A writer over TCP on Linux asks the
+ *     system to pace the connection itself (SO_MAX_PACING_RATE),
+ *     which spreads the packets out evenly and works best with the
+ *     "fq" queueing discipline, and the burst doesn't apply then.
+ *     Otherwise, and for a reader, whose pace holds back the writer
+ *     through TCP flow control, mspeak sleeps between socket
+ *     operations as needed:
+ *
+ *       mspeak sw 192.168.1.10:2000 --rate=20M < backup.tar
+ *
+ *     (POSIX only) The rate can be changed while the transfer runs,
+ *     without restarting it: sending the process SIGUSR1 doubles the
+ *     rate and SIGUSR2 halves it.  Each change is reported on stderr,
+ *     and a burst size that wasn't given follows the rate.
+ *
+ *   --control=PATH
+ *
+ *     (POSIX only) Not allowed with --pass-fd or a "shm:" address.
+ *     Listen on a Unix domain socket at PATH for commands changing the
+ *     --rate while the transfer runs, replacing any socket left behind
+ *     at the path and removing it at the end.  This also works without
+ *     --rate, starting out with no limit.  Each command is a line of
+ *     text, and gets a line in reply: "ok rate=RATE burst=BURST" with
+ *     the settings now in force (a rate of zero meaning no limit), or
+ *     "error" and the reason.  The commands are "rate RATE[:BURST]" to
+ *     set a new rate, "rate off" to remove the limit, "up" and "down"
+ *     to double and halve the rate as with the signals, and "status"
+ *     to just reply:
+ *
+ *       mspeak sw 192.168.1.10:2000 --rate=5M --control=/run/xfer.ctl
+ *       echo "rate 50M" | socat - UNIX-CONNECT:/run/xfer.ctl
+ *
+ *   --progress
+ *
+ *     Report the progress of the transfer on stderr once a second:
+ *     the amount of data moved so far, the rate over the last second
+ *     and on average, and, when the amount of data to move is known,
+ *     the percentage done and the estimated time left.  The amount is
+ *     known to a writer whose standard input is a regular file or that
+ *     was given --file, and to a fake HTTP reader receiving a request
+ *     with a Content-Length.  The report is printed by its own thread,
+ *     so the transfer itself only has to keep a running count, and it
+ *     can be left on for large production transfers.  Reporting starts
+ *     once the connection is up, so that time spent waiting for the
+ *     other side isn't counted in the rates.  A final report is
+ *     printed at the end.  With --pass-fd, only the reader reports
+ *     progress, since the writer doesn't see the data:
+ *
+ *       mspeak sw 192.168.1.10:2000 --progress < myfile.bin
+ *
+ *   --stats-json[=PATH]
+ *
+ *     At the end, write statistics about the transfer as a JSON object
+ *     to the given file, replacing it, or to stderr if no path is
+ *     given.  They are written whether or not the transfer succeeded,
+ *     with "ok" telling which.  "bytes" and "seconds" are the amount of
+ *     data moved and the wall-clock time.  "io" breaks down the I/O
+ *     operations into reading the input ("input"), sending on the
+ *     socket ("send"), receiving from the socket ("recv"), writing the
+ *     output ("output"), and waiting, with a "shm:" address for the
+ *     other side, or for --rate ("wait").  Each gives the number of
+ *     calls, the bytes they moved, the seconds spent in them, and
+ *     "sizes", the number of calls that moved up to each power-of-two
+ *     number of bytes (calls that moved nothing aren't included).
+ *     Comparing the seconds shows which side of the pipeline holds the
+ *     transfer up: a writer that spends most of its time in "send" is
+ *     limited by the network or the reader, one that spends it in
+ *     "input" by whatever feeds it.  Where the splice() or sendfile()
+ *     system calls are used, a single call may move data from the
+ *     socket straight to the output or from the file straight to the
+ *     socket, and is counted as "recv" or "send".  (Linux only) With a
+ *     TCP address, "tcp" holds the state of the connection at the end
+ *     of the transfer from TCP_INFO: the smoothed round-trip time and
+ *     its variation in microseconds, the total number of retransmitted
+ *     segments, the congestion window in segments, and the segment
+ *     size:
+ *
+ *       mspeak sw 192.168.1.10:2000 --stats-json=xfer.json < myfile.bin
+ *
+ *     "phases" gives the time in microseconds that each phase of
+ *     setting up the transfer took, as for --phase-hist below, leaving
+ *     out phases that didn't happen.
+ *
+ *   --phase-hist=PATH
+ *
+ *     At the end, add the time that each phase of the transfer took to
+ *     a histogram kept in the given file, creating it if needed, so
+ *     that the distribution builds up over many runs and the source of
+ *     slow setups can be found.  The phases are "lookup", translating
+ *     the address; "connect", connecting to the server (including any
+ *     --retry attempts) for a client, or waiting for the client to
+ *     connect for a server; "header", reading the request header in
+ *     fake HTTP mode; "first_byte", from then until the first data has
+ *     been sent or written out; and "total", the whole run.  Each line
+ *     of the file holds a phase name, an upper bound in microseconds
+ *     that is a power of two, and the number of runs in which the
+ *     phase took more than half that bound and at most the bound.
+ *     Lines starting with # are comments.  On POSIX, the file is
+ *     locked while it is updated, so concurrent runs can share it:
+ *
+ *       mspeak cr 192.168.1.10:2000 --phase-hist=setup.hist > out.bin
+ *
+ *   --source=PATTERN
+ *   --bytes=SIZE
+ *
+ *     Only allowed in write mode, and not with --file or --pass-fd.
+ *     Instead of reading standard input, send SIZE bytes of data
+ *     generated in memory (1G if --bytes isn't given), so that the
+ *     transfer can be measured without disks or other programs getting
+ *     in the way.  SIZE may end in K, M, or G as with --sndbuf.
+ *     PATTERN is "zero" for zero bytes, "random" for random bytes, or
+ *     a whole number from 0 to 100 giving the percentage of each 4K
+ *     block that is random, the rest being zero, which controls how
+ *     well the data compresses.  The data is generated once and then
+ *     copied out as needed.
+ *
+ *   --sink
+ *
+ *     Only allowed in read mode.  Throw the data away instead of
+ *     writing it to standard output, the counterpart of --source:
+ *
+ *       mspeak sr 127.0.0.1:2000 --sink
+ *       mspeak cw 127.0.0.1:2000 --source=random --bytes=4G
+ *
+ *   --bufsize=SIZE
+ *
+ *     Move data in blocks of SIZE bytes instead of 4K, up to 64M, which
+ *     may end in K, M, or G as with --sndbuf.  This is the amount read
+ *     from standard input and sent at a time by a writer, the amount
+ *     received and written out at a time by a reader when the data is
+ *     copied, and with a "shm:" address the largest amount moved
+ *     through the ring at a time (1M by default).
+ *
+ *   --bench
+ *
+ *     (POSIX only) Given instead of the flags and address.  Measure the
+ *     throughput of mspeak itself over loopback, with no disks or
+ *     other programs involved.  For each transport (TCP on 127.0.0.1,
+ *     a Unix domain socket, and on Linux shared memory) and each of
+ *     the block sizes 4K, 64K, and 1M (or just the one given with
+ *     --bufsize), a reader given --sink is started as a separate
+ *     process, and a writer given --source sends it the data.  The
+ *     results are written to standard output as CSV, with the columns
+ *     engine, bufsize, bytes, seconds, and mib_per_s, one line per
+ *     transfer.  --source and --bytes select the data (zero bytes by
+ *     default), and the TCP tuning options apply to the TCP
+ *     transfers:
+ *
+ *       mspeak --bench --bytes=4G > bench.csv
+ *
+ *   --duplex
+ *
+ *     Not allowed in fake HTTP mode, or with --pass-fd, a "shm:"
+ *     address, --fanout, --relay, --rate, --control, or --bench.  Send
+ *     standard input and write the data received to standard output at
+ *     the same time, over the one connection, in either read or write
+ *     mode, so that mspeak can carry a request/response protocol.
+ *     Receiving runs in a thread of its own.  When standard input ends,
+ *     only the sending direction of the connection is shut down, so
+ *     that the other side sees the end of the data while its own data
+ *     keeps coming, and the instance finishes once the other side has
+ *     ended its data too.  --source and --sink apply to the sending and
+ *     receiving directions as usual, and the amount of data reported by
+ *     --progress and --stats-json is the total of both directions:
+ *
+ *       mspeak sr 0.0.0.0:2000 --duplex < reply.bin > request.bin
+ *       mspeak cw 192.168.1.10:2000 --duplex < request.bin > reply.bin
+ *
+ *   --relay=ADDR
+ *
+ *     Only allowed in read mode, and not with fake HTTP, --pass-fd, or
+ *     a "shm:" address.  Besides writing the data received to standard
+ *     output, forward it to another instance in server read mode at
+ *     ADDR, given as for client mode (a "unix:" path on POSIX too), so
+ *     that instances can be chained to pass the same data along a line
+ *     of machines, each link carrying it once.  The data is forwarded
+ *     as it arrives, so pushing it down the whole chain takes about as
+ *     long as a single transfer.  The connection to ADDR is made once
+ *     the connection for receiving is up, and --retry applies to it,
+ *     also in server mode, so that the instances can be started in any
+ *     order.  On Linux, the data is teed from the socket to standard
+ *     output and the next instance inside the kernel, without being
+ *     copied into user space, where standard output allows it.  With
+ *     --sink, the data is only forwarded.  If the next instance goes
+ *     away, a warning is given and the data is still written out here,
+ *     but the transfer counts as failed:
+ *
+ *       mspeak sr 0.0.0.0:2000 --relay=node3:2000 --retry=60 > disk.img
+ *
+ *   --fanout=N
+ *   --slow=POLICY
+ *
+ *     (POSIX only) Only allowed in server write mode, and not with fake
+ *     HTTP, --pass-fd, or a "shm:" address.  Wait for N readers (up to
+ *     1024) to connect instead of one, then send all of them the same
+ *     data, so that one copy of standard input (or the --source data)
+ *     can be distributed to many machines at once.  Each block of
+ *     input is read only once, into a queue of 16M (or twice the block
+ *     size, if larger) shared by the readers, and each reader is sent
+ *     the data from its own place in the queue as fast as it takes it.
+ *     POLICY says what happens to a reader that falls behind: with
+ *     "stall" (the default), input is only read when there is room in
+ *     the queue, so the slowest reader sets the pace for all of them;
+ *     with "drop", a reader that falls a whole queue behind the
+ *     fastest one is disconnected with a warning, and the rest carry
+ *     on.  A reader whose connection fails is disconnected in either
+ *     case.  A disconnected reader's connection is reset, so that it
+ *     fails rather than ending early with part of the data, and the
+ *     writer fails if any reader didn't get all the data.
+ *     --rate limits how fast the input is read, and so the rate of
+ *     each reader:
+ *
+ *       mspeak sw 0.0.0.0:2000 --fanout=3 --slow=drop < disk.img
+ *       mspeak cr 192.168.1.10:2000 > disk.img
+ *
+ *   --pass-fd
+ *
+ *     (POSIX only) Only allowed with a "unix:" address (see below) and
+ *     not in fake HTTP mode, and must be given to both instances.
+ *     Instead of sending the data through the socket, the writer passes
+ *     its standard input itself to the reader, which then reads the
+ *     data directly.  On Linux, the data is spliced from the writer's
+ *     input to the reader's output without ever being copied through
+ *     the socket or user space.  The writer waits until the reader has
+ *     finished, and fails if the reader did.  The reader announces
+ *     itself first, and if it wasn't given --pass-fd, the writer fails
+ *     after five seconds without passing anything, so that the reader
+ *     doesn't get stray data:
+ *
+ *       tar -c mydir | mspeak sw unix:/run/xfer.sock --pass-fd
+ *       mspeak cr unix:/run/xfer.sock --pass-fd > mydir.tar
+ *
  * The 192.168.1.10:32 in the syntax example above is the IPv4 address
- * (192.168.1.10) and port (32).  Platform-specific translation services
- * are used to convert the given address into an address and port
- * combination to be used for the actual connection.  In "server" mode,
- * the address and port indicate the address and port on the local
- * machine to listen for incoming connections on, while in "client"
- * mode, the address and port indicate the address and port on the
- * remote machine to connect to.
- *
- * The server will accept exactly one connection from a client.  To stop
- * the server from waiting for a client, use a system-specific break,
- * such as CTRL+C.
+ * (192.168.1.10) and port (32).  IPv6 addresses are given in square
+ * brackets, such as [2001:db8::10]:32, since they contain colons
+ * themselves.  A host name may be given instead of an address, such as
+ * example.com:32.  Platform-specific translation services are used to
+ * convert the given address into an address and port combination to be
+ * used for the actual connection.  In "server" mode, the address and
+ * port indicate the address and port on the local machine to listen for
+ * incoming connections on, while in "client" mode, the address and port
+ * indicate the address and port on the remote machine to connect to.
+ * A server listening on the IPv6 wildcard address [::] accepts both
+ * IPv6 and IPv4 clients where the system allows it.  A server given a
+ * host name listens on its most preferred address.  A client given a
+ * host name with several addresses races connection attempts to them,
+ * alternating between IPv6 and IPv4 and starting a new attempt every
+ * 250 milliseconds while earlier ones are pending, and uses whichever
+ * connects first, so that unreachable addresses don't hold it up.
+ *
+ * (POSIX only) When both instances are on the same machine, an address
+ * of the form unix:/path/to/socket uses a Unix domain socket at that
+ * path instead of TCP, which avoids the overhead of the TCP loopback
+ * path.  The server creates the socket, replacing any socket left
+ * behind at the path, and removes it once a client has connected.
+ *
+ * (Linux only) For the fastest transfers between instances on the same
+ * machine, an address of the form shm:name uses a named shared-memory
+ * segment instead of a socket.  The server creates the segment,
+ * replacing any segment left behind under the same name, and removes
+ * the name once a client has attached.  The writer reads standard
+ * input straight into a ring buffer in the segment and the reader
+ * writes standard output straight from it, so the data never passes
+ * through a socket.  The two sides coordinate through the segment
+ * itself, only making system calls to sleep and wake each other when
+ * one of them has to wait.  The writer waits until the reader has
+ * finished, and fails if the reader did.  Fake HTTP mode isn't
+ * possible with this kind of address:
+ *
+ *   tar -c mydir | mspeak sw shm:xfer
+ *   mspeak cr shm:xfer > mydir.tar
+ *
+ * The server will accept exactly one connection from a client (or N
+ * with --fanout).  To stop the server from waiting for a client, use a
+ * system-specific break, such as CTRL+C.  The client fails if the
+ * server isn't accepting connections yet, unless --retry is given.
  *
  * The instance that is in "read" mode will output all the data it
  * receives to standard output.  This can be piped into a file, or piped
@@ -128,10 +543,32 @@
  * must be built in ANSI mode for console use.  (Unicode wouldn't add
  * anything, as no functions with functional Unicode alternatives are
  * used.)  64-bit builds should be supported, despite all the "32"
- * labels everywhere.
+ * labels everywhere.  On Linux with a C library older than glibc 2.34,
+ * librt must be linked in (-lrt) for the shared-memory functions.  On
+ * POSIX, the program must be built with -pthread for the --progress
+ * reporter thread and the other threads it may start.
  */
 
+/*
+ * On Linux, request the GNU extensions so that the zero-copy system
+ * calls such as splice() are declared.  On POSIX, request 64-bit file
+ * offsets so that files over 2 GiB work on 32-bit builds.  This must
+ * come before any include.
+ */
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#ifndef _WIN32
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#endif
+
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -142,6 +579,10 @@
 #ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #endif
 
@@ -149,8 +590,33 @@
  * POSIX-specific includes
  */
 #ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Linux-specific includes
+ */
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #endif
 
 /*
@@ -184,307 +650,7781 @@
 #define ASCII_LF (0x0A)
 
 /*
- * The maximum size, including terminating null, that a numeric address
- * and port combination may be in characters.
+ * The maximum size, including terminating null, that an address and
+ * port combination may be in characters.  This has room for the
+ * longest possible host name.
  */
-#define MAXAPSIZE 32
+#define MAXAPSIZE 272
 
 /*
- * Local function prototypes
- * =========================
+ * The maximum number of addresses of a host name that a client tries
+ * to connect to.
  */
+#define MAXRACE 16
 
 /*
- * Look up a given numeric address string and map it to a socket
- * address.
- *
- * This only supports IPv4 addresses (with port).  If successful, the
- * decoded IPv4 address will be written into pAddr.  If failure, the
- * state of *pAddr is undefined.  Note that sockaddr_in is a type of
- * sockaddr that can be used with socket functions.
- *
- * On POSIX, this uses getaddrinfo with NI_NUMERICHOST used to limit
- * addresses to numeric type.  On Windows, this uses inet_addr to decode
- * the IP address and then manually decodes the port and fills in the
- * address structure.  If multiple possible addresses are returned by
- * getaddrinfo on POSIX, only the first matching address is used.
- *
- * Parameters:
- *
- *   pAddrStr - the string to translate
- *
- *   pAddr - the socket address to receive the decoded address if
- *   successful
- *
- * Return:
- *
- *   non-zero if successful, zero if error
- *
- * Faults:
- *
- *   - If pAddrStr or pAddr is NULL
- *
- * Undefined behavior:
- *
- *   - If the address string is not null terminated
- *
- *   - If on Windows the Windows Sockets DLL hasn't been loaded with
- *     WSAStartup
+ * The delay in milliseconds before a client starts connecting to the
+ * next address of a host name while earlier attempts are still
+ * pending.
  */
-static int lookup(const char *pAddrStr, struct sockaddr_in *pAddr);
+#define RACEDELAY 250
 
 /*
- * Perform the "mspeak" function.
- *
- * The server flag indicates whether to operate in server mode or client
- * mode.  The write flag indicates whether to operate in write mode or
- * read mode.  pAddrStr points to a string specifying an IPv4 address
- * and port.  See the program documentation at the top of this source
- * file for further information.
- *
- * The fh flag indicates that "fake HTTP" mode should be activated, as
- * described in the program documentation at the top of this source
- * file.  It may only be used when the server and write flags are set.
- *
- * Errors will be reported directly using stderr.  Data will be read or
- * written with standard input and standard output when appropriate.
- *
- * Parameters:
- *
- *   server - non-zero if in server mode, zero if in client mode
- *
- *   write - non-zero if in write mode, zero if in read mode
- *
- *   fh - non-zero if in fake HTTP mode, zero if not
- *
- *   pAddrStr - pointer to the IPv4 address/port string
- *
- * Return:
- *
- *   non-zero if success, zero if failure
- *
- * Faults:
- *
- *   - If pAddrStr is NULL
- *
- *   - If fake HTTP mode is specified when in client or reading mode
+ * The first and the longest delay in milliseconds between connection
+ * attempts of a client given --retry.  The delay doubles after each
+ * failed attempt up to the longest delay.
+ */
+#define RETRYMIN 10
+#define RETRYMAX 250
+
+/*
+ * The largest number of seconds that may be given to --retry.
+ */
+#define MAXRETRY 86400
+
+/*
+ * The length of the queue of connections that have completed a TCP
+ * Fast Open handshake but haven't been accepted yet, for a server given
+ * --fastopen.
+ */
+#define FASTOPENQLEN 16
+
+/*
+ * (Linux only) How many seconds a server given --fastopen lets a
+ * connection wait for the client's first data before accepting it
+ * anyway.
+ */
+#define DEFERSECS 10
+
+/*
+ * The largest size that may be given to --sndbuf, --rcvbuf, and
+ * --notsent-lowat, and that --autobuf grows a buffer to.
+ */
+#define MAXSOCKBUF (1024 * 1024 * 1024)
+
+/*
+ * The largest rate in bytes per second that may be given to --autobuf.
+ */
+#define MAXRATE (INT64_C(1) << 40)
+
+/*
+ * How much data --rate lets through at once if no burst size is given,
+ * as the number of milliseconds' worth at the rate.
+ */
+#define RATEBURSTMS 100
+
+/*
+ * The longest the --rate pacer sleeps in one go, in milliseconds, so
+ * that a change of rate at run time takes effect quickly.
+ */
+#define RATESLICEMS 100
+
+/*
+ * How many milliseconds apart --progress reports are printed.
+ */
+#define PROGINTERVAL 1000
+
+/*
+ * (POSIX only) How long in milliseconds a --pass-fd writer waits for
+ * the reader to announce that it was given --pass-fd too.
+ */
+#define PASSFDWAITMS 5000
+
+/*
+ * The kinds of I/O operation counted for --stats-json -- reading the
+ * input (standard input or the --file file), sending on the socket,
+ * receiving from the socket, writing standard output, and waiting for
+ * the other side of a shared-memory ring or for the --rate pacer.
+ */
+#define STAT_INPUT  0
+#define STAT_SEND   1
+#define STAT_RECV   2
+#define STAT_OUTPUT 3
+#define STAT_WAIT   4
+#define STATCOUNT   5
+
+/*
+ * The number of power-of-two size buckets in the --stats-json size
+ * distributions; the last bucket also takes anything bigger.
+ */
+#define STATBUCKETS 32
+
+/*
+ * The phases of a run timed for --stats-json and --phase-hist --
+ * translating the address, connecting or waiting for a connection,
+ * reading the fake HTTP request header, getting the first data moved,
+ * and the whole run.
+ */
+#define PHASE_LOOKUP  0
+#define PHASE_CONNECT 1
+#define PHASE_HEADER  2
+#define PHASE_FIRST   3
+#define PHASE_TOTAL   4
+#define PHASECOUNT    5
+
+/*
+ * The number of power-of-two microsecond buckets in a --phase-hist
+ * histogram; the last bucket also takes anything longer.
+ */
+#define PHASEBUCKETS 40
+
+/*
+ * The largest block size that may be given to --bufsize.
+ */
+#define MAXBUFSIZE (64 * 1024 * 1024)
+
+/*
+ * How much data --source sends if --bytes isn't given.
+ */
+#define SRCBYTES (INT64_C(1) << 30)
+
+/*
+ * The size of the pattern that --source generates and copies out, and
+ * of the blocks within it that --source=PERCENT makes partly random.
+ */
+#define SRCPATSIZE (1024 * 1024)
+#define SRCBLOCK 4096
+
+/*
+ * How many seconds the writer in a --bench transfer keeps trying to
+ * reach the reader while it starts up.
+ */
+#define BENCHRETRY 10
+
+/*
+ * (POSIX only) The size in bytes of the queue that --fanout shares
+ * between the readers, and the most readers allowed.
+ */
+#define FANQUEUE (16 * 1024 * 1024)
+#define MAXFANOUT 1024
+
+/*
+ * (Linux only) The size in bytes of the data ring in a shared-memory
+ * segment.  This must be a power of two.  It is kept well below the
+ * 64 MiB that container runtimes typically give /dev/shm.
+ */
+#define SHMRINGSIZE (16 * 1024 * 1024)
+
+/*
+ * (Linux only) The size in bytes of the control block at the start of
+ * a shared-memory segment, which comes before the data ring.
+ */
+#define SHMHDRSIZE 4096
+
+/*
+ * (Linux only) The most bytes moved into or out of the shared-memory
+ * ring by a single system call, so that the other side can start on
+ * the data early.
+ */
+#define SHMCHUNK (1024 * 1024)
+
+/*
+ * (Linux only) How long in milliseconds to sleep on a futex before
+ * checking whether the other process still exists.
+ */
+#define SHMPOLLMS 1000
+
+/*
+ * (Linux only) Value identifying an initialized shared-memory segment.
+ */
+#define SHMMAGIC (0x4d53524eU)
+
+/*
+ * The maximum size in bytes of an HTTP request header that is retained
+ * in fake HTTP mode, including a terminating null.
  *
- * Undefined behavior:
+ * Fake HTTP read mode needs to look at the header fields, so it fails
+ * on requests with larger headers.  Fake HTTP write mode only scans
+ * the header for its end, so it just ignores anything past this limit.
+ */
+#define MAXHDRSIZE 16384
+
+/*
+ * The maximum size, including terminating null, of a single HTTP
+ * header field value or chunk size line that will be decoded.
+ */
+#define MAXLINESIZE 256
+
+/*
+ * (Linux only) The maximum number of bytes requested in each splice()
+ * call, which is also the capacity requested for the intermediate pipe
+ * when splicing from the socket into a file.
+ */
+#define SPLICECHUNK (1024 * 1024)
+
+/*
+ * The size in bytes of the data in each chunk of a chunked HTTP
+ * response, except for the last chunk, which may be smaller.
  *
- *   - If the address string is not null terminated
+ * Each chunk costs a few bytes of framing, so this is made large.  The
+ * buffer is dynamically allocated.
+ */
+#define HTTPCHUNKSIZE (256 * 1024)
+
+/*
+ * The size in bytes of the buffer used to send a file in fake HTTP
+ * write mode when the file can't be transmitted with sendfile().
  *
- *   - If on Windows the Windows Sockets DLL hasn't been loaded with
- *     WSAStartup
+ * This is dynamically allocated, so it can be made large.
  */
-static int mspeak(int server, int write, int fh, const char *pAddrStr);
+#define FILEBUFSIZE (256 * 1024)
 
 /*
- * Local function implementations
- * ==============================
+ * (Linux only) The maximum number of bytes requested in each
+ * sendfile() call.
  */
+#define SENDFILECHUNK (16 * 1024 * 1024)
 
 /*
- * lookup function.
+ * The maximum number of separate blocks that may be passed to send_vec
+ * in a single call.
+ */
+#define MAXVEC 8
+
+/*
+ * Types
+ * =====
+ */
+
+/*
+ * Platform-specific socket handle type, and the value that indicates
+ * no socket.
  */
-static int lookup(const char *pAddrStr, struct sockaddr_in *pAddr) {
-  int          status          = 1   ;
-  const char * pc              = NULL;
-  char *       pw              = NULL;
-  char         abuf[MAXAPSIZE]       ;
-  char         pbuf[MAXAPSIZE]       ;
 #ifdef _WIN32
-/* WIN32-specific --------------------------------------------------- */
-  unsigned long  ulipaddr = 0;
-  unsigned short usport   = 0;
-  int            c        = 0;
-/* ================================================================== */
-#endif
-#ifndef _WIN32
-/* POSIX-specific --------------------------------------------------- */
-  struct addrinfo   hint       ;
-  struct addrinfo * pi   = NULL;
-/* ================================================================== */
+typedef SOCKET MSOCKET;
+#define MSOCKET_NONE INVALID_SOCKET
+#else
+typedef int MSOCKET;
+#define MSOCKET_NONE (-1)
 #endif
 
-#ifndef _WIN32
-/* POSIX-specific --------------------------------------------------- */
+/*
+ * Buffered reader for a connected socket.
+ *
+ * This is used in fake HTTP mode, where the request header has to be
+ * scanned before the body (if any) is passed through.  Bytes that have
+ * been received from the socket but not consumed yet are held in pBuf
+ * from index pos (inclusive) to index lim (exclusive).  cap is the
+ * total size of pBuf.  If sink is set, data passed through is thrown
+ * away instead of being written to standard output.
+ */
+typedef struct {
+  MSOCKET   sock;
+  char    * pBuf;
+  int       cap;
+  int       pos;
+  int       lim;
+  int       sink;
+} CONNBUF;
 
-  /* Initialize structures */
-  memset(&hint, 0, sizeof(struct addrinfo));
+/*
+ * State shared with the receiving thread of --duplex.
+ *
+ * pc is the buffered reader that the thread transfers to standard
+ * output, and status receives non-zero if it succeeded.
+ */
+typedef struct {
+  CONNBUF * pc;
+  int       status;
+} MSDUPLEX;
+
+/*
+ * A block of data to send as part of a vectored send.
+ */
+typedef struct {
+  const char * pData;
+  size_t       len;
+} MSVEC;
+
+/*
+ * Optional settings given on the command line with "--" options.
+ *
+ * See the program documentation at the top of this source file for the
+ * meaning of each option.  A structure that is cleared to zero holds
+ * the default settings.
+ */
+typedef struct {
+  /* --chunked given -- generate the response header in fake HTTP write
+   * mode and frame standard input with chunked transfer encoding */
+  int chunked;
+
+  /* --file=path given -- path to the file to serve in fake HTTP write
+   * mode, or NULL if not given */
+  const char *pFile;
+
+  /* --pass-fd given -- over a Unix domain socket, pass the writer's
+   * standard input to the reader instead of sending the data */
+  int pass_fd;
+
+  /* --retry=SECONDS given -- how many seconds a client, or a --relay
+   * connection, keeps trying to connect to a server that isn't there
+   * yet, or zero to try once */
+  int retry;
+
+  /* --fastopen given -- use TCP Fast Open, and on a server that
+   * expects the client to speak first, deferred accept */
+  int fastopen;
+
+  /* --sndbuf=SIZE and --rcvbuf=SIZE given -- the socket buffer sizes to
+   * set, or zero to leave them to the system */
+  int sndbuf;
+  int rcvbuf;
+
+  /* --congestion=NAME given -- the congestion control algorithm to
+   * use, or NULL if not given */
+  const char *pCongestion;
+
+  /* --notsent-lowat=SIZE given -- the limit on unsent data in the send
+   * buffer, or zero to leave it to the system */
+  int notsent_lowat;
+
+  /* --autobuf=RATE given -- the transfer rate in bytes per second to
+   * size the socket buffers for, or zero if not given */
+  int64_t autobuf;
+
+  /* --rate=RATE[:BURST] given -- the most bytes per second to move
+   * through the socket, or zero for no limit, and the most to let
+   * through at once, or zero for the default */
+  int64_t rate;
+  int64_t burst;
+
+  /* --control=PATH given -- the Unix domain socket to take commands
+   * changing the rate on, or NULL if not given */
+  const char *pControl;
+
+  /* --progress given -- report progress on stderr */
+  int progress;
+
+  /* --stats-json given -- write transfer statistics at the end, to the
+   * file at pStats, or to stderr if pStats is NULL */
+  int stats;
+  const char *pStats;
+
+  /* --phase-hist=PATH given -- the histogram file to add the phase
+   * times to, or NULL if not given */
+  const char *pPhaseHist;
+
+  /* --source=PATTERN given -- send generated data instead of standard
+   * input, srcrandom percent of each block being random, and --bytes
+   * giving how much, or zero for the default */
+  int source;
+  int srcrandom;
+  int64_t bytes;
+
+  /* --sink given -- throw away the data instead of writing it to
+   * standard output */
+  int sink;
+
+  /* --bufsize=SIZE given -- the block size to move data in, or zero
+   * for the default */
+  int bufsize;
+
+  /* --bench given -- run the loopback benchmark */
+  int bench;
+
+  /* --fanout=N given -- the number of readers to send the data to, or
+   * zero for the usual single connection, and --slow=drop given --
+   * disconnect readers that fall behind instead of waiting for them */
+  int fanout;
+  int drop;
+
+  /* --relay=ADDR given -- the address of the next instance to forward
+   * the received data to, or NULL if not given */
+  const char *pRelay;
+
+  /* --duplex given -- send standard input and receive to standard
+   * output at the same time */
+  int duplex;
+} MSOPT;
+
+/*
+ * Statistics for one kind of I/O operation, for --stats-json.
+ *
+ * sizes[i] counts the calls that moved more than 2^(i-1) and at most
+ * 2^i bytes.
+ */
+typedef struct {
+  int64_t calls;
+  int64_t bytes;
+  int64_t ns;
+  int64_t sizes[STATBUCKETS];
+} MSSTATIO;
+
+/*
+ * Statistics about the transfer, for --stats-json.
+ *
+ * These are only collected if on is set, and only by the thread doing
+ * the transfer.  start is the now_ns reading when the transfer started.
+ * If tcp is set, the remaining fields hold the state of the TCP
+ * connection at the end of the transfer.
+ */
+typedef struct {
+  int      on;
+  int64_t  start;
+  MSSTATIO io[STATCOUNT];
+  int      tcp;
+  uint32_t rtt;
+  uint32_t rttvar;
+  uint32_t retrans;
+  uint32_t cwnd;
+  uint32_t mss;
+} MSSTATS;
+
+/*
+ * Timing of the phases of a run.
+ *
+ * mark is the now_ns reading when the current phase started, and
+ * start when the run started.  ns holds the nanoseconds each phase
+ * took, or -1 if it didn't happen.  first is set once the first data
+ * has been moved, with an atomic exchange, so that with --duplex only
+ * one of the two transfer threads ends the first-byte phase.
+ */
+typedef struct {
+  int64_t mark;
+  int64_t start;
+  int64_t ns[PHASECOUNT];
+  int     first;
+} MSPHASES;
+
+/*
+ * State of the data generated for --source.
+ *
+ * pPat holds SRCPATSIZE bytes of the pattern, which is copied out
+ * starting at offset pos until left bytes have been produced.
+ */
+typedef struct {
+  int     on;
+  char  * pPat;
+  size_t  pos;
+  int64_t left;
+} MSSOURCE;
+
+/*
+ * State of the token bucket that paces the transfer for --rate.
+ *
+ * rate is the bytes per second allowed, or zero if not pacing, and
+ * burst the size of the bucket, which follows the rate if autoburst is
+ * set.  tokens is how many bytes may be moved right now, which goes
+ * negative when a block larger than that has been moved, and last is
+ * the now_ns reading when it was last brought up to date.  If kernel
+ * is set, the system paces the sends itself.  sock is the connected
+ * socket, and sys is set if the system may be asked to pace it.
+ *
+ * On POSIX, the rate may be changed while the transfer runs by the
+ * control thread, which holds the lock while doing so and stores rate,
+ * burst, and kernel with atomic stores.  The transfer thread only
+ * reads those, and owns tokens and last.
+ */
+typedef struct {
+  int64_t         rate;
+  int64_t         burst;
+  int             autoburst;
+  double          tokens;
+  int64_t         last;
+  int             kernel;
+  MSOCKET         sock;
+  int             sys;
+#ifndef _WIN32
+  pthread_mutex_t lock;
+#endif
+} MSPACER;
+
+#ifndef _WIN32
+
+/*
+ * (POSIX only) State of the control thread, which changes the --rate
+ * at run time on SIGUSR1 and SIGUSR2 and for commands on the --control
+ * socket.
+ *
+ * Nothing else is valid unless on is set.  wake is a pipe that the
+ * signal handler and ctl_stop() write a byte to for the thread: '+'
+ * and '-' for the signals and 'q' to stop.  lsock is the listening
+ * control socket at pPath, or -1 if there is none.  running is set
+ * while the thread runs.
+ */
+typedef struct {
+  int          on;
+  int          running;
+  int          wake[2];
+  int          lsock;
+  const char * pPath;
+  pthread_t    thread;
+} MSCTL;
+
+#endif
+
+/*
+ * Progress of the transfer, shared between the thread doing the
+ * transfer and the --progress reporter thread.
+ *
+ * moved counts the bytes of data moved so far, and total is the
+ * number of bytes expected, or -1 if not known.  moved is added to
+ * atomically, since with --duplex there is a transfer thread for each
+ * direction; once per block, this costs next to nothing.  For the same
+ * reason, prog_add sets the first-data flag in MSPHASES with an atomic
+ * exchange, so that only one thread ends that phase.  total is
+ * only changed by the transfer thread, and the reporter only reads
+ * both.  armed is set by prog_start when reporting was asked for, and
+ * the reporter is only started, by prog_begin, once the connection is
+ * up.  stop is protected by the lock on POSIX, and is an event on
+ * Windows.  The rest belongs to the reporter.
+ */
+typedef struct {
+  int64_t         moved;
+  int64_t         total;
+  int             armed;
+  int             running;
+  int             tty;
+  int64_t         start;
+  int64_t         last;
+  int64_t         lastmoved;
+#ifdef _WIN32
+  HANDLE          thread;
+  HANDLE          stop;
+#else
+  int             stop;
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  wake;
+#endif
+} MSPROG;
+
+#ifdef __linux__
+
+/*
+ * (Linux only) Control block at the start of a shared-memory segment.
+ *
+ * The writer owns head, dseq, and eof, and the reader owns tail, sseq,
+ * and done.  head and tail count all the bytes ever written into and
+ * read out of the ring, so the ring holds head - tail bytes starting at
+ * offset tail modulo the ring size.  dseq and sseq are bumped every
+ * time head and tail move, and are the futex words that each side
+ * sleeps on; cwait and pwait tell the other side that a wakeup is
+ * needed, so that no system call is made while both sides are busy.
+ * The two halves are on separate cache lines so that the writer and
+ * reader don't fight over them.
+ *
+ * attached is zero until a client claims the segment, which it does by
+ * changing it to 2 with a compare-and-swap, so that only one of several
+ * clients racing on the same name gets it.  The client sets it to 1
+ * once cpid is filled in.
+ */
+typedef struct {
+  /* Set up by the server */
+  uint32_t magic;
+  uint32_t attached;
+  int32_t  spid;
+  int32_t  cpid;
+  uint64_t size;
+
+  /* Writer side -- eof is 1 at the end of the data, 2 if the writer
+   * failed */
+  uint64_t head __attribute__((aligned(64)));
+  uint32_t dseq;
+  uint32_t eof;
+  uint32_t pwait;
+
+  /* Reader side -- done is 1 if the reader finished successfully, 2
+   * if it failed */
+  uint64_t tail __attribute__((aligned(64)));
+  uint32_t sseq;
+  uint32_t done;
+  uint32_t cwait;
+} SHMHDR;
+
+#endif
+
+/*
+ * Local data
+ * ==========
+ */
+
+/*
+ * The progress of the transfer, counted whether or not --progress was
+ * given.
+ */
+static MSPROG progress;
+
+/*
+ * The statistics of the transfer, collected only if --stats-json was
+ * given.
+ */
+static MSSTATS stats;
+
+/*
+ * The phase timing of the run.
+ */
+static MSPHASES phases;
+
+/*
+ * The data generator for --source.
+ */
+static MSSOURCE source;
+
+/*
+ * The pacer for --rate.
+ */
+static MSPACER pacer;
+
+#ifndef _WIN32
+
+/*
+ * (POSIX only) The control thread for changing the --rate.
+ */
+static MSCTL control;
+
+#endif
+
+/*
+ * The names of the phases, as used in --stats-json and --phase-hist.
+ */
+static const char * const phase_names[PHASECOUNT] = {
+  "lookup", "connect", "header", "first_byte", "total"
+};
+
+/*
+ * Local function prototypes
+ * =========================
+ */
+
+/*
+ * Look up a given address string and map it to a list of socket
+ * addresses.
+ *
+ * The string is a host name or IPv4 address with port, such as
+ * "192.168.1.10:32" or "example.com:32", or an IPv6 address in square
+ * brackets with port, such as "[2001:db8::10]:32".  The port must be
+ * numeric.  If successful, *ppList receives the list of addresses from
+ * getaddrinfo, in the system's order of preference, which the caller
+ * must release with freeaddrinfo.  If failure, *ppList is set to NULL.
+ *
+ * This uses getaddrinfo on Windows as well as on POSIX, so host names
+ * are resolved with the system resolver.  Both IPv4 and IPv6 addresses
+ * are returned.
+ *
+ * Parameters:
+ *
+ *   pAddrStr - the string to translate
+ *
+ *   ppList - receives the address list if successful
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if error
+ *
+ * Faults:
+ *
+ *   - If pAddrStr or ppList is NULL
+ *
+ * Undefined behavior:
+ *
+ *   - If the address string is not null terminated
+ *
+ *   - If on Windows the Windows Sockets DLL hasn't been loaded with
+ *     WSAStartup
+ */
+static int lookup(const char *pAddrStr, struct addrinfo **ppList);
+
+/*
+ * Return a monotonic clock reading in milliseconds.
+ *
+ * The zero point is arbitrary, so only differences between readings
+ * are meaningful.
+ *
+ * Return:
+ *
+ *   the current clock reading
+ */
+static int64_t now_ms(void);
+
+/*
+ * Read a monotonic clock with high resolution.
+ *
+ * Return:
+ *
+ *   the current clock reading in nanoseconds
+ */
+static int64_t now_ns(void);
+
+/*
+ * Start timing an I/O operation for --stats-json.
+ *
+ * Return:
+ *
+ *   the now_ns reading to pass to stat_end, or zero if statistics
+ *   aren't being collected
+ */
+static int64_t stat_begin(void);
+
+/*
+ * Finish timing an I/O operation for --stats-json.
+ *
+ * Parameters:
+ *
+ *   kind - the kind of operation, one of the STAT_ constants
+ *
+ *   t0 - the reading returned by stat_begin
+ *
+ *   n - the number of bytes the operation moved, or zero or negative
+ *   if it moved nothing
+ */
+static void stat_end(int kind, int64_t t0, int64_t n);
+
+/*
+ * (Linux only) Record the state of a TCP connection for --stats-json.
+ *
+ * Does nothing if statistics aren't being collected, or on other
+ * platforms.
+ *
+ * Parameters:
+ *
+ *   sock - the connected socket
+ */
+static void stat_tcp(MSOCKET sock);
+
+/*
+ * Write the --stats-json statistics.
+ *
+ * Failing to write them is only a warning.
+ *
+ * Parameters:
+ *
+ *   pPath - the file to write, or NULL for stderr
+ *
+ *   pMode - the mode flags given on the command line
+ *
+ *   ok - non-zero if the transfer succeeded
+ *
+ * Faults:
+ *
+ *   - If pMode is NULL
+ */
+static void stat_write(const char *pPath, const char *pMode, int ok);
+
+/*
+ * Set up the data generator for --source.
+ *
+ * Does nothing if --source wasn't given.  Errors are reported directly
+ * to stderr.
+ *
+ * Parameters:
+ *
+ *   pOpt - the option settings
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pOpt is NULL
+ */
+static int src_start(const MSOPT *pOpt);
+
+/*
+ * Release the data generator for --source.
+ */
+static void src_stop(void);
+
+/*
+ * Read the next block of input for a writer -- standard input, or the
+ * data generated for --source.
+ *
+ * As with fread(), a short count means that the input has ended or
+ * there was an error reading standard input.
+ *
+ * Parameters:
+ *
+ *   pBuf - the buffer to receive the data
+ *
+ *   len - the size of the buffer
+ *
+ * Return:
+ *
+ *   the number of bytes read
+ *
+ * Faults:
+ *
+ *   - If pBuf is NULL
+ */
+static size_t in_read(char *pBuf, size_t len);
+
+/*
+ * Set up the pacer for --rate from the option settings, before the
+ * transfer starts.
+ *
+ * Parameters:
+ *
+ *   pOpt - the option settings
+ *
+ * Faults:
+ *
+ *   - If pOpt is NULL
+ */
+static void rate_init(const MSOPT *pOpt);
+
+/*
+ * Start pacing the transfer once the socket is connected.
+ *
+ * A TCP writer asks the system to pace the connection, where
+ * SO_MAX_PACING_RATE is available, and only paces the sends itself if
+ * that fails.  Otherwise, rate_pace() sleeps as needed to hold the
+ * transfer to the rate.  This is done whenever the rate changes, too.
+ *
+ * Parameters:
+ *
+ *   sock - the connected socket
+ *
+ *   write - non-zero for a writer, zero for a reader
+ *
+ *   tcp - non-zero if sock is a TCP socket
+ */
+static void rate_start(MSOCKET sock, int write, int tcp);
+
+/*
+ * Stop pacing through the socket before it is closed, so that a --rate
+ * change from the control socket no longer touches it.
+ */
+static void rate_stop(void);
+
+/*
+ * Ask the system to pace the sends at the current rate, or to stop
+ * pacing them if there is no rate, where the socket allows it, and note
+ * whether it does.  Must be called with the pacer lock held on POSIX.
+ */
+static void rate_apply(void);
+
+/*
+ * Change the --rate while the transfer runs, reporting the new rate on
+ * stderr.
+ *
+ * Parameters:
+ *
+ *   rate - the new rate in bytes per second, or zero for no limit
+ *
+ *   burst - the new burst size, or zero to follow the rate
+ */
+static void rate_set(int64_t rate, int64_t burst);
+
+/*
+ * Double or halve the --rate while the transfer runs.
+ *
+ * Parameters:
+ *
+ *   up - non-zero to double the rate, zero to halve it
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if there is no rate to change
+ */
+static int rate_step(int up);
+
+/*
+ * Account for data moved through the socket under --rate, sleeping
+ * until the token bucket has refilled if more than the burst has been
+ * moved ahead of the rate.
+ *
+ * This does nothing unless there is a rate and this program is pacing
+ * the transfer itself.  Long sleeps are taken in slices of at most
+ * RATESLICEMS, so that a change of rate takes effect quickly.
+ *
+ * Parameters:
+ *
+ *   n - the number of bytes just moved
+ */
+static void rate_pace(int64_t n);
+
+/*
+ * Limit the size of a single socket operation to the --rate burst, so
+ * that data isn't moved in larger bursts than that.
+ *
+ * Parameters:
+ *
+ *   want - the size that the caller would like to move
+ *
+ * Return:
+ *
+ *   want, or the burst size if that is smaller and this program is
+ *   pacing the transfer
+ */
+static size_t rate_chunk(size_t want);
+
+#ifndef _WIN32
+
+/*
+ * (POSIX only) Start the control thread, which changes the --rate on
+ * SIGUSR1 and SIGUSR2 and, with --control, listens on the control
+ * socket.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pOpt - the option settings
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pOpt is NULL
+ */
+static int ctl_start(const MSOPT *pOpt);
+
+/*
+ * (POSIX only) Stop the control thread if it is running, and remove
+ * the control socket.  The signals are ignored from then on.
+ */
+static void ctl_stop(void);
+
+/*
+ * (POSIX only) Signal handler for SIGUSR1 and SIGUSR2, which passes the
+ * signal on to the control thread.
+ *
+ * Parameters:
+ *
+ *   sig - the signal number
+ */
+static void ctl_signal(int sig);
+
+/*
+ * (POSIX only) Carry out one command received on the control socket
+ * and send the reply.
+ *
+ * Parameters:
+ *
+ *   fd - the connection to the control client
+ *
+ *   pLine - the command line, without the line break
+ *
+ * Faults:
+ *
+ *   - If pLine is NULL
+ */
+static void ctl_command(int fd, const char *pLine);
+
+/*
+ * (POSIX only) Entry point of the control thread.  Runs until
+ * ctl_stop() tells it to stop.
+ *
+ * Parameters:
+ *
+ *   pArg - ignored
+ *
+ * Return:
+ *
+ *   NULL
+ */
+static void *ctl_main(void *pArg);
+
+#endif
+
+/*
+ * Start timing the phases of a run.
+ */
+static void phase_start(void);
+
+/*
+ * Record that a phase of the run has ended, which is also when the
+ * next phase starts.
+ *
+ * For PHASE_TOTAL, the time since phase_start is recorded instead.
+ *
+ * Parameters:
+ *
+ *   phase - the phase, one of the PHASE_ constants
+ */
+static void phase_end(int phase);
+
+/*
+ * Add the phase times of the run to a --phase-hist histogram file.
+ *
+ * The file is created if it doesn't exist.  Failing to update it is
+ * only a warning, and a file that isn't in the expected format is left
+ * alone.
+ *
+ * Parameters:
+ *
+ *   pPath - the histogram file
+ *
+ * Faults:
+ *
+ *   - If pPath is NULL
+ */
+static void phase_hist(const char *pPath);
+
+/*
+ * Wait before the next connection attempt of a client given --retry.
+ *
+ * If the deadline hasn't passed yet, this sleeps for the current delay
+ * (or until the deadline, if that is sooner) and doubles the delay for
+ * next time, up to RETRYMAX.
+ *
+ * Parameters:
+ *
+ *   deadline - the now_ms reading after which no more attempts are
+ *   made
+ *
+ *   pDelay - the current delay in milliseconds, which is updated
+ *
+ * Return:
+ *
+ *   non-zero if another attempt should be made, zero if the deadline
+ *   has passed
+ *
+ * Faults:
+ *
+ *   - If pDelay is NULL
+ */
+static int retry_wait(int64_t deadline, int64_t *pDelay);
+
+/*
+ * Count data moved by the transfer.
+ *
+ * This is called for every chunk of data moved, by both the sending
+ * and the receiving thread with --duplex, so it adds to the count
+ * atomically, and ends the first-byte phase in whichever thread moves
+ * data first.
+ *
+ * Parameters:
+ *
+ *   n - the number of bytes moved
+ */
+static void prog_add(int64_t n);
+
+/*
+ * Set the number of bytes the transfer is expected to move, for the
+ * percentage and estimated time left in --progress reports.
+ *
+ * Parameters:
+ *
+ *   total - the number of bytes expected
+ */
+static void prog_expect(int64_t total);
+
+/*
+ * Set up --progress reporting, which then starts with prog_begin once
+ * the connection is up, so that waiting for the other side isn't
+ * reported or counted in the rates.
+ *
+ * In write mode, if standard input is a regular file, its length is
+ * the amount of data expected.
+ *
+ * Parameters:
+ *
+ *   write - non-zero if in write mode, zero if in read mode
+ */
+static void prog_start(int write);
+
+/*
+ * Start the --progress reporter thread and its clock, if prog_start
+ * set up reporting and the reporter isn't running yet.  This is called
+ * once the connection is up.  Failing to start the reporter is only a
+ * warning.
+ */
+static void prog_begin(void);
+
+/*
+ * Stop the --progress reporter thread and print the final report.
+ *
+ * Nothing is done if the reporter isn't running.
+ */
+static void prog_stop(void);
+
+/*
+ * Print a --progress report to stderr.
+ *
+ * Parameters:
+ *
+ *   final - non-zero for the final report, zero for a report during
+ *   the transfer
+ */
+static void prog_report(int final);
+
+/*
+ * Body of the --progress reporter thread, which prints a report every
+ * PROGINTERVAL milliseconds until told to stop.
+ *
+ * Parameters:
+ *
+ *   pArg - ignored
+ *
+ * Return:
+ *
+ *   zero or NULL
+ */
+#ifdef _WIN32
+static DWORD WINAPI prog_main(LPVOID pArg);
+#else
+static void *prog_main(void *pArg);
+#endif
+
+#ifndef _WIN32
+
+/*
+ * (POSIX only) Run the --bench loopback benchmark.
+ *
+ * Each transfer runs the reader in a child process and the writer in
+ * this one, and the results are written to standard output as CSV.
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pOpt - the option settings
+ *
+ * Return:
+ *
+ *   non-zero if every transfer succeeded, zero if not
+ *
+ * Faults:
+ *
+ *   - If pOpt is NULL
+ */
+static int bench(const MSOPT *pOpt);
+
+#endif
+
+/*
+ * Close a socket, ignoring errors.
+ *
+ * Parameters:
+ *
+ *   sock - the socket to close, or MSOCKET_NONE to do nothing
+ */
+static void sock_close(MSOCKET sock);
+
+/*
+ * Close a connected socket abortively, ignoring errors.
+ *
+ * SO_LINGER is set with a zero timeout before closing, so that the
+ * connection is reset instead of ended with a FIN, and the other side
+ * gets an error rather than seeing a clean end of the data.
+ *
+ * Parameters:
+ *
+ *   sock - the socket to reset, or MSOCKET_NONE to do nothing
+ */
+static void sock_reset(MSOCKET sock);
+
+/*
+ * Switch a socket between blocking and non-blocking mode.
+ *
+ * Parameters:
+ *
+ *   sock - the socket
+ *
+ *   nb - non-zero for non-blocking mode, zero for blocking mode
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ */
+static int sock_nonblock(MSOCKET sock, int nb);
+
+/*
+ * Set the send and receive buffer sizes of a socket.
+ *
+ * A size of zero leaves that buffer alone.  Failing to set a size, or
+ * the system setting a smaller size than asked for, is reported to
+ * stderr as a warning, since the connection still works either way.
+ *
+ * Parameters:
+ *
+ *   sock - the socket
+ *
+ *   sndbuf - the send buffer size, or zero
+ *
+ *   rcvbuf - the receive buffer size, or zero
+ */
+static void sock_bufs(MSOCKET sock, int sndbuf, int rcvbuf);
+
+/*
+ * Apply the TCP tuning options that take effect on a connected socket.
+ *
+ * This selects the congestion control algorithm of --congestion, sets
+ * the --notsent-lowat limit, and on Linux sizes the buffer used in the
+ * direction of the transfer for the --autobuf rate from the round-trip
+ * time measured for the connection.  The explicit buffer sizes of
+ * --sndbuf and --rcvbuf must be set with sock_bufs before the
+ * connection is made, so that they are taken into account when the
+ * TCP window scale is negotiated.
+ *
+ * Errors are reported directly to stderr.  Only failing to select the
+ * congestion control algorithm is an error; the rest only warn.
+ *
+ * Parameters:
+ *
+ *   sock - the connected socket
+ *
+ *   pOpt - the option settings
+ *
+ *   write - non-zero if this instance is in write mode
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pOpt is NULL
+ */
+static int sock_tune(MSOCKET sock, const MSOPT *pOpt, int write);
+
+#ifdef __linux__
+
+/*
+ * (Linux only) Read a number from a system setting under /proc/sys,
+ * such as one of the values of net.ipv4.tcp_wmem.
+ *
+ * Parameters:
+ *
+ *   pPath - the path of the setting
+ *
+ *   index - which of the whitespace-separated numbers to read, from
+ *   zero
+ *
+ * Return:
+ *
+ *   the number, or -1 if it couldn't be read
+ *
+ * Faults:
+ *
+ *   - If pPath is NULL
+ */
+static int64_t proc_value(const char *pPath, int index);
+
+#endif
+
+/*
+ * Connect a client socket to the first address in a list that answers.
+ *
+ * This races connection attempts in the manner of "Happy Eyeballs"
+ * (RFC 8305) so that dead addresses don't delay the connection.  The
+ * addresses are reordered to alternate between IPv6 and IPv4, starting
+ * with the family of the most preferred address.  The first attempt is
+ * started right away, and each further attempt is started RACEDELAY
+ * milliseconds after the previous one, or as soon as all pending
+ * attempts have failed.  The first attempt to succeed wins and all
+ * others are abandoned.  At most MAXRACE addresses are tried.
+ *
+ * The buffer sizes of --sndbuf and --rcvbuf in pOpt are set on each
+ * socket before it connects.  If --fastopen was given, this instance is
+ * in write mode, and there is only one address to try and no --retry,
+ * the socket is set up for TCP Fast Open where the platform supports
+ * it on the client side.  Then, if the system already holds a Fast
+ * Open cookie for the address, the connection completes at once and
+ * the handshake is sent along with the first data sent, so a missing
+ * server is only noticed when sending.  That would defeat both the race
+ * and --retry, which is why Fast Open isn't used with them.
+ *
+ * The returned socket is in blocking mode.
+ *
+ * Parameters:
+ *
+ *   pList - the address list from lookup
+ *
+ *   pOpt - the option settings
+ *
+ *   write - non-zero if this instance is in write mode
+ *
+ * Return:
+ *
+ *   the connected socket, or MSOCKET_NONE if no address could be
+ *   connected to
+ *
+ * Faults:
+ *
+ *   - If pList or pOpt is NULL
+ */
+static MSOCKET connect_race(
+    const struct addrinfo * pList,
+    const MSOPT           * pOpt,
+    int                     write);
+
+#ifndef _WIN32
+
+/*
+ * (POSIX only) Decode the path of a "unix:" address into a Unix domain
+ * socket address.
+ *
+ * pPath is the part of the address string after the "unix:" prefix.
+ *
+ * Parameters:
+ *
+ *   pPath - the socket path
+ *
+ *   pAddr - receives the socket address if successful
+ *
+ *   pAddrLen - receives the length of the socket address if successful
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if the path is empty or too long
+ *
+ * Faults:
+ *
+ *   - If any parameter is NULL
+ */
+static int unix_lookup(
+    const char               * pPath,
+          struct sockaddr_un * pAddr,
+          socklen_t          * pAddrLen);
+
+/*
+ * (POSIX only) Write side of --pass-fd: pass standard input to the
+ * reader over a Unix domain socket.
+ *
+ * The reader first announces itself with a single 'P' byte, so that
+ * the descriptor is only passed to a reader that was given --pass-fd
+ * too.  If the byte doesn't arrive within PASSFDWAITMS, the connection
+ * is reset and closed instead, and the reader gets no data.  Otherwise,
+ * the descriptor goes with a single byte of data in an SCM_RIGHTS
+ * control message.  Then this waits for the reader to send back a
+ * single status byte, which is 'Y' if the reader transferred all the
+ * data successfully.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pSock - the connected Unix domain socket, set to MSOCKET_NONE if
+ *   it is reset and closed here
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pSock is NULL
+ */
+static int pass_fd_write(MSOCKET *pSock);
+
+/*
+ * (POSIX only) Read side of --pass-fd: receive the writer's standard
+ * input over a Unix domain socket and transfer it to standard output.
+ *
+ * The announcement byte described at pass_fd_write is sent first.  The
+ * data is read from the received descriptor with sock_to_out, so on
+ * Linux it is spliced straight from the writer's input to standard
+ * output without passing through the socket.  Afterwards, the status
+ * byte described at pass_fd_write is sent back.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the buffered reader on the connected socket, whose buffer is
+ *   borrowed for the transfer
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pc is NULL
+ */
+static int pass_fd_read(CONNBUF *pc);
+
+/*
+ * (POSIX only) Write side of --fanout: send standard input, or the
+ * --source data, to all of the connected readers.
+ *
+ * Each block of input is read once into a ring of FANQUEUE bytes (or
+ * twice the block size, if larger), and each reader is sent the data
+ * from its own position in the ring, so that the ring acts as a queue
+ * per reader of what it hasn't been sent yet.  The sockets are made
+ * non-blocking and served together with poll().  Input is only read
+ * when there is room for a whole block behind the slowest reader, so
+ * that reader sets the pace, unless drop is set, in which case a
+ * reader that falls a whole ring behind the fastest one is
+ * disconnected with a warning.  A reader whose connection fails is
+ * disconnected in either case.
+ *
+ * Each reader is shut down and closed once it has been sent all the
+ * data, or has its connection reset with sock_reset if it is
+ * disconnected or this fails, so that it fails too, and its entry is
+ * set to -1.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pSock - the connected sockets of the readers
+ *
+ *   n - the number of readers
+ *
+ *   bufsize - the block size to read the input in
+ *
+ *   drop - non-zero to disconnect readers that fall behind, zero to
+ *   wait for them
+ *
+ *   tcp - non-zero if the readers are connected over TCP
+ *
+ * Return:
+ *
+ *   non-zero if every reader was sent all the data, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pSock is NULL or n is less than one
+ */
+static int fan_send(int *pSock, int n, int bufsize, int drop, int tcp);
+
+#endif
+
+#ifdef __linux__
+
+/*
+ * (Linux only) Sleep on a futex word in shared memory until it is
+ * woken, its value differs from val, or SHMPOLLMS milliseconds pass.
+ *
+ * Parameters:
+ *
+ *   pWord - the futex word
+ *
+ *   val - the value the word was seen to have
+ */
+static void shm_futex_wait(uint32_t *pWord, uint32_t val);
+
+/*
+ * (Linux only) Wake every process sleeping on a futex word in shared
+ * memory.
+ *
+ * Parameters:
+ *
+ *   pWord - the futex word
+ */
+static void shm_futex_wake(uint32_t *pWord);
+
+/*
+ * (Linux only) Check whether a process still exists.
+ *
+ * Parameters:
+ *
+ *   pid - the process ID
+ *
+ * Return:
+ *
+ *   non-zero if the process exists, zero if not
+ */
+static int shm_alive(int32_t pid);
+
+/*
+ * (Linux only) Transfer standard input into a shared-memory ring.
+ *
+ * Data is read from standard input, or generated for --source,
+ * straight into free space in the ring, at most --bufsize bytes at a
+ * time, and then published to the reader.  At the end of input, this
+ * waits until the reader reports that it has written everything out.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   ph - the control block
+ *
+ *   pRing - the data ring
+ *
+ *   peer - the process ID of the reader
+ *
+ *   pOpt - the option settings
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If ph, pRing, or pOpt is NULL
+ */
+static int shm_produce(
+    SHMHDR      * ph,
+    char        * pRing,
+    int32_t       peer,
+    const MSOPT * pOpt);
+
+/*
+ * (Linux only) Transfer the data in a shared-memory ring to standard
+ * output.
+ *
+ * Data is written to standard output straight from the ring, at most
+ * --bufsize bytes at a time, or thrown away with --sink, until the
+ * writer reports the end of the data, and then the outcome is reported
+ * back to the writer.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   ph - the control block
+ *
+ *   pRing - the data ring
+ *
+ *   peer - the process ID of the writer
+ *
+ *   pOpt - the option settings
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If ph, pRing, or pOpt is NULL
+ */
+static int shm_consume(
+    SHMHDR      * ph,
+    char        * pRing,
+    int32_t       peer,
+    const MSOPT * pOpt);
+
+/*
+ * (Linux only) Perform the "mspeak" function over a named
+ * shared-memory segment instead of a socket.
+ *
+ * The server creates the segment, replacing any segment left behind
+ * under the same name, and waits for the client to attach to it, after
+ * which the name is removed.  The client attaches to an existing
+ * segment.  Then the writer and reader exchange data through the ring
+ * in the segment with shm_produce and shm_consume.  If the other
+ * process goes away without finishing, the transfer fails.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   server - non-zero if in server mode, zero if in client mode
+ *
+ *   write - non-zero if in write mode, zero if in read mode
+ *
+ *   pName - the segment name, after the "shm:" prefix
+ *
+ *   pOpt - the option settings, of which --retry gives how many
+ *   seconds the client keeps trying to attach to a segment that isn't
+ *   there yet
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pName or pOpt is NULL
+ */
+static int shm_speak(
+    int           server,
+    int           write,
+    const char  * pName,
+    const MSOPT * pOpt);
+
+#endif
+
+/*
+ * Case-insensitive comparison of the first n characters of two strings.
+ *
+ * Only the ASCII letters are folded, which is what HTTP field names and
+ * tokens require.  Comparison stops early at a null terminator that
+ * occurs in both strings at the same position.
+ *
+ * Parameters:
+ *
+ *   pA - the first string
+ *
+ *   pB - the second string
+ *
+ *   n - the maximum number of characters to compare
+ *
+ * Return:
+ *
+ *   non-zero if the strings match, zero if they differ
+ *
+ * Faults:
+ *
+ *   - If pA or pB is NULL
+ */
+static int str_ieq(const char *pA, const char *pB, size_t n);
+
+/*
+ * Receive more data from the socket into a buffered reader.
+ *
+ * This should only be called when all the buffered data has been
+ * consumed (pos equal to lim).  The buffer is reset and refilled with a
+ * single receive operation.
+ *
+ * Parameters:
+ *
+ *   pc - the buffered reader
+ *
+ * Return:
+ *
+ *   the number of bytes received, zero if the other side closed the
+ *   connection, or negative if there was a socket error
+ *
+ * Faults:
+ *
+ *   - If pc is NULL
+ */
+static int connbuf_fill(CONNBUF *pc);
+
+/*
+ * Scan an HTTP request header from a buffered reader.
+ *
+ * Data is consumed until two line breaks in a row are encountered,
+ * where line breaks are ASCII LF characters with any ASCII CR
+ * characters filtered out.  The consumed data (including CR characters
+ * and the final line breaks) is copied into pHdr up to one less than
+ * maxhdr characters and null terminated.  If the header was longer than
+ * that, *pTrunc is set to non-zero and the rest of the header is
+ * scanned but discarded; otherwise, *pTrunc is set to zero.
+ *
+ * On return, the buffered reader is positioned at the first byte after
+ * the header.
+ *
+ * Parameters:
+ *
+ *   pc - the buffered reader
+ *
+ *   pHdr - the buffer to receive the header
+ *
+ *   maxhdr - the size of the header buffer, including terminating null
+ *
+ *   pTrunc - receives the truncation flag
+ *
+ * Return:
+ *
+ *   one if the end of the header was found, zero if the connection was
+ *   closed before the end of the header, or negative if there was a
+ *   socket error
+ *
+ * Faults:
+ *
+ *   - If pc, pHdr, or pTrunc is NULL
+ *
+ *   - If maxhdr is less than one
+ */
+static int connbuf_header(
+    CONNBUF * pc,
+    char    * pHdr,
+    int       maxhdr,
+    int     * pTrunc);
+
+/*
+ * Read a single line from a buffered reader.
+ *
+ * The line is terminated by an ASCII LF character.  The LF and any
+ * ASCII CR characters are not copied into pLine, which is null
+ * terminated.
+ *
+ * Parameters:
+ *
+ *   pc - the buffered reader
+ *
+ *   pLine - the buffer to receive the line
+ *
+ *   maxline - the size of the line buffer, including terminating null
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if the connection ended or failed
+ *   before the end of the line or the line was too long for the buffer
+ *
+ * Faults:
+ *
+ *   - If pc or pLine is NULL
+ *
+ *   - If maxline is less than one
+ */
+static int connbuf_line(CONNBUF *pc, char *pLine, int maxline);
+
+/*
+ * Find a header field in an HTTP request header.
+ *
+ * pHdr is the null-terminated header, as returned by connbuf_header.
+ * The first line (the request line) is skipped.  pName is the name of
+ * the field to find, without the colon, and it is matched without
+ * regard to letter case.  If the field is present, its value without
+ * leading or trailing whitespace is copied into pVal.  If the field
+ * appears more than once, the first instance is used.
+ *
+ * Parameters:
+ *
+ *   pHdr - the request header
+ *
+ *   pName - the field name
+ *
+ *   pVal - the buffer to receive the field value
+ *
+ *   maxval - the size of the value buffer, including terminating null
+ *
+ * Return:
+ *
+ *   one if the field was found, zero if it was not found, or negative
+ *   if the value was too long for the buffer
+ *
+ * Faults:
+ *
+ *   - If pHdr, pName, or pVal is NULL
+ *
+ *   - If maxval is less than one
+ */
+static int http_field(
+    const char * pHdr,
+    const char * pName,
+          char * pVal,
+          int    maxval);
+
+/*
+ * Check whether an If-None-Match field value matches an entity tag.
+ *
+ * pList is the field value, which is either "*" or a comma-separated
+ * list of entity tags.  pTag is the current entity tag of the file,
+ * including its quotes.  Tags are compared with the weak comparison
+ * that HTTP requires for If-None-Match, so a "W/" prefix on a tag in
+ * the list is ignored.
+ *
+ * Parameters:
+ *
+ *   pList - the If-None-Match field value
+ *
+ *   pTag - the current entity tag
+ *
+ * Return:
+ *
+ *   non-zero if the list matches the tag, zero if not
+ *
+ * Faults:
+ *
+ *   - If pList or pTag is NULL
+ */
+static int etag_match(const char *pList, const char *pTag);
+
+/*
+ * Send a block of data completely over a socket.
+ *
+ * Parameters:
+ *
+ *   sock - the connected socket
+ *
+ *   pData - the data to send
+ *
+ *   len - the number of bytes to send
+ *
+ *   flags - the flags for each send() call, such as MSG_MORE
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if the data couldn't be sent
+ *
+ * Faults:
+ *
+ *   - If pData is NULL
+ */
+static int send_all(MSOCKET sock, const char *pData, int len, int flags);
+
+/*
+ * Send several blocks of data completely over a socket, in order.
+ *
+ * The blocks are passed to the system in a single vectored send where
+ * possible, so that framing data such as HTTP chunk headers doesn't
+ * have to be copied next to the data it frames.  Blocks with a length
+ * of zero are allowed and skipped.  The lengths in the block array may
+ * be modified by this function.
+ *
+ * Parameters:
+ *
+ *   sock - the connected socket
+ *
+ *   pv - the array of blocks to send
+ *
+ *   n - the number of blocks in the array
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if the data couldn't be sent
+ *
+ * Faults:
+ *
+ *   - If pv is NULL
+ *
+ *   - If n is less than zero or greater than MAXVEC
+ */
+static int send_vec(MSOCKET sock, MSVEC *pv, int n);
+
+/*
+ * Transfer data received through a buffered reader to standard output.
+ *
+ * Any data already buffered is written first, and then the rest comes
+ * directly from the socket.  If count is zero or greater, exactly that
+ * many bytes are transferred, and it is an error if the connection ends
+ * before that.  If count is negative, data is transferred until the
+ * other side closes the connection.
+ *
+ * On Linux, the data is moved from the socket to standard output with
+ * splice() when standard output is a pipe, a socket, or a regular file,
+ * so that it never has to be copied into user space.  Otherwise, data
+ * is received into the buffered reader's buffer and written with the
+ * standard library.
+ *
+ * On POSIX, the reader may also be set up on a file descriptor that
+ * isn't a socket, such as a pipe or file received with --pass-fd.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the buffered reader
+ *
+ *   count - the number of bytes to transfer, or negative to transfer
+ *   until the end of the connection
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pc is NULL
+ */
+static int sock_to_out(CONNBUF *pc, int64_t count);
+
+/*
+ * Connect to the next instance in a --relay chain.
+ *
+ * The address is a host name, IPv4 address, or IPv6 address and port,
+ * or on POSIX a "unix:" path, as for the main address in client mode.
+ * With --retry in pOpt, the connection is retried with backoff until
+ * the deadline, and the TCP tuning options are applied to the
+ * connection as for a writer.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pAddrStr - the address of the next instance
+ *
+ *   pOpt - the option settings
+ *
+ * Return:
+ *
+ *   the connected socket, or MSOCKET_NONE if failure
+ *
+ * Faults:
+ *
+ *   - If pAddrStr or pOpt is NULL
+ */
+static MSOCKET relay_connect(const char *pAddrStr, const MSOPT *pOpt);
+
+/*
+ * Transfer data received through a buffered reader to standard output
+ * and forward it to the next instance of a --relay chain at the same
+ * time, until the other side closes the connection.
+ *
+ * On Linux, the data is spliced from the socket into a pipe, duplicated
+ * from there to standard output with tee(), through a second pipe
+ * unless standard output is a pipe itself, and then spliced from the
+ * first pipe to the next instance, so that it is never copied into
+ * user space.  This is done when standard output is a pipe, a socket,
+ * or a regular file, or with --sink, when the data is only forwarded.
+ * Otherwise, data is received into the buffered reader's buffer, sent
+ * on, and written with the standard library.
+ *
+ * If the connection to the next instance fails, a warning is given and
+ * the data is still written to standard output, so that this instance
+ * still gets all of it, but the transfer counts as failed.
+ *
+ * Nothing may have been consumed from the buffered reader yet.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the buffered reader
+ *
+ *   fwd - the connection to the next instance
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pc is NULL
+ */
+static int relay_out(CONNBUF *pc, MSOCKET fwd);
+
+/*
+ * Transfer standard input, or the data generated for --source, through
+ * a connected socket until the input ends.
+ *
+ * The input is read in blocks of bufsize bytes, each of which is sent
+ * whole with a single send() on the blocking socket.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   sock - the connected socket
+ *
+ *   pBuf - the buffer to read the input into
+ *
+ *   bufsize - the size of the buffer
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pBuf is NULL
+ */
+static int in_to_sock(MSOCKET sock, char *pBuf, int bufsize);
+
+/*
+ * Transfer standard input through the socket of a buffered reader and
+ * the socket through standard output at the same time, for --duplex.
+ *
+ * A second thread receives with sock_to_out, using the buffered
+ * reader's buffer, while this thread sends with in_to_sock, using a
+ * buffer of its own of bufsize bytes.  When the input ends, the
+ * sending direction of the connection is shut down, so that the other
+ * side sees the end of the data while its own data keeps coming, and
+ * then this waits for the other side to end its data in turn.  If
+ * sending fails, both directions are shut down, so that receiving
+ * stops too, and likewise, if receiving fails, the receiving thread
+ * shuts down both directions, so that sending stops at its next send
+ * (SIGPIPE is ignored on POSIX for this).
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the buffered reader on the connected socket
+ *
+ *   bufsize - the block size to read the input in
+ *
+ * Return:
+ *
+ *   non-zero if both directions succeeded, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pc is NULL
+ */
+static int duplex(CONNBUF *pc, int bufsize);
+
+/*
+ * Entry point of the receiving thread of --duplex.
+ *
+ * Parameters:
+ *
+ *   pArg - the MSDUPLEX state shared with duplex
+ *
+ * Return:
+ *
+ *   nothing of interest
+ */
+#ifdef _WIN32
+static DWORD WINAPI duplex_main(LPVOID pArg);
+#else
+static void *duplex_main(void *pArg);
+#endif
+
+/*
+ * Handle the body of an HTTP request in fake HTTP read mode.
+ *
+ * pHdr is the request header that has already been scanned from the
+ * buffered reader.  The request body is determined from the header
+ * fields, decoded if it uses chunked transfer encoding, and written to
+ * standard output.  Then, a minimal HTTP response is sent back.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   pc - the buffered reader
+ *
+ *   pHdr - the request header
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pc or pHdr is NULL
+ */
+static int http_upload(CONNBUF *pc, const char *pHdr);
+
+/*
+ * Decode the request line of an HTTP request header.
+ *
+ * The method is copied into pMethod.  The return value encodes the
+ * HTTP version of the request as ten times the major version plus the
+ * minor version, so 10 for HTTP/1.0 and 11 for HTTP/1.1.  Requests
+ * that don't state a version are treated as HTTP/0.9 and return 9.
+ *
+ * Parameters:
+ *
+ *   pHdr - the request header
+ *
+ *   pMethod - the buffer to receive the method
+ *
+ *   maxmethod - the size of the method buffer, including terminating
+ *   null
+ *
+ * Return:
+ *
+ *   the encoded HTTP version, or zero if the request line couldn't be
+ *   decoded
+ *
+ * Faults:
+ *
+ *   - If pHdr or pMethod is NULL
+ *
+ *   - If maxmethod is less than one
+ */
+static int http_request(const char *pHdr, char *pMethod, int maxmethod);
+
+/*
+ * Respond to an HTTP request with the data from standard input, framed
+ * with chunked transfer encoding.
+ *
+ * This is used in fake HTTP write mode with the --chunked option.  The
+ * response header is generated here, so the length of the data doesn't
+ * need to be known in advance.  Each chunk is sent together with its
+ * framing in a single vectored send.  HTTP/1.0 clients don't understand
+ * chunked transfer encoding, so for them the data is sent unframed and
+ * its end is marked by closing the connection.  If the request method
+ * is HEAD, only the response header is sent.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   sock - the connected socket
+ *
+ *   pHdr - the request header
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pHdr is NULL
+ */
+static int http_chunked(MSOCKET sock, const char *pHdr);
+
+/*
+ * Respond to an HTTP request with the contents of a file.
+ *
+ * This is used in fake HTTP write mode with the --file option.  The
+ * response header is generated here, using the length of the file for
+ * the Content-Length.  On Linux, the file is then transmitted with
+ * sendfile() so that its contents never have to be copied into user
+ * space.  Elsewhere, or if sendfile() is not supported for this file,
+ * the file is copied through a large buffer.  If the request method is
+ * HEAD, only the response header is sent.
+ *
+ * The response carries the given entity tag.  If the request has an
+ * If-None-Match field that matches it, the client already has the
+ * file, so a 304 (Not Modified) response is sent without a body.
+ *
+ * The file must already be open for reading in binary mode at its
+ * beginning.  It is not closed by this function.
+ *
+ * Errors are reported directly to stderr.
+ *
+ * Parameters:
+ *
+ *   sock - the connected socket
+ *
+ *   pHdr - the request header
+ *
+ *   fd - the file descriptor of the file to send
+ *
+ *   flen - the length of the file in bytes
+ *
+ *   pETag - the entity tag of the file, including its quotes
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pHdr or pETag is NULL
+ *
+ *   - If flen is negative
+ */
+static int http_file(
+    MSOCKET      sock,
+    const char * pHdr,
+    int          fd,
+    int64_t      flen,
+    const char * pETag);
+
+/*
+ * Interpret a "--" option from the command line.
+ *
+ * pArg is the whole command-line argument, including the leading "--".
+ * Options that take a value have the form "--name=value".  The setting
+ * is stored in the options structure.  Errors are reported directly to
+ * stderr.
+ *
+ * Parameters:
+ *
+ *   pArg - the command-line argument
+ *
+ *   pOpt - the options structure to update
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if the option is not recognized or its
+ *   value is not valid
+ *
+ * Faults:
+ *
+ *   - If pArg or pOpt is NULL
+ */
+static int parse_option(const char *pArg, MSOPT *pOpt);
+
+/*
+ * Parse a size or rate given as the value of an option.
+ *
+ * The value is a whole number, which may be followed by K, M, or G (in
+ * either case) to multiply it by 1024, 1024 squared, or 1024 cubed.
+ *
+ * Parameters:
+ *
+ *   pVal - the option value
+ *
+ *   max - the largest value allowed
+ *
+ *   pSize - receives the value
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if the value is missing, not valid, or
+ *   greater than max
+ *
+ * Faults:
+ *
+ *   - If pSize is NULL
+ */
+static int parse_size(const char *pVal, int64_t max, int64_t *pSize);
+
+/*
+ * Parse a rate and optional burst size given as RATE[:BURST], as for
+ * --rate.
+ *
+ * Parameters:
+ *
+ *   pVal - the value
+ *
+ *   pRate - receives the rate
+ *
+ *   pBurst - receives the burst size, or zero if not given
+ *
+ * Return:
+ *
+ *   non-zero if successful, zero if the value is missing or not valid
+ *
+ * Faults:
+ *
+ *   - If pRate or pBurst is NULL
+ */
+static int parse_rate(const char *pVal, int64_t *pRate, int64_t *pBurst);
+
+/*
+ * Perform the "mspeak" function.
+ *
+ * The server flag indicates whether to operate in server mode or client
+ * mode.  The write flag indicates whether to operate in write mode or
+ * read mode.  pAddrStr points to a string specifying a host name, IPv4
+ * address, or IPv6 address, and port.  See the program documentation at
+ * the top of this source file for further information.
+ *
+ * The fh flag indicates that "fake HTTP" mode should be activated, as
+ * described in the program documentation at the top of this source
+ * file.  It may only be used when the server flag is set.
+ *
+ * pOpt points to the settings of the "--" options, which must already
+ * have been checked to be consistent with the mode flags.
+ *
+ * Errors will be reported directly using stderr.  Data will be read or
+ * written with standard input and standard output when appropriate.
+ *
+ * Parameters:
+ *
+ *   server - non-zero if in server mode, zero if in client mode
+ *
+ *   write - non-zero if in write mode, zero if in read mode
+ *
+ *   fh - non-zero if in fake HTTP mode, zero if not
+ *
+ *   pAddrStr - pointer to the address/port string
+ *
+ *   pOpt - pointer to the option settings
+ *
+ * Return:
+ *
+ *   non-zero if success, zero if failure
+ *
+ * Faults:
+ *
+ *   - If pAddrStr or pOpt is NULL
+ *
+ *   - If fake HTTP mode is specified when in client mode
+ *
+ * Undefined behavior:
+ *
+ *   - If the address string is not null terminated
+ *
+ *   - If on Windows the Windows Sockets DLL hasn't been loaded with
+ *     WSAStartup
+ */
+static int mspeak(
+    int          server,
+    int          write,
+    int          fh,
+    const char * pAddrStr,
+    const MSOPT * pOpt);
+
+/*
+ * Local function implementations
+ * ==============================
+ */
+
+/*
+ * lookup function.
+ */
+static int lookup(const char *pAddrStr, struct addrinfo **ppList) {
+  int               status          = 1   ;
+  const char      * pc              = NULL;
+  char            * pw              = NULL;
+  struct addrinfo   hint                  ;
+  char              abuf[MAXAPSIZE]       ;
+  char              pbuf[MAXAPSIZE]       ;
+
+  /* Initialize structures and buffers */
+  memset(&hint, 0, sizeof(struct addrinfo));
+  memset(abuf, 0, MAXAPSIZE);
+  memset(pbuf, 0, MAXAPSIZE);
+
+  /* Check parameters */
+  if ((pAddrStr == NULL) || (ppList == NULL)) {
+    abort();
+  }
+  *ppList = NULL;
+
+  /* Make sure passed address doesn't exceed one less than MAXAPSIZE
+   * so that it will fit within the buffers */
+  if (status) {
+    if (strlen(pAddrStr) > (MAXAPSIZE - 1)) {
+      status = 0;
+    }
+  }
+
+  /* Split the address string into host and port components across a
+   * colon character -- first get the host, which is in square brackets
+   * if it is an IPv6 address since IPv6 addresses contain colons
+   * themselves */
+  if (status) {
+    /* Copy everything up to the closing bracket or the colon into
+     * abuf -- this won't overflow because we verified total size
+     * previously */
+    pw = abuf;
+    pc = pAddrStr;
+    if (*pc == '[') {
+      for(pc++; (*pc != 0) && (*pc != ']'); pc++) {
+        *pw = *pc;
+        pw++;
+      }
+      if (*pc == ']') {
+        pc++;
+      } else {
+        status = 0;
+      }
+
+    } else {
+      for( ; (*pc != 0) && (*pc != ':'); pc++) {
+        *pw = *pc;
+        pw++;
+      }
+    }
+
+    /* Make sure we stopped on a colon character, consuming it if we
+     * did and failing otherwise */
+    if (status && (*pc == ':')) {
+      pc++;
+    } else {
+      status = 0;
+    }
+  }
+
+  /* Now get the port */
+  if (status) {
+    pw = pbuf;
+    for( ; *pc != 0; pc++) {
+      *pw = *pc;
+      pw++;
+    }
+  }
+
+  /* Fail if either field is empty or the port contains characters apart
+   * from ASCII decimal digits -- the host is checked by the translation
+   * below */
+  if (status) {
+    /* Check for empty fields */
+    if ((abuf[0] == 0) || (pbuf[0] == 0)) {
+      status = 0;
+    }
+
+    /* Check character range of port */
+    if (status) {
+      for(pc = pbuf; *pc != 0; pc++) {
+        if ((*pc < '0') || (*pc > '9')) {
+          status = 0;
+        }
+      }
+    }
+  }
+
+  /* Set the hint structure -- the address family is left open so that
+   * both IPv4 and IPv6 addresses are returned */
+  if (status) {
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_STREAM;
+    hint.ai_flags = AI_NUMERICSERV;
+    hint.ai_protocol = IPPROTO_TCP;
+  }
+
+  /* Attempt to translate the address */
+  if (status) {
+    if (getaddrinfo(abuf, pbuf, &hint, ppList)) {
+      *ppList = NULL;
+      status = 0;
+    }
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * prog_add function.
+ */
+static void prog_add(int64_t n) {
+  /* Only the thread that sets the first flag ends the phase */
+#ifdef _WIN32
+  if ((!phases.first) &&
+      (InterlockedExchange((volatile LONG *) &phases.first, 1) == 0)) {
+#else
+  if ((!__atomic_load_n(&phases.first, __ATOMIC_RELAXED)) &&
+      (!__atomic_exchange_n(&phases.first, 1, __ATOMIC_ACQ_REL))) {
+#endif
+    phase_end(PHASE_FIRST);
+  }
+
+#ifdef _WIN32
+  (void) InterlockedExchangeAdd64((volatile LONG64 *) &progress.moved, n);
+#else
+  (void) __atomic_fetch_add(&progress.moved, n, __ATOMIC_RELAXED);
+#endif
+}
+
+/*
+ * prog_expect function.
+ */
+static void prog_expect(int64_t total) {
+#ifdef _WIN32
+  (void) InterlockedExchange64((volatile LONG64 *) &progress.total, total);
+#else
+  __atomic_store_n(&progress.total, total, __ATOMIC_RELAXED);
+#endif
+}
+
+/*
+ * prog_start function.
+ */
+static void prog_start(int write) {
+#ifdef _WIN32
+  struct _stati64    st;
+#else
+  struct stat        st;
+#endif
+
+  memset(&st, 0, sizeof(st));
+
+  progress.moved     = 0;
+  progress.total     = -1;
+  progress.armed     = 1;
+
+  /* A terminal gets a single line that is rewritten in place, anything
+   * else gets a line per report */
+#ifdef _WIN32
+  progress.tty = _isatty(_fileno(stderr));
+  if (write && (_fstati64(_fileno(stdin), &st) == 0) &&
+      ((st.st_mode & _S_IFMT) == _S_IFREG)) {
+    progress.total = (int64_t) st.st_size;
+  }
+#else
+  progress.tty = isatty(STDERR_FILENO);
+  if (write && (fstat(STDIN_FILENO, &st) == 0) && S_ISREG(st.st_mode)) {
+    progress.total = (int64_t) st.st_size;
+  }
+#endif
+}
+
+/*
+ * prog_begin function.
+ */
+static void prog_begin(void) {
+  int                status = 1;
+
+  if ((!progress.armed) || progress.running) {
+    return;
+  }
+
+  progress.start     = now_ms();
+  progress.last      = progress.start;
+  progress.lastmoved = 0;
+
+#ifdef _WIN32
+  progress.stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (progress.stop == NULL) {
+    status = 0;
+  }
+  if (status) {
+    progress.thread = CreateThread(NULL, 0, prog_main, NULL, 0, NULL);
+    if (progress.thread == NULL) {
+      CloseHandle(progress.stop);
+      progress.stop = NULL;
+      status = 0;
+    }
+  }
+#else
+  progress.stop = 0;
+  if (pthread_mutex_init(&progress.lock, NULL)) {
+    status = 0;
+  } else if (pthread_cond_init(&progress.wake, NULL)) {
+    (void) pthread_mutex_destroy(&progress.lock);
+    status = 0;
+  } else if (pthread_create(&progress.thread, NULL, prog_main, NULL)) {
+    (void) pthread_cond_destroy(&progress.wake);
+    (void) pthread_mutex_destroy(&progress.lock);
+    status = 0;
+  }
+#endif
+
+  if (status) {
+    progress.running = 1;
+  } else {
+    progress.armed = 0;
+    fprintf(stderr, "Warning:  couldn't start progress reporting.\n");
+  }
+}
+
+/*
+ * prog_stop function.
+ */
+static void prog_stop(void) {
+  if (!progress.running) {
+    return;
+  }
+  progress.running = 0;
+
+  /* Tell the reporter to stop and wait for it */
+#ifdef _WIN32
+  (void) SetEvent(progress.stop);
+  (void) WaitForSingleObject(progress.thread, INFINITE);
+  CloseHandle(progress.thread);
+  CloseHandle(progress.stop);
+  progress.thread = NULL;
+  progress.stop   = NULL;
+#else
+  (void) pthread_mutex_lock(&progress.lock);
+  progress.stop = 1;
+  (void) pthread_cond_signal(&progress.wake);
+  (void) pthread_mutex_unlock(&progress.lock);
+  (void) pthread_join(progress.thread, NULL);
+  (void) pthread_cond_destroy(&progress.wake);
+  (void) pthread_mutex_destroy(&progress.lock);
+#endif
+
+  prog_report(1);
+}
+
+/*
+ * prog_report function.
+ */
+static void prog_report(int final) {
+  static const char * const units[5] = {
+    "B", "KiB", "MiB", "GiB", "TiB"
+  };
+  int64_t  now     = 0  ;
+  int64_t  moved   = 0  ;
+  int64_t  total   = 0  ;
+  int64_t  secs    = 0  ;
+  double   v[3]         ;
+  int      u[3]         ;
+  int      i       = 0  ;
+  int      n       = 0  ;
+  char     line[160]    ;
+
+  memset(line, 0, sizeof(line));
+
+  now = now_ms();
+#ifdef _WIN32
+  moved = (int64_t) InterlockedCompareExchange64(
+                      (volatile LONG64 *) &progress.moved, 0, 0);
+  total = (int64_t) InterlockedCompareExchange64(
+                      (volatile LONG64 *) &progress.total, 0, 0);
+#else
+  moved = __atomic_load_n(&progress.moved, __ATOMIC_RELAXED);
+  total = __atomic_load_n(&progress.total, __ATOMIC_RELAXED);
+#endif
+
+  /* The amount so far, the rate since the last report, and the average
+   * rate, each scaled to a readable unit */
+  v[0] = (double) moved;
+  v[1] = 0.0;
+  if (now > progress.last) {
+    v[1] = ((double) (moved - progress.lastmoved)) * 1000.0 /
+            ((double) (now - progress.last));
+  }
+  v[2] = 0.0;
+  if (now > progress.start) {
+    v[2] = ((double) moved) * 1000.0 / ((double) (now - progress.start));
+  }
+  for(i = 0; i < 3; i++) {
+    u[i] = 0;
+    while ((v[i] >= 1024.0) && (u[i] < 4)) {
+      v[i] /= 1024.0;
+      u[i]++;
+    }
+  }
+
+  if (final) {
+    secs = (now - progress.start) / 1000;
+    n = sprintf(line, "%.1f %s in %d:%02d:%02d (avg %.1f %s/s)",
+                v[0], units[u[0]],
+                (int) (secs / 3600), (int) ((secs / 60) % 60),
+                (int) (secs % 60), v[2], units[u[2]]);
+  } else {
+    n = sprintf(line, "%.1f %s at %.1f %s/s (avg %.1f %s/s)",
+                v[0], units[u[0]], v[1], units[u[1]], v[2], units[u[2]]);
+
+    /* Percentage and time left at the average rate, if the total is
+     * known */
+    if ((total > 0) && (moved <= total)) {
+      n += sprintf(line + n, " %d%%",
+                    (int) ((((double) moved) * 100.0) / ((double) total)));
+      if ((moved > 0) && (now > progress.start)) {
+        secs = (int64_t) (((double) (total - moved)) *
+                          ((double) (now - progress.start)) /
+                          ((double) moved) / 1000.0);
+        if (secs < INT64_C(360000)) {
+          n += sprintf(line + n, " ETA %d:%02d:%02d",
+                        (int) (secs / 3600), (int) ((secs / 60) % 60),
+                        (int) (secs % 60));
+        }
+      }
+    }
+  }
+  (void) n;
+
+  progress.last      = now;
+  progress.lastmoved = moved;
+
+  if (progress.tty) {
+    fprintf(stderr, "\r%-72s%s", line, final ? "\n" : "");
+  } else {
+    fprintf(stderr, "%s\n", line);
+  }
+  (void) fflush(stderr);
+}
+
+/*
+ * prog_main function.
+ */
+#ifdef _WIN32
+static DWORD WINAPI prog_main(LPVOID pArg) {
+  (void) pArg;
+
+  while (WaitForSingleObject(progress.stop, PROGINTERVAL) == WAIT_TIMEOUT) {
+    prog_report(0);
+  }
+  return 0;
+}
+#else
+static void *prog_main(void *pArg) {
+  struct timespec ts;
+  int             r = 0;
+
+  (void) pArg;
+
+  memset(&ts, 0, sizeof(struct timespec));
+
+  (void) pthread_mutex_lock(&progress.lock);
+  while (!progress.stop) {
+    /* The condition variable waits on the real-time clock */
+    if (clock_gettime(CLOCK_REALTIME, &ts)) {
+      break;
+    }
+    ts.tv_sec  += PROGINTERVAL / 1000;
+    ts.tv_nsec += (long) (PROGINTERVAL % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+
+    /* Sleep until the report is due, unless told to stop */
+    r = 0;
+    while ((!progress.stop) && (r != ETIMEDOUT)) {
+      r = pthread_cond_timedwait(&progress.wake, &progress.lock, &ts);
+    }
+
+    if (!progress.stop) {
+      (void) pthread_mutex_unlock(&progress.lock);
+      prog_report(0);
+      (void) pthread_mutex_lock(&progress.lock);
+    }
+  }
+  (void) pthread_mutex_unlock(&progress.lock);
+
+  return NULL;
+}
+#endif
+
+#ifndef _WIN32
+
+/*
+ * bench function.
+ */
+static int bench(const MSOPT *pOpt) {
+  static const char * const engines[] = {"tcp", "unix", "shm"};
+  static const int sizes[] = {4096, 65536, 1048576};
+
+  int                status = 1   ;
+  int                ok     = 0   ;
+  int                e      = 0   ;
+  int                k      = 0   ;
+  int                nengine = 0  ;
+  int                nsize  = 0   ;
+  int                wst    = 0   ;
+  int                fd     = -1  ;
+  pid_t              pid    = -1  ;
+  int64_t            bytes  = 0   ;
+  int64_t            t0     = 0   ;
+  double             secs   = 0.0 ;
+  socklen_t          slen   = 0   ;
+  struct sockaddr_in sin          ;
+  MSOPT              ro           ;
+  MSOPT              wo           ;
+  char               addr[MAXAPSIZE];
+
+  /* Check parameters */
+  if (pOpt == NULL) {
+    abort();
+  }
+
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  memset(addr, 0, sizeof(addr));
+
+  /* Shared memory is only available on Linux, and a block size given
+   * with --bufsize replaces the sweep */
+#ifdef __linux__
+  nengine = 3;
+#else
+  nengine = 2;
+#endif
+  nsize = (pOpt->bufsize > 0) ? 1 : 3;
+  bytes = (pOpt->bytes > 0) ? pOpt->bytes : SRCBYTES;
+
+  /* A reader that fails shouldn't take the benchmark down with it */
+  (void) signal(SIGPIPE, SIG_IGN);
+
+  printf("engine,bufsize,bytes,seconds,mib_per_s\n");
+  (void) fflush(stdout);
+
+  for(e = 0; e < nengine; e++) {
+    for(k = 0; k < nsize; k++) {
+      ok = 1;
+
+      /* The reader throws the data away and the writer generates it;
+       * the TCP tuning options only apply to TCP */
+      memcpy(&ro, pOpt, sizeof(MSOPT));
+      ro.bench   = 0;
+      ro.source  = 0;
+      ro.bytes   = 0;
+      ro.retry   = 0;
+      ro.sink    = 1;
+      ro.bufsize = (pOpt->bufsize > 0) ? pOpt->bufsize : sizes[k];
+      if (e != 0) {
+        ro.fastopen      = 0;
+        ro.sndbuf        = 0;
+        ro.rcvbuf        = 0;
+        ro.pCongestion   = NULL;
+        ro.notsent_lowat = 0;
+        ro.autobuf       = 0;
+      }
+
+      memcpy(&wo, &ro, sizeof(MSOPT));
+      wo.sink   = 0;
+      wo.source = 1;
+      wo.bytes  = bytes;
+      wo.retry  = BENCHRETRY;
+
+      /* Pick the address -- for TCP, a port that is free right now */
+      if (e == 0) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        sin.sin_family      = AF_INET;
+        sin.sin_port        = 0;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        slen = (socklen_t) sizeof(struct sockaddr_in);
+        if ((fd == -1) ||
+            bind(fd, (const struct sockaddr *) &sin, slen) ||
+            getsockname(fd, (struct sockaddr *) &sin, &slen)) {
+          fprintf(stderr, "Couldn't find a free port!\n");
+          ok = 0;
+        }
+        if (fd != -1) {
+          close(fd);
+          fd = -1;
+        }
+        sprintf(addr, "127.0.0.1:%u", (unsigned) ntohs(sin.sin_port));
+      } else if (e == 1) {
+        sprintf(addr, "unix:/tmp/mspeak-bench-%ld.sock", (long) getpid());
+      } else {
+        sprintf(addr, "mspeak-bench-%ld", (long) getpid());
+      }
+
+      /* Start the reader in a child process */
+      if (ok) {
+        pid = fork();
+        if (pid == -1) {
+          fprintf(stderr, "Couldn't start reader process!\n");
+          ok = 0;
+        } else if (pid == 0) {
+#ifdef __linux__
+          if (e == 2) {
+            _exit(shm_speak(1, 0, addr, &ro) ? 0 : 1);
+          }
+#endif
+          _exit(mspeak(1, 0, 0, addr, &ro) ? 0 : 1);
+        }
+      }
+
+      /* Send the data and wait for the reader to finish with it */
+      if (ok) {
+        ok = src_start(&wo);
+        t0 = now_ns();
+        if (ok) {
+#ifdef __linux__
+          if (e == 2) {
+            ok = shm_speak(0, 1, addr, &wo);
+          } else {
+            ok = mspeak(0, 1, 0, addr, &wo);
+          }
+#else
+          ok = mspeak(0, 1, 0, addr, &wo);
+#endif
+        }
+        src_stop();
+
+        /* A writer that failed, perhaps before it even connected, may
+         * have left the reader waiting for it for good */
+        if (!ok) {
+          (void) kill(pid, SIGTERM);
+        }
+
+        while (waitpid(pid, &wst, 0) == -1) {
+          if (errno != EINTR) {
+            wst = 1;
+            break;
+          }
+        }
+        secs = ((double) (now_ns() - t0)) / 1000000000.0;
+        if ((!WIFEXITED(wst)) || (WEXITSTATUS(wst) != 0)) {
+          ok = 0;
+        }
+      }
+
+      /* Report the transfer */
+      if (ok) {
+        printf("%s,%d,%lld,%.6f,%.1f\n", engines[e], ro.bufsize,
+                (long long) bytes, secs,
+                ((double) bytes) / (1024.0 * 1024.0) / secs);
+      } else {
+        fprintf(stderr, "Benchmark transfer %s,%d failed!\n",
+                engines[e], ro.bufsize);
+        status = 0;
+      }
+      (void) fflush(stdout);
+    }
+  }
+
+  /* Return status */
+  return status;
+}
+
+#endif
+
+/*
+ * now_ms function.
+ */
+static int64_t now_ms(void) {
+#ifdef _WIN32
+/* WIN32-specific --------------------------------------------------- */
+  return (int64_t) GetTickCount64();
+/* ================================================================== */
+#else
+/* POSIX-specific --------------------------------------------------- */
+  struct timespec ts;
+
+  memset(&ts, 0, sizeof(struct timespec));
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    abort();
+  }
+  return (((int64_t) ts.tv_sec) * 1000) +
+          (((int64_t) ts.tv_nsec) / 1000000);
+/* ================================================================== */
+#endif
+}
+
+/*
+ * now_ns function.
+ */
+static int64_t now_ns(void) {
+#ifdef _WIN32
+/* WIN32-specific --------------------------------------------------- */
+  LARGE_INTEGER c;
+  LARGE_INTEGER f;
+
+  if ((!QueryPerformanceCounter(&c)) || (!QueryPerformanceFrequency(&f))) {
+    abort();
+  }
+  return (int64_t) (((double) c.QuadPart) * 1000000000.0 /
+                    ((double) f.QuadPart));
+/* ================================================================== */
+#else
+/* POSIX-specific --------------------------------------------------- */
+  struct timespec ts;
+
+  memset(&ts, 0, sizeof(struct timespec));
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    abort();
+  }
+  return (((int64_t) ts.tv_sec) * 1000000000) + ((int64_t) ts.tv_nsec);
+/* ================================================================== */
+#endif
+}
+
+/*
+ * stat_begin function.
+ */
+static int64_t stat_begin(void) {
+  if (!stats.on) {
+    return 0;
+  }
+  return now_ns();
+}
+
+/*
+ * stat_end function.
+ */
+static void stat_end(int kind, int64_t t0, int64_t n) {
+  MSSTATIO * ps = NULL;
+  int        b  = 0   ;
+
+  if (!stats.on) {
+    return;
+  }
+
+  ps = &(stats.io[kind]);
+  ps->calls++;
+  ps->ns += now_ns() - t0;
+
+  if (n > 0) {
+    ps->bytes += n;
+    for(b = 0; (b < STATBUCKETS - 1) && ((INT64_C(1) << b) < n); b++) { }
+    ps->sizes[b]++;
+  }
+}
+
+/*
+ * stat_tcp function.
+ */
+static void stat_tcp(MSOCKET sock) {
+#ifdef __linux__
+  struct tcp_info ti;
+  socklen_t       tlen = 0;
+
+  if (!stats.on) {
+    return;
+  }
+
+  memset(&ti, 0, sizeof(struct tcp_info));
+  tlen = (socklen_t) sizeof(struct tcp_info);
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &tlen) == 0) {
+    stats.tcp     = 1;
+    stats.rtt     = ti.tcpi_rtt;
+    stats.rttvar  = ti.tcpi_rttvar;
+    stats.retrans = ti.tcpi_total_retrans;
+    stats.cwnd    = ti.tcpi_snd_cwnd;
+    stats.mss     = ti.tcpi_snd_mss;
+  }
+#else
+  (void) sock;
+#endif
+}
+
+/*
+ * stat_write function.
+ */
+static void stat_write(const char *pPath, const char *pMode, int ok) {
+  static const char * const names[STATCOUNT] = {
+    "input", "send", "recv", "output", "wait"
+  };
+  FILE           * pf    = stderr;
+  const MSSTATIO * ps    = NULL;
+  int              i     = 0;
+  int              b     = 0;
+  int              first = 0;
+  int64_t          moved = 0;
+
+  /* Check parameters */
+  if (pMode == NULL) {
+    abort();
+  }
+
+  if (pPath != NULL) {
+    pf = fopen(pPath, "w");
+    if (pf == NULL) {
+      fprintf(stderr, "Warning:  couldn't write statistics file.\n");
+      return;
+    }
+  }
+
+#ifdef _WIN32
+  moved = (int64_t) InterlockedCompareExchange64(
+                      (volatile LONG64 *) &progress.moved, 0, 0);
+#else
+  moved = __atomic_load_n(&progress.moved, __ATOMIC_RELAXED);
+#endif
+
+  fprintf(pf, "{\"mode\":\"%s\",\"ok\":%s,\"bytes\":%lld,"
+              "\"seconds\":%.6f,\"io\":{",
+          pMode, ok ? "true" : "false", (long long) moved,
+          ((double) (now_ns() - stats.start)) / 1000000000.0);
+
+  for(i = 0; i < STATCOUNT; i++) {
+    ps = &(stats.io[i]);
+    fprintf(pf, "%s\"%s\":{\"calls\":%lld,\"bytes\":%lld,"
+                "\"seconds\":%.6f,\"sizes\":{",
+            (i > 0) ? "," : "", names[i], (long long) ps->calls,
+            (long long) ps->bytes, ((double) ps->ns) / 1000000000.0);
+    first = 1;
+    for(b = 0; b < STATBUCKETS; b++) {
+      if (ps->sizes[b] > 0) {
+        fprintf(pf, "%s\"%lld\":%lld", first ? "" : ",",
+                (long long) (INT64_C(1) << b), (long long) ps->sizes[b]);
+        first = 0;
+      }
+    }
+    fprintf(pf, "}}");
+  }
+  fprintf(pf, "}");
+
+  fprintf(pf, ",\"phases\":{");
+  first = 1;
+  for(i = 0; i < PHASECOUNT; i++) {
+    if (phases.ns[i] >= 0) {
+      fprintf(pf, "%s\"%s_us\":%lld", first ? "" : ",", phase_names[i],
+              (long long) (phases.ns[i] / 1000));
+      first = 0;
+    }
+  }
+  fprintf(pf, "}");
+
+  if (stats.tcp) {
+    fprintf(pf, ",\"tcp\":{\"rtt_us\":%lu,\"rttvar_us\":%lu,"
+                "\"retransmits\":%lu,\"cwnd\":%lu,\"mss\":%lu}",
+            (unsigned long) stats.rtt, (unsigned long) stats.rttvar,
+            (unsigned long) stats.retrans, (unsigned long) stats.cwnd,
+            (unsigned long) stats.mss);
+  }
+  fprintf(pf, "}\n");
+
+  if (pPath != NULL) {
+    if (fclose(pf)) {
+      fprintf(stderr, "Warning:  couldn't write statistics file.\n");
+    }
+  } else {
+    (void) fflush(pf);
+  }
+}
+
+/*
+ * phase_start function.
+ */
+static void phase_start(void) {
+  int i = 0;
+
+  phases.start = now_ns();
+  phases.mark  = phases.start;
+  phases.first = 0;
+  for(i = 0; i < PHASECOUNT; i++) {
+    phases.ns[i] = -1;
+  }
+}
+
+/*
+ * phase_end function.
+ */
+static void phase_end(int phase) {
+  int64_t now = 0;
+
+  now = now_ns();
+  if (phase == PHASE_TOTAL) {
+    phases.ns[phase] = now - phases.start;
+  } else {
+    phases.ns[phase] = now - phases.mark;
+    phases.mark = now;
+  }
+}
+
+/*
+ * phase_hist function.
+ */
+static void phase_hist(const char *pPath) {
+  int       status = 1   ;
+  int       fd     = -1  ;
+  FILE    * pf     = NULL;
+  int       i      = 0   ;
+  int       b      = 0   ;
+  int64_t   us     = 0   ;
+  long long bound  = 0   ;
+  long long count  = 0   ;
+  char      name[32]     ;
+  char      line[MAXLINESIZE];
+  int64_t   hist[PHASECOUNT][PHASEBUCKETS];
+
+  /* Check parameters */
+  if (pPath == NULL) {
+    abort();
+  }
+
+  memset(name, 0, sizeof(name));
+  memset(line, 0, sizeof(line));
+  memset(hist, 0, sizeof(hist));
+
+  /* Open the file, creating it if needed, and lock it against other
+   * runs updating it at the same time */
+#ifdef _WIN32
+  fd = _open(pPath, _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  fd = open(pPath, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+#endif
+  if (fd == -1) {
+    status = 0;
+  }
+
+#ifndef _WIN32
+  if (status) {
+    while (flock(fd, LOCK_EX)) {
+      if (errno != EINTR) {
+        status = 0;
+        break;
+      }
+    }
+  }
+#endif
+
+  if (status) {
+#ifdef _WIN32
+    pf = _fdopen(fd, "r+b");
+#else
+    pf = fdopen(fd, "r+");
+#endif
+    if (pf == NULL) {
+      status = 0;
+    } else {
+      fd = -1;
+    }
+  }
+
+  if (!status) {
+    fprintf(stderr, "Warning:  couldn't open phase histogram file.\n");
+  }
+
+  /* Read the histogram so far */
+  while (status && (fgets(line, MAXLINESIZE, pf) != NULL)) {
+    if ((line[0] == '#') || (line[0] == '\n')) {
+      continue;
+    }
+
+    if (sscanf(line, "%31s %lld %lld", name, &bound, &count) != 3) {
+      status = 0;
+      break;
+    }
+    for(i = 0; i < PHASECOUNT; i++) {
+      if (strcmp(name, phase_names[i]) == 0) {
+        break;
+      }
+    }
+    for(b = 0; b < PHASEBUCKETS; b++) {
+      if (bound == (long long) (INT64_C(1) << b)) {
+        break;
+      }
+    }
+    if ((i >= PHASECOUNT) || (b >= PHASEBUCKETS) || (count < 0)) {
+      status = 0;
+      break;
+    }
+    hist[i][b] += (int64_t) count;
+  }
+
+  if (status && ferror(pf)) {
+    status = 0;
+  }
+
+  if ((!status) && (pf != NULL)) {
+    fprintf(stderr,
+      "Warning:  phase histogram file is not valid, not updated.\n");
+  }
+
+  /* Add this run */
+  for(i = 0; status && (i < PHASECOUNT); i++) {
+    if (phases.ns[i] < 0) {
+      continue;
+    }
+    us = phases.ns[i] / 1000;
+    for(b = 0; (b < PHASEBUCKETS - 1) && ((INT64_C(1) << b) < us); b++) { }
+    hist[i][b]++;
+  }
+
+  /* Write the histogram back over the old one */
+  if (status) {
+    rewind(pf);
+#ifdef _WIN32
+    if (_chsize_s(_fileno(pf), 0)) {
+#else
+    if (ftruncate(fileno(pf), 0)) {
+#endif
+      status = 0;
+    }
+  }
+
+  if (status) {
+    fprintf(pf, "# mspeak phase times: phase, upper bound in "
+                "microseconds, number of runs\n");
+    for(i = 0; i < PHASECOUNT; i++) {
+      for(b = 0; b < PHASEBUCKETS; b++) {
+        if (hist[i][b] > 0) {
+          fprintf(pf, "%s %lld %lld\n", phase_names[i],
+                  (long long) (INT64_C(1) << b), (long long) hist[i][b]);
+        }
+      }
+    }
+    if (fflush(pf)) {
+      status = 0;
+    }
+    if (!status) {
+      fprintf(stderr, "Warning:  couldn't write phase histogram file.\n");
+    }
+  }
+
+  /* Closing the file also releases the lock */
+  if (pf != NULL) {
+    (void) fclose(pf);
+  }
+  if (fd != -1) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+  }
+}
+
+/*
+ * src_start function.
+ */
+static int src_start(const MSOPT *pOpt) {
+  int      status = 1;
+  size_t   i      = 0;
+  size_t   nrand  = 0;
+  uint64_t x      = 0;
+
+  /* Check parameters */
+  if (pOpt == NULL) {
+    abort();
+  }
+
+  src_stop();
+
+  source.pPat = (char *) malloc(SRCPATSIZE);
+  if (source.pPat == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    status = 0;
+  }
+
+  /* Fill the start of each block with bytes from a xorshift generator
+   * and leave the rest zero, so that the data compresses about as well
+   * as srcrandom says */
+  if (status) {
+    memset(source.pPat, 0, SRCPATSIZE);
+    nrand = (size_t) (SRCBLOCK * pOpt->srcrandom / 100);
+    x = ((uint64_t) now_ns()) | 1;
+    for(i = 0; i < SRCPATSIZE; i++) {
+      if ((i % SRCBLOCK) < nrand) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        source.pPat[i] = (char) (x >> 56);
+      }
+    }
+
+    source.pos  = 0;
+    source.left = (pOpt->bytes > 0) ? pOpt->bytes : SRCBYTES;
+    source.on   = 1;
+    prog_expect(source.left);
+  }
+
+  return status;
+}
+
+/*
+ * src_stop function.
+ */
+static void src_stop(void) {
+  if (source.pPat != NULL) {
+    free(source.pPat);
+  }
+  memset(&source, 0, sizeof(MSSOURCE));
+}
+
+/*
+ * in_read function.
+ */
+static size_t in_read(char *pBuf, size_t len) {
+  size_t done = 0;
+  size_t n    = 0;
+
+  /* Check parameters */
+  if (pBuf == NULL) {
+    abort();
+  }
+
+  if (!source.on) {
+    return fread(pBuf, 1, len, stdin);
+  }
+
+  /* Copy the pattern out, wrapping around at its end */
+  if (((int64_t) len) > source.left) {
+    len = (size_t) source.left;
+  }
+  while (done < len) {
+    n = SRCPATSIZE - source.pos;
+    if (n > len - done) {
+      n = len - done;
+    }
+    memcpy(pBuf + done, source.pPat + source.pos, n);
+    done += n;
+    source.pos = (source.pos + n) % SRCPATSIZE;
+  }
+  source.left -= (int64_t) done;
+
+  return done;
+}
+
+/*
+ * rate_init function.
+ */
+static void rate_init(const MSOPT *pOpt) {
+  /* Check parameters */
+  if (pOpt == NULL) {
+    abort();
+  }
+
+  pacer.rate      = pOpt->rate;
+  pacer.burst     = pOpt->burst;
+  pacer.autoburst = (pOpt->burst < 1) ? 1 : 0;
+  if (pacer.autoburst) {
+    pacer.burst = pacer.rate * RATEBURSTMS / 1000;
+  }
+  if (pacer.burst < 1) {
+    pacer.burst = 1;
+  }
+  pacer.kernel = 0;
+  pacer.sock   = MSOCKET_NONE;
+  pacer.sys    = 0;
+#ifndef _WIN32
+  (void) pthread_mutex_init(&pacer.lock, NULL);
+#endif
+}
+
+/*
+ * rate_apply function.
+ */
+static void rate_apply(void) {
+  int      kernel = 0;
+#ifdef SO_MAX_PACING_RATE
+  uint64_t rate64 = 0;
+  unsigned rate32 = 0;
+
+  /* Older systems only take a 32-bit rate */
+  if (pacer.sys) {
+    rate64 = (pacer.rate > 0) ? (uint64_t) pacer.rate : ~((uint64_t) 0);
+    rate32 = (pacer.rate > 0) ? (unsigned) pacer.rate : ~0U;
+    if (setsockopt(pacer.sock, SOL_SOCKET, SO_MAX_PACING_RATE,
+                    (const void *) &rate64, sizeof(rate64)) == 0) {
+      kernel = 1;
+    } else if ((pacer.rate <= (int64_t) UINT32_MAX) &&
+                (setsockopt(pacer.sock, SOL_SOCKET, SO_MAX_PACING_RATE,
+                    (const void *) &rate32, sizeof(rate32)) == 0)) {
+      kernel = 1;
+    }
+  }
+#endif
+
+#ifdef _WIN32
+  pacer.kernel = kernel;
+#else
+  __atomic_store_n(&pacer.kernel, kernel, __ATOMIC_RELAXED);
+#endif
+}
+
+/*
+ * rate_start function.
+ */
+static void rate_start(MSOCKET sock, int write, int tcp) {
+#ifndef _WIN32
+  (void) pthread_mutex_lock(&pacer.lock);
+#endif
+
+  pacer.sock   = sock;
+  pacer.sys    = (write && tcp) ? 1 : 0;
+  pacer.tokens = (double) pacer.burst;
+  pacer.last   = now_ns();
+  if (pacer.rate > 0) {
+    rate_apply();
+  }
+
+#ifndef _WIN32
+  (void) pthread_mutex_unlock(&pacer.lock);
+#endif
+}
+
+/*
+ * rate_stop function.
+ */
+static void rate_stop(void) {
+#ifndef _WIN32
+  (void) pthread_mutex_lock(&pacer.lock);
+#endif
+
+  pacer.sock = MSOCKET_NONE;
+  pacer.sys  = 0;
+
+#ifndef _WIN32
+  (void) pthread_mutex_unlock(&pacer.lock);
+#endif
+}
+
+/*
+ * rate_set function.
+ */
+static void rate_set(int64_t rate, int64_t burst) {
+  int autoburst = 0;
+
+  autoburst = (burst < 1) ? 1 : 0;
+  if (autoburst) {
+    burst = rate * RATEBURSTMS / 1000;
+  }
+  if (burst < 1) {
+    burst = 1;
+  }
+
+#ifndef _WIN32
+  (void) pthread_mutex_lock(&pacer.lock);
+#endif
+
+  pacer.autoburst = autoburst;
+#ifdef _WIN32
+  pacer.rate  = rate;
+  pacer.burst = burst;
+#else
+  __atomic_store_n(&pacer.rate, rate, __ATOMIC_RELAXED);
+  __atomic_store_n(&pacer.burst, burst, __ATOMIC_RELAXED);
+#endif
+  if (pacer.sock != MSOCKET_NONE) {
+    rate_apply();
+  }
+
+#ifndef _WIN32
+  (void) pthread_mutex_unlock(&pacer.lock);
+#endif
+
+  if (rate > 0) {
+    fprintf(stderr, "Rate set to %lld bytes per second, burst %lld.\n",
+            (long long) rate, (long long) burst);
+  } else {
+    fprintf(stderr, "Rate limit removed.\n");
+  }
+}
+
+/*
+ * rate_step function.
+ */
+static int rate_step(int up) {
+  int64_t rate  = 0;
+  int64_t burst = 0;
+
+  /* Only the control thread changes the rate, so it can be read
+   * without the lock here */
+  rate  = pacer.rate;
+  burst = pacer.autoburst ? 0 : pacer.burst;
+  if (rate < 1) {
+    fprintf(stderr, "Warning:  no rate to change.\n");
+    return 0;
+  }
+
+  if (up) {
+    rate = (rate > MAXRATE / 2) ? MAXRATE : rate * 2;
+  } else {
+    rate = (rate < 2) ? 1 : rate / 2;
+  }
+  rate_set(rate, burst);
+
+  return 1;
+}
+
+/*
+ * rate_pace function.
+ */
+static void rate_pace(int64_t n) {
+  int64_t         rate  = 0;
+  int64_t         burst = 0;
+  int             kernel = 0;
+  int64_t         now   = 0;
+  int64_t         wait  = 0;
+  int64_t         t0    = 0;
+#ifndef _WIN32
+  struct timespec ts;
+#endif
+
+#ifdef _WIN32
+  rate   = pacer.rate;
+  kernel = pacer.kernel;
+#else
+  rate   = __atomic_load_n(&pacer.rate, __ATOMIC_RELAXED);
+  kernel = __atomic_load_n(&pacer.kernel, __ATOMIC_RELAXED);
+#endif
+  if ((rate <= 0) || kernel) {
+    return;
+  }
+
+  t0 = stat_begin();
+  for( ; ; ) {
+    /* Refill the bucket for the time since it was last brought up to
+     * date at the current rate, then take out what was moved */
+#ifdef _WIN32
+    burst = pacer.burst;
+#else
+    burst = __atomic_load_n(&pacer.burst, __ATOMIC_RELAXED);
+#endif
+    now = now_ns();
+    pacer.tokens += ((double) (now - pacer.last)) * ((double) rate) /
+                      1000000000.0;
+    if (pacer.tokens > (double) burst) {
+      pacer.tokens = (double) burst;
+    }
+    pacer.last = now;
+    pacer.tokens -= (double) n;
+    n = 0;
+
+    /* Done unless ahead of the rate */
+    if (pacer.tokens >= 0.0) {
+      break;
+    }
+
+    /* Sleep until the bucket is no longer in debt, or for a slice of
+     * that, then check the rate again */
+    wait = (int64_t) ((-pacer.tokens) * 1000000000.0 / ((double) rate));
+    if (wait > ((int64_t) RATESLICEMS) * 1000000) {
+      wait = ((int64_t) RATESLICEMS) * 1000000;
+    }
+#ifdef _WIN32
+    Sleep((DWORD) ((wait + 999999) / 1000000));
+#else
+    memset(&ts, 0, sizeof(struct timespec));
+    ts.tv_sec  = (time_t) (wait / 1000000000);
+    ts.tv_nsec = (long) (wait % 1000000000);
+    while (nanosleep(&ts, &ts) && (errno == EINTR)) { }
+#endif
+
+#ifdef _WIN32
+    rate   = pacer.rate;
+    kernel = pacer.kernel;
+#else
+    rate   = __atomic_load_n(&pacer.rate, __ATOMIC_RELAXED);
+    kernel = __atomic_load_n(&pacer.kernel, __ATOMIC_RELAXED);
+#endif
+    if ((rate <= 0) || kernel) {
+      pacer.tokens = 0.0;
+      break;
+    }
+  }
+  stat_end(STAT_WAIT, t0, 0);
+}
+
+/*
+ * rate_chunk function.
+ */
+static size_t rate_chunk(size_t want) {
+  int64_t rate   = 0;
+  int64_t burst  = 0;
+  int     kernel = 0;
+
+#ifdef _WIN32
+  rate   = pacer.rate;
+  burst  = pacer.burst;
+  kernel = pacer.kernel;
+#else
+  rate   = __atomic_load_n(&pacer.rate, __ATOMIC_RELAXED);
+  burst  = __atomic_load_n(&pacer.burst, __ATOMIC_RELAXED);
+  kernel = __atomic_load_n(&pacer.kernel, __ATOMIC_RELAXED);
+#endif
+
+  if ((rate > 0) && (!kernel) && (((int64_t) want) > burst)) {
+    want = (size_t) burst;
+  }
+  return want;
+}
+
+#ifndef _WIN32
+
+/*
+ * ctl_start function.
+ */
+static int ctl_start(const MSOPT *pOpt) {
+  int                status = 1;
+  struct stat        st;
+  struct sockaddr_un sun;
+  struct sigaction   sa;
+  sigset_t           set;
+
+  /* Check parameters */
+  if (pOpt == NULL) {
+    abort();
+  }
+
+  memset(&st, 0, sizeof(struct stat));
+  memset(&sun, 0, sizeof(struct sockaddr_un));
+  memset(&sa, 0, sizeof(struct sigaction));
+
+  control.on      = 1;
+  control.running = 0;
+  control.wake[0] = -1;
+  control.wake[1] = -1;
+  control.lsock   = -1;
+  control.pPath   = NULL;
+
+  /* The wake pipe must never block the signal handler */
+  if (pipe(control.wake)) {
+    control.wake[0] = -1;
+    control.wake[1] = -1;
+    status = 0;
+  } else {
+    (void) fcntl(control.wake[0], F_SETFD, FD_CLOEXEC);
+    (void) fcntl(control.wake[1], F_SETFD, FD_CLOEXEC);
+    (void) fcntl(control.wake[1], F_SETFL,
+                  fcntl(control.wake[1], F_GETFL) | O_NONBLOCK);
+  }
+  if (!status) {
+    fprintf(stderr, "Couldn't start rate control!\n");
+  }
+
+  /* Listen on the control socket, replacing a socket left behind by an
+   * earlier run but nothing else */
+  if (status && (pOpt->pControl != NULL)) {
+    if (strlen(pOpt->pControl) >= sizeof(sun.sun_path)) {
+      fprintf(stderr, "Control socket path is too long!\n");
+      status = 0;
+    }
+
+    if (status) {
+      sun.sun_family = AF_UNIX;
+      strcpy(sun.sun_path, pOpt->pControl);
+      if (lstat(sun.sun_path, &st) == 0) {
+        if (S_ISSOCK(st.st_mode)) {
+          (void) unlink(sun.sun_path);
+        }
+      }
+
+      control.lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (control.lsock == -1) {
+        status = 0;
+      }
+    }
+
+    if (status) {
+      (void) fcntl(control.lsock, F_SETFD, FD_CLOEXEC);
+      if (bind(control.lsock, (const struct sockaddr *) &sun,
+                (socklen_t) sizeof(struct sockaddr_un))) {
+        status = 0;
+      } else {
+        control.pPath = pOpt->pControl;
+        if (listen(control.lsock, 1)) {
+          status = 0;
+        }
+      }
+    }
+
+    if (!status) {
+      fprintf(stderr, "Couldn't listen on control socket!\n");
+    }
+  }
+
+  /* Start the thread, then pass the signals on to it */
+  if (status) {
+    if (pthread_create(&control.thread, NULL, ctl_main, NULL)) {
+      fprintf(stderr, "Couldn't start rate control!\n");
+      status = 0;
+    } else {
+      control.running = 1;
+    }
+  }
+
+  /* Block the signals in this thread and any it starts later, so
+   * that they are handled by the control thread and don't interrupt
+   * the transfer */
+  if (status) {
+    sa.sa_handler = ctl_signal;
+    sa.sa_flags   = SA_RESTART;
+    (void) sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL) || sigaction(SIGUSR2, &sa, NULL)) {
+      fprintf(stderr, "Warning:  couldn't catch SIGUSR1 and SIGUSR2.\n");
+    }
+
+    (void) sigemptyset(&set);
+    (void) sigaddset(&set, SIGUSR1);
+    (void) sigaddset(&set, SIGUSR2);
+    (void) pthread_sigmask(SIG_BLOCK, &set, NULL);
+  }
+
+  if (!status) {
+    ctl_stop();
+  }
+
+  return status;
+}
+
+/*
+ * ctl_stop function.
+ */
+static void ctl_stop(void) {
+  char c = 'q';
+
+  if (!control.on) {
+    return;
+  }
+
+  /* Ignore the signals from now on, since nothing will handle them */
+  if (control.running) {
+    (void) signal(SIGUSR1, SIG_IGN);
+    (void) signal(SIGUSR2, SIG_IGN);
+  }
+
+  /* Tell the thread to stop and wait for it */
+  if (control.running) {
+    while ((write(control.wake[1], &c, 1) == -1) && (errno == EINTR)) { }
+    (void) pthread_join(control.thread, NULL);
+    control.running = 0;
+  }
+
+  if (control.lsock != -1) {
+    close(control.lsock);
+    control.lsock = -1;
+  }
+  if (control.pPath != NULL) {
+    (void) unlink(control.pPath);
+    control.pPath = NULL;
+  }
+  if (control.wake[0] != -1) {
+    close(control.wake[0]);
+    control.wake[0] = -1;
+  }
+  if (control.wake[1] != -1) {
+    close(control.wake[1]);
+    control.wake[1] = -1;
+  }
+
+  control.on = 0;
+}
+
+/*
+ * ctl_signal function.
+ */
+static void ctl_signal(int sig) {
+  int     saved = 0;
+  char    c     = 0;
+  ssize_t n     = 0;
+
+  saved = errno;
+  c = (sig == SIGUSR1) ? '+' : '-';
+  n = write(control.wake[1], &c, 1);
+  (void) n;
+  errno = saved;
+}
+
+/*
+ * ctl_command function.
+ */
+static void ctl_command(int fd, const char *pLine) {
+  int          ok    = 1   ;
+  int64_t      rate  = 0   ;
+  int64_t      burst = 0   ;
+  const char * pErr  = NULL;
+  char         reply[MAXLINESIZE];
+
+  /* Check parameters */
+  if (pLine == NULL) {
+    abort();
+  }
+
+  memset(reply, 0, sizeof(reply));
+
+  /* Interpret the command -- "status" just falls through to the
+   * reply */
+  if (strcmp(pLine, "up") == 0) {
+    if (!rate_step(1)) {
+      pErr = "no rate to change";
+    }
+
+  } else if (strcmp(pLine, "down") == 0) {
+    if (!rate_step(0)) {
+      pErr = "no rate to change";
+    }
+
+  } else if (strcmp(pLine, "rate off") == 0) {
+    rate_set(0, 0);
+
+  } else if (strncmp(pLine, "rate ", 5) == 0) {
+    ok = parse_rate(pLine + 5, &rate, &burst);
+    if (ok) {
+      rate_set(rate, burst);
+    } else {
+      pErr = "bad rate";
+    }
+
+  } else if (*pLine == 0) {
+    pErr = "empty or overlong command";
+
+  } else if (strcmp(pLine, "status") != 0) {
+    pErr = "unknown command";
+  }
+
+  /* Reply with the rate now in force, or the error */
+  if (pErr != NULL) {
+    snprintf(reply, sizeof(reply), "error %s\n", pErr);
+  } else {
+    snprintf(reply, sizeof(reply), "ok rate=%lld burst=%lld\n",
+             (long long) pacer.rate, (long long) pacer.burst);
+  }
+
+#ifdef MSG_NOSIGNAL
+  (void) send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+#else
+  (void) send(fd, reply, strlen(reply), 0);
+#endif
+}
+
+/*
+ * ctl_main function.
+ */
+static void *ctl_main(void *pArg) {
+  int           stop   = 0 ;
+  int           client = -1;
+  int           i      = 0 ;
+  int           r      = 0 ;
+  size_t        len    = 0 ;
+  char        * pEnd   = NULL;
+  struct pollfd pfd[2]   ;
+  char          buf[64]  ;
+  char          line[MAXLINESIZE];
+
+  (void) pArg;
+
+  memset(line, 0, sizeof(line));
+
+  while (!stop) {
+    /* Wait for a signal or a stop request on the pipe, and for a
+     * connection or command on the control socket -- only one client
+     * is served at a time */
+    memset(pfd, 0, sizeof(pfd));
+    pfd[0].fd     = control.wake[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = (client != -1) ? client : control.lsock;
+    pfd[1].events = POLLIN;
+    if (poll(pfd, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    /* Step the rate for each signal */
+    if (pfd[0].revents) {
+      r = (int) read(control.wake[0], buf, sizeof(buf));
+      for(i = 0; i < r; i++) {
+        if (buf[i] == 'q') {
+          stop = 1;
+        } else {
+          (void) rate_step((buf[i] == '+') ? 1 : 0);
+        }
+      }
+      if (stop) {
+        break;
+      }
+    }
+
+    if ((pfd[1].fd == -1) || (!pfd[1].revents)) {
+      continue;
+    }
+
+    /* Accept a control client */
+    if (client == -1) {
+      client = accept(control.lsock, NULL, NULL);
+      if (client != -1) {
+        (void) fcntl(client, F_SETFD, FD_CLOEXEC);
+        len = 0;
+      }
+      continue;
+    }
+
+    /* Read commands from the client until it disconnects */
+    r = (int) read(client, line + len, sizeof(line) - 1 - len);
+    if ((r < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if (r <= 0) {
+      close(client);
+      client = -1;
+      continue;
+    }
+    len += (size_t) r;
+    line[len] = 0;
+
+    /* Carry out each complete line */
+    while ((pEnd = strchr(line, '\n')) != NULL) {
+      *pEnd = 0;
+      if ((pEnd > line) && (pEnd[-1] == '\r')) {
+        pEnd[-1] = 0;
+      }
+      ctl_command(client, line);
+      len -= (size_t) (pEnd + 1 - line);
+      memmove(line, pEnd + 1, len + 1);
+    }
+
+    /* A line that fills the buffer is too long to be a command */
+    if (len >= sizeof(line) - 1) {
+      ctl_command(client, "");
+      len = 0;
+      line[0] = 0;
+    }
+  }
+
+  if (client != -1) {
+    close(client);
+  }
+
+  return NULL;
+}
+
+#endif
+
+/*
+ * retry_wait function.
+ */
+static int retry_wait(int64_t deadline, int64_t *pDelay) {
+  int64_t left = 0;
+#ifndef _WIN32
+  struct timespec ts;
+#endif
+
+  /* Check parameters */
+  if (pDelay == NULL) {
+    abort();
+  }
+
+  /* Stop once the deadline has passed */
+  left = deadline - now_ms();
+  if (left <= 0) {
+    return 0;
+  }
+  if (left > *pDelay) {
+    left = *pDelay;
+  }
+
+  /* Sleep */
+#ifdef _WIN32
+  Sleep((DWORD) left);
+#else
+  memset(&ts, 0, sizeof(struct timespec));
+  ts.tv_sec  = (time_t) (left / 1000);
+  ts.tv_nsec = (long) ((left % 1000) * 1000000);
+  while (nanosleep(&ts, &ts) && (errno == EINTR)) { }
+#endif
+
+  /* Back off */
+  *pDelay *= 2;
+  if (*pDelay > RETRYMAX) {
+    *pDelay = RETRYMAX;
+  }
+
+  return 1;
+}
+
+/*
+ * sock_close function.
+ */
+static void sock_close(MSOCKET sock) {
+  if (sock != MSOCKET_NONE) {
+#ifdef _WIN32
+    (void) closesocket(sock);
+#else
+    (void) close(sock);
+#endif
+  }
+}
+
+/*
+ * sock_reset function.
+ */
+static void sock_reset(MSOCKET sock) {
+  struct linger lg;
+
+  if (sock == MSOCKET_NONE) {
+    return;
+  }
+
+  memset(&lg, 0, sizeof(struct linger));
+  lg.l_onoff  = 1;
+  lg.l_linger = 0;
+  (void) setsockopt(
+      sock,
+      SOL_SOCKET,
+      SO_LINGER,
+#ifdef _WIN32
+      (const char *) &lg,
+      (int) sizeof(struct linger)
+#else
+      &lg,
+      (socklen_t) sizeof(struct linger)
+#endif
+    );
+
+  sock_close(sock);
+}
+
+/*
+ * sock_nonblock function.
+ */
+static int sock_nonblock(MSOCKET sock, int nb) {
+#ifdef _WIN32
+/* WIN32-specific --------------------------------------------------- */
+  u_long mode = 0;
+
+  mode = nb ? 1 : 0;
+  return (ioctlsocket(sock, FIONBIO, &mode) == 0);
+/* ================================================================== */
+#else
+/* POSIX-specific --------------------------------------------------- */
+  int flags = 0;
+
+  flags = fcntl(sock, F_GETFL);
+  if (flags == -1) {
+    return 0;
+  }
+  if (nb) {
+    flags |= O_NONBLOCK;
+  } else {
+    flags &= ~O_NONBLOCK;
+  }
+  return (fcntl(sock, F_SETFL, flags) == 0);
+/* ================================================================== */
+#endif
+}
+
+/*
+ * sock_bufs function.
+ */
+static void sock_bufs(MSOCKET sock, int sndbuf, int rcvbuf) {
+  int          i    = 0   ;
+  int          want = 0   ;
+  int          got  = 0   ;
+  int          opt  = 0   ;
+  const char * pDir = NULL;
+#ifdef _WIN32
+  int          glen = 0   ;
+#else
+  socklen_t    glen = 0   ;
+#endif
+
+  for(i = 0; i < 2; i++) {
+    if (i == 0) {
+      opt  = SO_SNDBUF;
+      want = sndbuf;
+      pDir = "send";
+    } else {
+      opt  = SO_RCVBUF;
+      want = rcvbuf;
+      pDir = "receive";
+    }
+    if (want < 1) {
+      continue;
+    }
+
+    if (setsockopt(
+        sock,
+        SOL_SOCKET,
+        opt,
+#ifdef _WIN32
+        (const char *) &want,
+        (int) sizeof(int)
+#else
+        &want,
+        (socklen_t) sizeof(int)
+#endif
+      )) {
+      fprintf(stderr, "Warning:  couldn't set socket %s buffer size.\n",
+              pDir);
+      continue;
+    }
+
+    /* Read the size back to find out whether the system capped it */
+    got = 0;
+#ifdef _WIN32
+    glen = (int) sizeof(int);
+    if (getsockopt(sock, SOL_SOCKET, opt, (char *) &got, &glen)) {
+#else
+    glen = (socklen_t) sizeof(int);
+    if (getsockopt(sock, SOL_SOCKET, opt, &got, &glen)) {
+#endif
+      continue;
+    }
+#ifdef __linux__
+    /* Linux reports twice the size that was set, the rest being room
+     * for its own bookkeeping */
+    got = got / 2;
+#endif
+    if (got < want) {
+      fprintf(stderr,
+        "Warning:  system limited socket %s buffer to %d bytes.\n",
+        pDir, got);
+    }
+  }
+}
+
+/*
+ * sock_tune function.
+ */
+static int sock_tune(MSOCKET sock, const MSOPT *pOpt, int write) {
+  int              status = 1;
+#ifdef TCP_NOTSENT_LOWAT
+  int              lowat  = 0;
+#endif
+#ifdef __linux__
+  struct tcp_info  ti;
+  socklen_t        tlen   = 0;
+  int64_t          want   = 0;
+  int              cur    = 0;
+  socklen_t        clen   = 0;
+  int64_t          limit  = 0;
+  int64_t          ceil   = 0;
+#endif
+
+  /* Check parameters */
+  if (pOpt == NULL) {
+    abort();
+  }
+
+#ifdef TCP_CONGESTION
+  if (pOpt->pCongestion != NULL) {
+    if (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, pOpt->pCongestion,
+                    (socklen_t) strlen(pOpt->pCongestion))) {
+      fprintf(stderr,
+        "Couldn't select congestion control algorithm!\n");
+      status = 0;
+    }
+  }
+#endif
+
+#ifdef TCP_NOTSENT_LOWAT
+  if (status && (pOpt->notsent_lowat > 0)) {
+    lowat = pOpt->notsent_lowat;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                    &lowat, (socklen_t) sizeof(int))) {
+      fprintf(stderr, "Warning:  couldn't set unsent data limit.\n");
+    }
+  }
+#endif
+
+#ifdef __linux__
+  /* Size the buffer in the direction of the transfer for the target
+   * rate, unless it was given explicitly -- the round-trip time from
+   * TCP_INFO is in microseconds, and at this point is the time the
+   * handshake took */
+  if (status && (pOpt->autobuf > 0) &&
+      ((write ? pOpt->sndbuf : pOpt->rcvbuf) < 1)) {
+    memset(&ti, 0, sizeof(struct tcp_info));
+    tlen = (socklen_t) sizeof(struct tcp_info);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &tlen) ||
+        (ti.tcpi_rtt < 1)) {
+      fprintf(stderr,
+        "Warning:  couldn't measure round-trip time for --autobuf.\n");
+    } else {
+      want = (int64_t) (2.0 * ((double) pOpt->autobuf) *
+                        ((double) ti.tcpi_rtt) / 1000000.0);
+      if (want > MAXSOCKBUF) {
+        want = MAXSOCKBUF;
+      }
+
+      /* Setting a size turns off the system's autotuning of the
+       * buffer, which can grow it up to the last value of tcp_wmem or
+       * tcp_rmem, while a size that is set is capped at wmem_max or
+       * rmem_max -- so leave the buffer to autotuning unless the
+       * capped size goes beyond what autotuning can reach */
+      limit = proc_value(write ? "/proc/sys/net/core/wmem_max" :
+                                 "/proc/sys/net/core/rmem_max", 0);
+      ceil  = proc_value(write ? "/proc/sys/net/ipv4/tcp_wmem" :
+                                 "/proc/sys/net/ipv4/tcp_rmem", 2);
+      if ((limit > 0) && (want > limit)) {
+        want = limit;
+      }
+      if ((ceil > 0) && (want <= ceil)) {
+        fprintf(stderr,
+          "Warning:  --autobuf leaves the %s buffer to autotuning, "
+          "which can grow it to %lld bytes.\n",
+          write ? "send" : "receive", (long long) ceil);
+        want = 0;
+      }
+
+      /* Never shrink the buffer the system already has */
+      cur = 0;
+      clen = (socklen_t) sizeof(int);
+      if (getsockopt(sock, SOL_SOCKET, write ? SO_SNDBUF : SO_RCVBUF,
+                      &cur, &clen) == 0) {
+        cur = cur / 2;
+      }
+      if (want > cur) {
+        if (write) {
+          sock_bufs(sock, (int) want, 0);
+        } else {
+          sock_bufs(sock, 0, (int) want);
+        }
+      }
+    }
+  }
+#else
+  (void) write;
+#endif
+
+  /* Return status */
+  return status;
+}
+
+#ifdef __linux__
+
+/*
+ * proc_value function.
+ */
+static int64_t proc_value(const char *pPath, int index) {
+  FILE      * pf = NULL;
+  long long   v  = -1  ;
+  int         i  = 0   ;
+
+  /* Check parameters */
+  if (pPath == NULL) {
+    abort();
+  }
+
+  pf = fopen(pPath, "r");
+  if (pf == NULL) {
+    return -1;
+  }
+
+  /* Skip to the number wanted */
+  for(i = 0; i <= index; i++) {
+    if (fscanf(pf, "%lld", &v) != 1) {
+      v = -1;
+      break;
+    }
+  }
+
+  (void) fclose(pf);
+  return (int64_t) v;
+}
+
+#endif
+
+/*
+ * connect_race function.
+ */
+static MSOCKET connect_race(
+    const struct addrinfo * pList,
+    const MSOPT           * pOpt,
+    int                     write) {
+
+  int                     n       = 0   ;
+  int                     n6      = 0   ;
+  int                     n4      = 0   ;
+  int                     i       = 0   ;
+  int                     j       = 0   ;
+  int                     started = 0   ;
+  int                     live    = 0   ;
+  int                     first6  = 0   ;
+  int                     r       = 0   ;
+  int                     err     = 0   ;
+  int64_t                 next    = 0   ;
+  int64_t                 wait    = 0   ;
+  MSOCKET                 win     = MSOCKET_NONE;
+  MSOCKET                 maxs    = 0   ;
+  const struct addrinfo * pa      = NULL;
+  const struct addrinfo * a6[MAXRACE]   ;
+  const struct addrinfo * a4[MAXRACE]   ;
+  const struct addrinfo * ord[MAXRACE]  ;
+  MSOCKET                 sk[MAXRACE]   ;
+  fd_set                  wset          ;
+  fd_set                  eset          ;
+  struct timeval          tv            ;
+#ifdef _WIN32
+  int                     elen    = 0   ;
+#else
+  socklen_t               elen    = 0   ;
+#endif
+
+  /* Initialize structures */
+  memset(&tv, 0, sizeof(struct timeval));
+  for(i = 0; i < MAXRACE; i++) {
+    sk[i] = MSOCKET_NONE;
+  }
+
+  /* Check parameters */
+  if (pList == NULL) {
+    abort();
+  }
+
+  /* Split the addresses by family, keeping the order of preference
+   * within each family */
+  for(pa = pList; pa != NULL; pa = pa->ai_next) {
+    if ((pa->ai_family == AF_INET6) && (n6 < MAXRACE)) {
+      a6[n6] = pa;
+      n6++;
+    } else if ((pa->ai_family != AF_INET6) && (n4 < MAXRACE)) {
+      a4[n4] = pa;
+      n4++;
+    }
+  }
+  first6 = (pList->ai_family == AF_INET6);
+
+  /* Interleave the families, starting with the preferred one */
+  i = 0;
+  j = 0;
+  while ((n < MAXRACE) && ((i < n6) || (j < n4))) {
+    if (first6 ? (i < n6) : (j >= n4)) {
+      ord[n] = a6[i];
+      i++;
+    } else {
+      ord[n] = a4[j];
+      j++;
+    }
+    n++;
+    first6 = !first6;
+  }
+
+  /* Race the connection attempts */
+  next = now_ms();
+  while (win == MSOCKET_NONE) {
+    /* Start the next attempt if it is time, or if nothing is pending */
+    if ((started < n) && ((live < 1) || (now_ms() >= next))) {
+      i = started;
+      started++;
+
+      sk[i] = socket(ord[i]->ai_family, ord[i]->ai_socktype,
+                      ord[i]->ai_protocol);
+      if (sk[i] == MSOCKET_NONE) {
+        continue;
+      }
+      if (!sock_nonblock(sk[i], 1)) {
+        sock_close(sk[i]);
+        sk[i] = MSOCKET_NONE;
+        continue;
+      }
+      sock_bufs(sk[i], pOpt->sndbuf, pOpt->rcvbuf);
+
+#ifdef TCP_FASTOPEN_CONNECT
+      /* Failing to enable Fast Open just means a normal handshake --
+       * only used when there is nothing to race or retry, since the
+       * connection then completes before the server has been reached */
+      if (pOpt->fastopen && write && (n == 1) && (pOpt->retry < 1)) {
+        err = 1;
+        (void) setsockopt(sk[i], IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                          &err, (socklen_t) sizeof(int));
+      }
+#else
+      (void) write;
+#endif
+
+#ifdef _WIN32
+      r = connect(sk[i], ord[i]->ai_addr, (int) ord[i]->ai_addrlen);
+      if (r != 0) {
+        r = (WSAGetLastError() == WSAEWOULDBLOCK) ? 1 : -1;
+      }
+#else
+      r = connect(sk[i], ord[i]->ai_addr, ord[i]->ai_addrlen);
+      if (r != 0) {
+        r = ((errno == EINPROGRESS) || (errno == EINTR)) ? 1 : -1;
+      }
+#endif
+
+      if (r == 0) {
+        /* Connected immediately, as may happen on loopback */
+        win = sk[i];
+        sk[i] = MSOCKET_NONE;
+        break;
+
+      } else if (r < 0) {
+        /* Failed immediately -- go on to the next one right away */
+        sock_close(sk[i]);
+        sk[i] = MSOCKET_NONE;
+        continue;
+      }
+
+      live++;
+      next = now_ms() + RACEDELAY;
+    }
+
+    /* Stop if everything has failed */
+    if (live < 1) {
+      if (started >= n) {
+        break;
+      }
+      continue;
+    }
+
+    /* Wait for a pending attempt to finish, or until it is time to
+     * start the next one */
+    FD_ZERO(&wset);
+    FD_ZERO(&eset);
+    maxs = 0;
+    for(i = 0; i < started; i++) {
+      if (sk[i] != MSOCKET_NONE) {
+        FD_SET(sk[i], &wset);
+        FD_SET(sk[i], &eset);
+        if (sk[i] > maxs) {
+          maxs = sk[i];
+        }
+      }
+    }
+
+    if (started < n) {
+      wait = next - now_ms();
+      if (wait < 0) {
+        wait = 0;
+      }
+      tv.tv_sec  = (long) (wait / 1000);
+      tv.tv_usec = (long) ((wait % 1000) * 1000);
+      r = select((int) (maxs + 1), NULL, &wset, &eset, &tv);
+    } else {
+      r = select((int) (maxs + 1), NULL, &wset, &eset, NULL);
+    }
+
+    if (r < 0) {
+#ifndef _WIN32
+      if (errno == EINTR) {
+        continue;
+      }
+#endif
+      break;
+    }
+
+    /* Check each attempt that finished */
+    for(i = 0; (r > 0) && (i < started); i++) {
+      if (sk[i] == MSOCKET_NONE) {
+        continue;
+      }
+      if ((!FD_ISSET(sk[i], &wset)) && (!FD_ISSET(sk[i], &eset))) {
+        continue;
+      }
+
+      err = 0;
+      elen = (int) sizeof(int);
+      if (getsockopt(sk[i], SOL_SOCKET, SO_ERROR, (char *) &err, &elen)) {
+        err = 1;
+      }
+
+      if ((err == 0) && (!FD_ISSET(sk[i], &eset))) {
+        win = sk[i];
+        sk[i] = MSOCKET_NONE;
+        break;
+      }
+
+      sock_close(sk[i]);
+      sk[i] = MSOCKET_NONE;
+      live--;
+    }
+  }
+
+  /* Abandon the attempts that lost */
+  for(i = 0; i < started; i++) {
+    sock_close(sk[i]);
+  }
+
+  /* Put the winner back into blocking mode */
+  if (win != MSOCKET_NONE) {
+    if (!sock_nonblock(win, 0)) {
+      sock_close(win);
+      win = MSOCKET_NONE;
+    }
+  }
+
+  /* Return the connected socket */
+  return win;
+}
+
+#ifndef _WIN32
+
+/*
+ * unix_lookup function.
+ */
+static int unix_lookup(
+    const char               * pPath,
+          struct sockaddr_un * pAddr,
+          socklen_t          * pAddrLen) {
+
+  int    status = 1;
+  size_t plen   = 0;
+
+  /* Check parameters */
+  if ((pPath == NULL) || (pAddr == NULL) || (pAddrLen == NULL)) {
+    abort();
+  }
+
+  /* The path must fit in the address with its terminating null */
+  plen = strlen(pPath);
+  if ((plen < 1) || (plen >= sizeof(pAddr->sun_path))) {
+    status = 0;
+  }
+
+  /* Fill in the address */
+  if (status) {
+    memset(pAddr, 0, sizeof(struct sockaddr_un));
+    pAddr->sun_family = AF_UNIX;
+    memcpy(pAddr->sun_path, pPath, plen + 1);
+    *pAddrLen = (socklen_t) sizeof(struct sockaddr_un);
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * pass_fd_write function.
+ */
+static int pass_fd_write(MSOCKET *pSock) {
+  int              status = 1   ;
+  int              fd     = STDIN_FILENO;
+  ssize_t          r      = 0   ;
+  char             tag    = 'F' ;
+  char             hello  = 0   ;
+  char             ack    = 0   ;
+  struct msghdr    msg          ;
+  struct iovec     iov          ;
+  struct cmsghdr * pcm    = NULL;
+  struct pollfd    pfd          ;
+  union {
+    struct cmsghdr align;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+
+  /* Initialize structures */
+  memset(&msg, 0, sizeof(struct msghdr));
+  memset(&iov, 0, sizeof(struct iovec));
+  memset(&pfd, 0, sizeof(struct pollfd));
+  memset(&ctl, 0, sizeof(ctl));
+
+  /* Check parameters */
+  if (pSock == NULL) {
+    abort();
+  }
+
+  /* Wait for the reader to announce that it was given --pass-fd, so
+   * that a plain reader never gets the tag byte below as data; reset
+   * the connection if it doesn't */
+  pfd.fd     = *pSock;
+  pfd.events = POLLIN;
+  do {
+    r = poll(&pfd, 1, PASSFDWAITMS);
+  } while ((r < 0) && (errno == EINTR));
+  if (r == 1) {
+    do {
+      r = recv(*pSock, &hello, 1, 0);
+    } while ((r < 0) && (errno == EINTR));
+  }
+  if ((r != 1) || (hello != 'P')) {
+    fprintf(stderr, "Reader wasn't given --pass-fd!\n");
+    sock_reset(*pSock);
+    *pSock = MSOCKET_NONE;
+    status = 0;
+  }
+
+  /* Attach standard input to a one-byte message */
+  iov.iov_base = &tag;
+  iov.iov_len  = 1;
+
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+
+  pcm = CMSG_FIRSTHDR(&msg);
+  pcm->cmsg_level = SOL_SOCKET;
+  pcm->cmsg_type  = SCM_RIGHTS;
+  pcm->cmsg_len   = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(pcm), &fd, sizeof(int));
+
+  /* Send it */
+  if (status) {
+    do {
+      r = sendmsg(*pSock, &msg, 0);
+    } while ((r < 0) && (errno == EINTR));
+    if (r != 1) {
+      fprintf(stderr, "Couldn't pass standard input to the reader!\n");
+      status = 0;
+    }
+  }
+
+  /* Nothing else is sent, so end the stream */
+  if (status) {
+    (void) shutdown(*pSock, SHUT_WR);
+  }
+
+  /* Wait for the reader to report how the transfer went */
+  if (status) {
+    do {
+      r = recv(*pSock, &ack, 1, 0);
+    } while ((r < 0) && (errno == EINTR));
+    if ((r != 1) || (ack != 'Y')) {
+      fprintf(stderr, "Reader didn't complete the transfer!\n");
+      status = 0;
+    }
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * pass_fd_read function.
+ */
+static int pass_fd_read(CONNBUF *pc) {
+  int              status = 1   ;
+  int              fd     = -1  ;
+  ssize_t          r      = 0   ;
+  char             tag    = 0   ;
+  char             hello  = 'P' ;
+  char             ack    = 'N' ;
+  CONNBUF          cf           ;
+  struct msghdr    msg          ;
+  struct iovec     iov          ;
+  struct cmsghdr * pcm    = NULL;
+  union {
+    struct cmsghdr align;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+
+  /* Initialize structures */
+  memset(&cf, 0, sizeof(CONNBUF));
+  memset(&msg, 0, sizeof(struct msghdr));
+  memset(&iov, 0, sizeof(struct iovec));
+  memset(&ctl, 0, sizeof(ctl));
+
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+
+  /* Announce to the writer that this reader was given --pass-fd */
+  if (send(pc->sock, &hello, 1, 0) != 1) {
+    fprintf(stderr, "Couldn't announce --pass-fd to the writer!\n");
+    status = 0;
+  }
+
+  /* Receive the message carrying the writer's standard input */
+  if (status) {
+    iov.iov_base = &tag;
+    iov.iov_len  = 1;
+
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    do {
+      r = recvmsg(pc->sock, &msg, MSG_CMSG_CLOEXEC);
+    } while ((r < 0) && (errno == EINTR));
+
+    if (r == 1) {
+      for(pcm = CMSG_FIRSTHDR(&msg); pcm != NULL;
+          pcm = CMSG_NXTHDR(&msg, pcm)) {
+        if ((pcm->cmsg_level == SOL_SOCKET) &&
+            (pcm->cmsg_type == SCM_RIGHTS) &&
+            (pcm->cmsg_len >= CMSG_LEN(sizeof(int)))) {
+          memcpy(&fd, CMSG_DATA(pcm), sizeof(int));
+        }
+      }
+    }
+
+    if (fd == -1) {
+      fprintf(stderr, "Writer didn't pass its standard input!\n");
+      status = 0;
+    }
+  }
+
+  /* Transfer from the received descriptor, borrowing the socket
+   * reader's buffer */
+  if (status) {
+    cf.sock = fd;
+    cf.pBuf = pc->pBuf;
+    cf.cap  = pc->cap;
+    cf.pos  = 0;
+    cf.lim  = 0;
+    cf.sink = pc->sink;
+    status = sock_to_out(&cf, -1);
+  }
+
+  if (status) {
+    if (fflush(stdout)) {
+      fprintf(stderr, "Error writing to stdout!\n");
+      status = 0;
+    }
+  }
+
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+
+  /* Tell the writer how it went */
+  if (status) {
+    ack = 'Y';
+  }
+  if (send(pc->sock, &ack, 1, 0) != 1) {
+    fprintf(stderr, "Warning:  couldn't report status to writer.\n");
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * fan_send function.
+ */
+static int fan_send(int *pSock, int n, int bufsize, int drop, int tcp) {
+  int             status = 1   ;
+  char          * pRing  = NULL;
+  int64_t       * pPos   = NULL;
+  struct pollfd * pfd    = NULL;
+  int           * pWho   = NULL;
+  int64_t         qsize  = 0   ;
+  int64_t         head   = 0   ;
+  int64_t         tail   = 0   ;
+  int64_t         lead   = 0   ;
+  int64_t         t0     = 0   ;
+  size_t          off    = 0   ;
+  size_t          want   = 0   ;
+  ssize_t         r      = 0   ;
+  int             live   = 0   ;
+  int             lost   = 0   ;
+  int             eof    = 0   ;
+  int             room   = 0   ;
+  int             npfd   = 0   ;
+  int             i      = 0   ;
+  int             j      = 0   ;
+
+  /* Check parameters */
+  if ((pSock == NULL) || (n < 1)) {
+    abort();
+  }
+
+  /* Allocate the ring, the position of each reader in the input, and
+   * the poll table with the reader each entry belongs to (-1 for
+   * standard input) */
+  qsize = FANQUEUE;
+  if (qsize < ((int64_t) bufsize) * 2) {
+    qsize = ((int64_t) bufsize) * 2;
+  }
+  pRing = (char *) malloc((size_t) qsize);
+  pPos  = (int64_t *) calloc((size_t) n, sizeof(int64_t));
+  pfd   = (struct pollfd *) calloc((size_t) n + 1, sizeof(struct pollfd));
+  pWho  = (int *) calloc((size_t) n + 1, sizeof(int));
+  if ((pRing == NULL) || (pPos == NULL) || (pfd == NULL) ||
+      (pWho == NULL)) {
+    fprintf(stderr, "Couldn't allocate fan-out queue!\n");
+    status = 0;
+  }
+
+  /* A reader going away must only disconnect that reader, rather than
+   * end the whole process with SIGPIPE */
+  if (status) {
+    (void) signal(SIGPIPE, SIG_IGN);
+    for(i = 0; i < n; i++) {
+      if (!sock_nonblock(pSock[i], 1)) {
+        fprintf(stderr, "Couldn't set up reader connections!\n");
+        status = 0;
+        break;
+      }
+    }
+    live = n;
+  }
+
+  while (status && (live > 0)) {
+    /* Find how far the slowest and the fastest readers have got */
+    tail = head;
+    lead = 0;
+    for(i = 0; i < n; i++) {
+      if (pSock[i] != -1) {
+        if (pPos[i] < tail) {
+          tail = pPos[i];
+        }
+        if (pPos[i] > lead) {
+          lead = pPos[i];
+        }
+      }
+    }
+
+    /* With --slow=drop, when the slowest readers are holding up the
+     * input, disconnect those that are a whole ring behind the
+     * fastest one */
+    if (drop && (!eof) && (qsize - (head - tail) < (int64_t) bufsize)) {
+      j = 0;
+      for(i = 0; i < n; i++) {
+        if ((pSock[i] != -1) &&
+            (lead - pPos[i] > qsize - (int64_t) bufsize)) {
+          fprintf(stderr,
+            "Warning:  reader %d fell behind and was dropped.\n", i + 1);
+          sock_reset(pSock[i]);
+          pSock[i] = -1;
+          live--;
+          lost++;
+          j = 1;
+        }
+      }
+      if (j) {
+        continue;
+      }
+    }
+
+    /* Wait for room to read input into, if there is any room for a
+     * whole block, and for the readers that have data waiting to be
+     * able to take more -- generated data is always ready */
+    room = (!eof) && (qsize - (head - tail) >= (int64_t) bufsize);
+    npfd = 0;
+    if (room && (!source.on)) {
+      pfd[npfd].fd      = STDIN_FILENO;
+      pfd[npfd].events  = POLLIN;
+      pfd[npfd].revents = 0;
+      pWho[npfd] = -1;
+      npfd++;
+    }
+    for(i = 0; i < n; i++) {
+      if ((pSock[i] != -1) && (pPos[i] < head)) {
+        pfd[npfd].fd      = pSock[i];
+        pfd[npfd].events  = POLLOUT;
+        pfd[npfd].revents = 0;
+        pWho[npfd] = i;
+        npfd++;
+      }
+    }
+
+    if (poll(pfd, (nfds_t) npfd, (room && source.on) ? 0 : -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error waiting for readers!\n");
+      status = 0;
+      break;
+    }
+
+    /* Read the next block of input into the ring, up to the end of the
+     * ring and the --rate burst */
+    if (room && (source.on || (pfd[0].revents != 0))) {
+      off  = (size_t) (head % qsize);
+      want = (size_t) bufsize;
+      if (want > (size_t) qsize - off) {
+        want = (size_t) qsize - off;
+      }
+      want = rate_chunk(want);
+
+      t0 = stat_begin();
+      if (source.on) {
+        r = (ssize_t) in_read(pRing + off, want);
+        if ((size_t) r < want) {
+          eof = 1;
+        }
+      } else {
+        r = read(STDIN_FILENO, pRing + off, want);
+        if (r == 0) {
+          eof = 1;
+        } else if ((r < 0) && ((errno == EINTR) || (errno == EAGAIN))) {
+          r = 0;
+        } else if (r < 0) {
+          fprintf(stderr, "Error reading from stdin!\n");
+          status = 0;
+        }
+      }
+      stat_end(STAT_INPUT, t0, (r > 0) ? (int64_t) r : 0);
+
+      if (r > 0) {
+        head += (int64_t) r;
+        prog_add((int64_t) r);
+        rate_pace((int64_t) r);
+      }
+    }
+
+    /* Send each reader that can take more as much of what it hasn't
+     * had yet as fits, up to the end of the ring */
+    for(j = 0; status && (j < npfd); j++) {
+      i = pWho[j];
+      if ((i < 0) || (pfd[j].revents == 0)) {
+        continue;
+      }
+
+      off  = (size_t) (pPos[i] % qsize);
+      want = (size_t) (head - pPos[i]);
+      if (want > (size_t) qsize - off) {
+        want = (size_t) qsize - off;
+      }
+
+      t0 = stat_begin();
+      r = send(pSock[i], pRing + off, want, 0);
+      if ((r < 0) && ((errno == EINTR) || (errno == EAGAIN) ||
+                      (errno == EWOULDBLOCK))) {
+        r = 0;
+      } else if (r < 0) {
+        fprintf(stderr,
+          "Warning:  reader %d disconnected.\n", i + 1);
+        sock_reset(pSock[i]);
+        pSock[i] = -1;
+        live--;
+        lost++;
+        continue;
+      }
+      stat_end(STAT_SEND, t0, (int64_t) r);
+      pPos[i] += (int64_t) r;
+    }
+
+    /* Once the input has ended, let go of the readers that have been
+     * sent all of it, recording the TCP state of the first */
+    for(i = 0; eof && (i < n); i++) {
+      if ((pSock[i] != -1) && (pPos[i] == head)) {
+        if (tcp && (!stats.tcp)) {
+          stat_tcp(pSock[i]);
+        }
+        if (shutdown(pSock[i], SHUT_RDWR)) {
+          fprintf(stderr, "Warning:  socket shutdown failed.\n");
+        }
+        sock_close(pSock[i]);
+        pSock[i] = -1;
+        live--;
+      }
+    }
+  }
+
+  if (status && (lost > 0)) {
+    fprintf(stderr, "%d of %d readers didn't get all the data!\n",
+      lost, n);
+    status = 0;
+  }
+
+  /* On failure, reset the connections of the readers that are left,
+   * so that they fail too */
+  for(i = 0; i < n; i++) {
+    if (pSock[i] != -1) {
+      sock_reset(pSock[i]);
+      pSock[i] = -1;
+    }
+  }
+
+  if (pWho != NULL) {
+    free(pWho);
+    pWho = NULL;
+  }
+  if (pfd != NULL) {
+    free(pfd);
+    pfd = NULL;
+  }
+  if (pPos != NULL) {
+    free(pPos);
+    pPos = NULL;
+  }
+  if (pRing != NULL) {
+    free(pRing);
+    pRing = NULL;
+  }
+
+  /* Return status */
+  return status;
+}
+
+#endif
+
+#ifdef __linux__
+
+/*
+ * shm_futex_wait function.
+ */
+static void shm_futex_wait(uint32_t *pWord, uint32_t val) {
+  struct timespec ts;
+
+  memset(&ts, 0, sizeof(struct timespec));
+  ts.tv_sec  = SHMPOLLMS / 1000;
+  ts.tv_nsec = (long) (SHMPOLLMS % 1000) * 1000000L;
+
+  (void) syscall(SYS_futex, pWord, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+/*
+ * shm_futex_wake function.
+ */
+static void shm_futex_wake(uint32_t *pWord) {
+  (void) syscall(SYS_futex, pWord, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/*
+ * shm_alive function.
+ */
+static int shm_alive(int32_t pid) {
+  return ((kill((pid_t) pid, 0) == 0) || (errno == EPERM));
+}
+
+/*
+ * shm_produce function.
+ */
+static int shm_produce(
+    SHMHDR      * ph,
+    char        * pRing,
+    int32_t       peer,
+    const MSOPT * pOpt) {
+
+  int      status = 1;
+  int      ended  = 0;
+  uint64_t head   = 0;
+  uint64_t mask   = 0;
+  uint64_t space  = 0;
+  uint64_t off    = 0;
+  uint32_t seq    = 0;
+  size_t   want   = 0;
+  size_t   chunk  = 0;
+  ssize_t  got    = 0;
+  int64_t  t0     = 0;
+
+  /* Check parameters */
+  if ((ph == NULL) || (pRing == NULL) || (pOpt == NULL)) {
+    abort();
+  }
+
+  chunk = (pOpt->bufsize > 0) ? (size_t) pOpt->bufsize : SHMCHUNK;
+
+  head = ph->head;
+  mask = ph->size - 1;
+
+  /* Fill the ring from standard input until it ends */
+  while (status && (!ended)) {
+    /* Find out how much free space there is, sleeping until there is
+     * some -- the sequence number is read first, so that a change
+     * after the check makes the sleep return right away */
+    seq = __atomic_load_n(&(ph->sseq), __ATOMIC_ACQUIRE);
+    space = ph->size - (head - __atomic_load_n(&(ph->tail),
+                                                __ATOMIC_ACQUIRE));
+    if (__atomic_load_n(&(ph->done), __ATOMIC_ACQUIRE) != 0) {
+      fprintf(stderr, "Reader stopped before the end of the data!\n");
+      status = 0;
+      break;
+    }
+
+    if (space < 1) {
+      __atomic_store_n(&(ph->pwait), 1, __ATOMIC_SEQ_CST);
+      space = ph->size - (head - __atomic_load_n(&(ph->tail),
+                                                  __ATOMIC_SEQ_CST));
+      if (space < 1) {
+        t0 = stat_begin();
+        shm_futex_wait(&(ph->sseq), seq);
+        stat_end(STAT_WAIT, t0, 0);
+        if (!shm_alive(peer)) {
+          fprintf(stderr, "Reader went away!\n");
+          status = 0;
+        }
+      }
+      __atomic_store_n(&(ph->pwait), 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    /* Read straight into the free space, not past the end of the ring
+     * buffer */
+    off = head & mask;
+    want = chunk;
+    if ((uint64_t) want > space) {
+      want = (size_t) space;
+    }
+    if ((uint64_t) want > ph->size - off) {
+      want = (size_t) (ph->size - off);
+    }
+
+    t0 = stat_begin();
+    if (source.on) {
+      got = (ssize_t) in_read(pRing + off, want);
+    } else {
+      got = read(STDIN_FILENO, pRing + off, want);
+    }
+    stat_end(STAT_INPUT, t0, (int64_t) got);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error reading from stdin!\n");
+      status = 0;
+      break;
+    } else if (got == 0) {
+      ended = 1;
+    }
+    prog_add((int64_t) got);
+
+    /* Publish the new data, or the end of the data */
+    head += (uint64_t) got;
+    __atomic_store_n(&(ph->head), head, __ATOMIC_RELEASE);
+    if (ended) {
+      __atomic_store_n(&(ph->eof), 1, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&(ph->dseq), 1, __ATOMIC_SEQ_CST);
+    if (ended || __atomic_load_n(&(ph->cwait), __ATOMIC_SEQ_CST)) {
+      shm_futex_wake(&(ph->dseq));
+    }
+  }
+
+  /* If we failed, tell the reader */
+  if (!status) {
+    __atomic_store_n(&(ph->eof), 2, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&(ph->dseq), 1, __ATOMIC_SEQ_CST);
+    shm_futex_wake(&(ph->dseq));
+  }
+
+  /* Wait for the reader to finish writing everything out */
+  while (status) {
+    seq = __atomic_load_n(&(ph->sseq), __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&(ph->done), __ATOMIC_ACQUIRE) == 1) {
+      break;
+    } else if (__atomic_load_n(&(ph->done), __ATOMIC_ACQUIRE) != 0) {
+      fprintf(stderr, "Reader didn't complete the transfer!\n");
+      status = 0;
+      break;
+    }
+
+    __atomic_store_n(&(ph->pwait), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(ph->done), __ATOMIC_SEQ_CST) == 0) {
+      t0 = stat_begin();
+      shm_futex_wait(&(ph->sseq), seq);
+      stat_end(STAT_WAIT, t0, 0);
+      if ((__atomic_load_n(&(ph->done), __ATOMIC_SEQ_CST) == 0) &&
+          (!shm_alive(peer))) {
+        fprintf(stderr, "Reader went away!\n");
+        status = 0;
+      }
+    }
+    __atomic_store_n(&(ph->pwait), 0, __ATOMIC_RELAXED);
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * shm_consume function.
+ */
+static int shm_consume(
+    SHMHDR      * ph,
+    char        * pRing,
+    int32_t       peer,
+    const MSOPT * pOpt) {
+
+  int      status = 1;
+  uint32_t eof    = 0;
+  uint64_t tail   = 0;
+  uint64_t mask   = 0;
+  uint64_t avail  = 0;
+  uint64_t off    = 0;
+  uint32_t seq    = 0;
+  size_t   want   = 0;
+  size_t   chunk  = 0;
+  ssize_t  put    = 0;
+  int64_t  t0     = 0;
+
+  /* Check parameters */
+  if ((ph == NULL) || (pRing == NULL) || (pOpt == NULL)) {
+    abort();
+  }
+
+  chunk = (pOpt->bufsize > 0) ? (size_t) pOpt->bufsize : SHMCHUNK;
+
+  tail = ph->tail;
+  mask = ph->size - 1;
+
+  /* Anything buffered by the standard library goes first */
+  if (fflush(stdout)) {
+    fprintf(stderr, "Error writing to stdout!\n");
+    status = 0;
+  }
+
+  /* Drain the ring to standard output until the writer is done */
+  while (status) {
+    /* Find out how much data there is, sleeping until there is some
+     * or the writer is done -- the end flag is read before the head,
+     * so that no data published before it is missed */
+    seq = __atomic_load_n(&(ph->dseq), __ATOMIC_ACQUIRE);
+    eof = __atomic_load_n(&(ph->eof), __ATOMIC_ACQUIRE);
+    avail = __atomic_load_n(&(ph->head), __ATOMIC_ACQUIRE) - tail;
+
+    if ((avail < 1) && (eof == 1)) {
+      break;
+    } else if (eof > 1) {
+      fprintf(stderr, "Writer failed!\n");
+      status = 0;
+      break;
+    }
+
+    if (avail < 1) {
+      __atomic_store_n(&(ph->cwait), 1, __ATOMIC_SEQ_CST);
+      if ((__atomic_load_n(&(ph->head), __ATOMIC_SEQ_CST) == tail) &&
+          (__atomic_load_n(&(ph->eof), __ATOMIC_SEQ_CST) == 0)) {
+        t0 = stat_begin();
+        shm_futex_wait(&(ph->dseq), seq);
+        stat_end(STAT_WAIT, t0, 0);
+        if (!shm_alive(peer)) {
+          fprintf(stderr, "Writer went away!\n");
+          status = 0;
+        }
+      }
+      __atomic_store_n(&(ph->cwait), 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    /* Write straight from the ring, not past the end of the ring
+     * buffer */
+    off = tail & mask;
+    want = chunk;
+    if ((uint64_t) want > avail) {
+      want = (size_t) avail;
+    }
+    if ((uint64_t) want > ph->size - off) {
+      want = (size_t) (ph->size - off);
+    }
+
+    t0 = stat_begin();
+    if (pOpt->sink) {
+      put = (ssize_t) want;
+    } else {
+      put = write(STDOUT_FILENO, pRing + off, want);
+    }
+    stat_end(STAT_OUTPUT, t0, (int64_t) put);
+    if (put < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error writing to stdout!\n");
+      status = 0;
+      break;
+    }
+
+    prog_add((int64_t) put);
+
+    /* Hand the space back to the writer */
+    tail += (uint64_t) put;
+    __atomic_store_n(&(ph->tail), tail, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&(ph->sseq), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(ph->pwait), __ATOMIC_SEQ_CST)) {
+      shm_futex_wake(&(ph->sseq));
+    }
+  }
+
+  /* Report the outcome to the writer */
+  __atomic_store_n(&(ph->done), status ? 1 : 2, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&(ph->sseq), 1, __ATOMIC_SEQ_CST);
+  shm_futex_wake(&(ph->sseq));
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * shm_speak function.
+ */
+static int shm_speak(
+    int           server,
+    int           write,
+    const char  * pName,
+    const MSOPT * pOpt) {
+
+  int          status = 1   ;
+  int          fd     = -1  ;
+  int          named  = 0   ;
+  int          r      = 0   ;
+  int32_t      peer   = 0   ;
+  uint32_t     seq    = 0   ;
+  int64_t      deadline = 0 ;
+  int64_t      delay  = 0   ;
+  size_t       slen   = 0   ;
+  SHMHDR     * ph     = NULL;
+  void       * pMap   = NULL;
+  char       * pPath  = NULL;
+  struct stat  st           ;
+
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+
+  /* Check parameters */
+  if ((pName == NULL) || (pOpt == NULL)) {
+    abort();
+  }
+
+  /* Segment names are a single component beginning with a slash */
+  if (*pName == '/') {
+    pName++;
+  }
+  if ((*pName == 0) || (strchr(pName, '/') != NULL)) {
+    fprintf(stderr, "Address is not valid!\n");
+    status = 0;
+  }
+
+  if (status) {
+    pPath = (char *) malloc(strlen(pName) + 2);
+    if (pPath == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      status = 0;
+    }
+  }
+  if (status) {
+    pPath[0] = '/';
+    strcpy(pPath + 1, pName);
+  }
+
+  /* The server creates the segment, replacing one left behind by an
+   * earlier server, and reserves its memory up front so that running
+   * out shows up here rather than as a crash later */
+  slen = SHMHDRSIZE + SHMRINGSIZE;
+  if (status && server) {
+    fd = shm_open(pPath, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if ((fd == -1) && (errno == EEXIST)) {
+      (void) shm_unlink(pPath);
+      fd = shm_open(pPath, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    }
+    if (fd == -1) {
+      fprintf(stderr, "Could not create shared memory!\n");
+      status = 0;
+    } else {
+      named = 1;
+    }
+
+    if (status) {
+      r = posix_fallocate(fd, 0, (off_t) slen);
+      if (r != 0) {
+        fprintf(stderr, "Could not allocate shared memory!\n");
+        status = 0;
+      }
+    }
+
+  /* The client attaches to the existing segment, which with --retry
+   * it waits for with backoff; the segment isn't ready to use until
+   * the server has filled in the control block */
+  } else if (status) {
+    deadline = now_ms() + ((int64_t) pOpt->retry) * 1000;
+    delay = RETRYMIN;
+    for(;;) {
+      fd = shm_open(pPath, O_RDWR | O_CLOEXEC, 0);
+      if (fd != -1) {
+        if (fstat(fd, &st) == 0) {
+          if ((size_t) st.st_size == slen) {
+            pMap = mmap(NULL, SHMHDRSIZE, PROT_READ, MAP_SHARED, fd, 0);
+            if (pMap != MAP_FAILED) {
+              ph = (SHMHDR *) pMap;
+              r = (__atomic_load_n(&(ph->magic), __ATOMIC_ACQUIRE)
+                    == SHMMAGIC);
+              (void) munmap(pMap, SHMHDRSIZE);
+              if (r) {
+                break;
+              }
+            }
+          }
+        }
+        close(fd);
+        fd = -1;
+      }
+      if (!retry_wait(deadline, &delay)) {
+        break;
+      }
+    }
+    pMap = NULL;
+    ph = NULL;
+
+    if (fd == -1) {
+      fprintf(stderr, "Could not connect to server!\n");
+      status = 0;
+    }
+  }
+
+  /* Map the whole segment, populating it so that the transfer doesn't
+   * take page faults */
+  if (status) {
+    pMap = mmap(NULL, slen, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (pMap == MAP_FAILED) {
+      pMap = NULL;
+      fprintf(stderr, "Could not map shared memory!\n");
+      status = 0;
+    }
+  }
+  if (status) {
+    ph = (SHMHDR *) pMap;
+  }
+
+  /* Rendezvous -- the server fills in the control block and then waits
+   * for the client to say it has attached, while the client checks the
+   * control block, claims it, and says so */
+  if (status && server) {
+    ph->size = SHMRINGSIZE;
+    ph->spid = (int32_t) getpid();
+    __atomic_store_n(&(ph->magic), SHMMAGIC, __ATOMIC_RELEASE);
+
+    for(;;) {
+      seq = __atomic_load_n(&(ph->attached), __ATOMIC_ACQUIRE);
+      if (seq == 1) {
+        break;
+      }
+      shm_futex_wait(&(ph->attached), seq);
+    }
+    peer = __atomic_load_n(&(ph->cpid), __ATOMIC_ACQUIRE);
+
+    /* Nobody else may attach, so remove the name */
+    (void) shm_unlink(pPath);
+    named = 0;
+
+  } else if (status) {
+    if ((__atomic_load_n(&(ph->magic), __ATOMIC_ACQUIRE) != SHMMAGIC) ||
+        (ph->size != SHMRINGSIZE)) {
+      fprintf(stderr, "Could not connect to server!\n");
+      status = 0;
+    }
+
+    /* Only one client may claim the ring -- one that loses the race to
+     * another fails */
+    if (status) {
+      seq = 0;
+      if (!__atomic_compare_exchange_n(&(ph->attached), &seq, 2, 0,
+                                       __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE)) {
+        fprintf(stderr, "Could not connect to server!\n");
+        status = 0;
+      }
+    }
+
+    if (status) {
+      peer = ph->spid;
+      __atomic_store_n(&(ph->cpid), (int32_t) getpid(), __ATOMIC_RELEASE);
+      __atomic_store_n(&(ph->attached), 1, __ATOMIC_RELEASE);
+      shm_futex_wake(&(ph->attached));
+    }
+  }
+
+  if (status) {
+    phase_end(PHASE_CONNECT);
+    prog_begin();
+  }
+
+  /* Transfer the data */
+  if (status && write) {
+    status = shm_produce(ph, ((char *) pMap) + SHMHDRSIZE, peer, pOpt);
+  } else if (status) {
+    status = shm_consume(ph, ((char *) pMap) + SHMHDRSIZE, peer, pOpt);
+  }
+
+  /* Release everything */
+  if (pMap != NULL) {
+    (void) munmap(pMap, slen);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (named) {
+    (void) shm_unlink(pPath);
+  }
+  free(pPath);
+
+  /* Return status */
+  return status;
+}
+
+#endif
+
+/*
+ * str_ieq function.
+ */
+static int str_ieq(const char *pA, const char *pB, size_t n) {
+  int    result = 1;
+  int    ca     = 0;
+  int    cb     = 0;
+  size_t i      = 0;
+
+  /* Check parameters */
+  if ((pA == NULL) || (pB == NULL)) {
+    abort();
+  }
+
+  /* Compare each character, folding ASCII uppercase to lowercase */
+  for(i = 0; i < n; i++) {
+    ca = (int) (unsigned char) pA[i];
+    cb = (int) (unsigned char) pB[i];
+
+    if ((ca >= 'A') && (ca <= 'Z')) {
+      ca = ca - 'A' + 'a';
+    }
+    if ((cb >= 'A') && (cb <= 'Z')) {
+      cb = cb - 'A' + 'a';
+    }
+
+    if (ca != cb) {
+      result = 0;
+      break;
+    }
+
+    if (ca == 0) {
+      break;
+    }
+  }
+
+  /* Return result */
+  return result;
+}
+
+/*
+ * connbuf_fill function.
+ */
+static int connbuf_fill(CONNBUF *pc) {
+  int     rcount = 0;
+  int64_t t0     = 0;
+
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+
+  /* Reset the buffer and receive into it */
+  pc->pos = 0;
+  pc->lim = 0;
+
+  t0 = stat_begin();
+  rcount = (int) recv(pc->sock, pc->pBuf, pc->cap, 0);
+  stat_end(STAT_RECV, t0, rcount);
+  if (rcount > 0) {
+    pc->lim = rcount;
+  }
+
+  /* Return the receive count */
+  return rcount;
+}
+
+/*
+ * connbuf_header function.
+ */
+static int connbuf_header(
+    CONNBUF * pc,
+    char    * pHdr,
+    int       maxhdr,
+    int     * pTrunc) {
+
+  int  result = 0;
+  int  hlen   = 0;
+  int  lf_flg = 0;
+  int  rcount = 0;
+  char c      = 0;
+
+  /* Check parameters */
+  if ((pc == NULL) || (pHdr == NULL) || (pTrunc == NULL) ||
+      (maxhdr < 1)) {
+    abort();
+  }
+
+  /* Clear truncation flag */
+  *pTrunc = 0;
+
+  /* Consume characters until end of header, end of data, or error */
+  while (!result) {
+    /* Refill the buffer if all of it has been consumed */
+    if (pc->pos >= pc->lim) {
+      rcount = connbuf_fill(pc);
+      if (rcount < 1) {
+        result = rcount;
+        break;
+      }
+    }
+
+    /* Consume the next character, copying it into the header buffer
+     * if there is room, or setting the truncation flag otherwise */
+    c = pc->pBuf[pc->pos];
+    (pc->pos)++;
+
+    if (hlen < maxhdr - 1) {
+      pHdr[hlen] = c;
+      hlen++;
+    } else {
+      *pTrunc = 1;
+    }
+
+    /* Ignore CR characters */
+    if (c == ASCII_CR) {
+      continue;
+    }
+
+    /* LF character -- if lf_flg already set, we got two line breaks in
+     * a row, so the header is done; else, set lf_flg; any other
+     * character resets lf_flg */
+    if (c == ASCII_LF) {
+      if (lf_flg) {
+        result = 1;
+      } else {
+        lf_flg = 1;
+      }
+
+    } else {
+      lf_flg = 0;
+    }
+  }
+
+  /* Terminate the header */
+  pHdr[hlen] = 0;
+
+  /* Return result */
+  return result;
+}
+
+/*
+ * connbuf_line function.
+ */
+static int connbuf_line(CONNBUF *pc, char *pLine, int maxline) {
+  int  status = 1;
+  int  llen   = 0;
+  char c      = 0;
+
+  /* Check parameters */
+  if ((pc == NULL) || (pLine == NULL) || (maxline < 1)) {
+    abort();
+  }
+
+  /* Consume characters until LF */
+  while (status) {
+    /* Refill the buffer if all of it has been consumed */
+    if (pc->pos >= pc->lim) {
+      if (connbuf_fill(pc) < 1) {
+        status = 0;
+        break;
+      }
+    }
+
+    /* Consume the next character */
+    c = pc->pBuf[pc->pos];
+    (pc->pos)++;
+
+    /* Stop at LF and skip CR */
+    if (c == ASCII_LF) {
+      break;
+    } else if (c == ASCII_CR) {
+      continue;
+    }
+
+    /* Add other characters to the line if there is room */
+    if (llen < maxline - 1) {
+      pLine[llen] = c;
+      llen++;
+    } else {
+      status = 0;
+    }
+  }
+
+  /* Terminate the line */
+  pLine[llen] = 0;
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * http_field function.
+ */
+static int http_field(
+    const char * pHdr,
+    const char * pName,
+          char * pVal,
+          int    maxval) {
+
+  int          result = 0   ;
+  size_t       nlen   = 0   ;
+  const char * pc     = NULL;
+  const char * pe     = NULL;
+
+  /* Check parameters */
+  if ((pHdr == NULL) || (pName == NULL) || (pVal == NULL) ||
+      (maxval < 1)) {
+    abort();
+  }
+
+  /* Clear the value */
+  pVal[0] = 0;
+  nlen = strlen(pName);
+
+  /* Skip the request line */
+  pc = strchr(pHdr, ASCII_LF);
+
+  /* Go through each header line */
+  while ((pc != NULL) && (!result)) {
+    /* Move past the line break to the start of the line */
+    pc++;
+
+    /* Check whether this line is the field we want */
+    if (str_ieq(pc, pName, nlen) && (pc[nlen] == ':')) {
+      /* Found it -- skip leading whitespace in the value */
+      result = 1;
+      pc += nlen + 1;
+      while ((*pc == ' ') || (*pc == '\t')) {
+        pc++;
+      }
+
+      /* Find the end of the value, not including trailing
+       * whitespace */
+      pe = pc;
+      while ((*pe != 0) && (*pe != ASCII_LF)) {
+        pe++;
+      }
+      while ((pe > pc) && ((pe[-1] == ASCII_CR) || (pe[-1] == ' ') ||
+              (pe[-1] == '\t'))) {
+        pe--;
+      }
+
+      /* Copy the value if it fits */
+      if (pe - pc < maxval) {
+        memcpy(pVal, pc, (size_t) (pe - pc));
+        pVal[pe - pc] = 0;
+      } else {
+        result = -1;
+      }
+
+    } else {
+      /* Not the field we want -- go to the next line */
+      pc = strchr(pc, ASCII_LF);
+    }
+  }
+
+  /* Return result */
+  return result;
+}
+
+/*
+ * etag_match function.
+ */
+static int etag_match(const char *pList, const char *pTag) {
+  int          result = 0   ;
+  size_t       tlen   = 0   ;
+  const char * pe     = NULL;
+
+  /* Check parameters */
+  if ((pList == NULL) || (pTag == NULL)) {
+    abort();
+  }
+
+  tlen = strlen(pTag);
+
+  /* Go through each element of the list */
+  while ((*pList != 0) && (!result)) {
+    /* Skip separators */
+    if ((*pList == ',') || (*pList == ' ') || (*pList == '\t')) {
+      pList++;
+      continue;
+    }
+
+    /* A wildcard matches any current file */
+    if (*pList == '*') {
+      result = 1;
+      break;
+    }
+
+    /* Ignore the weak indicator */
+    if ((pList[0] == 'W') && (pList[1] == '/')) {
+      pList += 2;
+    }
+
+    /* Anything else must be a quoted tag; stop at garbage */
+    if (*pList != '"') {
+      break;
+    }
+    pe = strchr(pList + 1, '"');
+    if (pe == NULL) {
+      break;
+    }
+    pe++;
+
+    /* Compare it, quotes included */
+    if (((size_t) (pe - pList) == tlen) &&
+        (memcmp(pList, pTag, tlen) == 0)) {
+      result = 1;
+    }
+    pList = pe;
+  }
+
+  /* Return result */
+  return result;
+}
+
+/*
+ * send_all function.
+ */
+static int send_all(MSOCKET sock, const char *pData, int len, int flags) {
+  int     status = 1;
+  int     scount = 0;
+  int64_t t0     = 0;
+
+  /* Check parameters */
+  if (pData == NULL) {
+    abort();
+  }
+
+  /* Keep sending until everything is sent or there is an error */
+  while (len > 0) {
+    t0 = stat_begin();
+    scount = (int) send(sock, pData, len, flags);
+    stat_end(STAT_SEND, t0, scount);
+    if (scount < 1) {
+      status = 0;
+      break;
+    }
+
+    pData += scount;
+    len -= scount;
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * sock_to_out function.
+ */
+static int sock_to_out(CONNBUF *pc, int64_t count) {
+  int         status = 1 ;
+  int         rcount = 0 ;
+  int         use_sp = 0 ;
+  int64_t     t0     = 0 ;
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+  struct stat st         ;
+  int         pfd[2]     ;
+  int         direct = 0 ;
+  int         any    = 0 ;
+  size_t      want   = 0 ;
+  ssize_t     moved  = 0 ;
+  ssize_t     drain  = 0 ;
+  ssize_t     got    = 0 ;
+/* ================================================================== */
+#endif
+
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+  pfd[0] = -1;
+  pfd[1] = -1;
+
+/* ================================================================== */
+#endif
+
+  /* First, write out anything that is already buffered */
+  if (status && (pc->pos < pc->lim) && (count != 0)) {
+    rcount = pc->lim - pc->pos;
+    if ((count >= 0) && (count < (int64_t) rcount)) {
+      rcount = (int) count;
+    }
+
+    if (!pc->sink) {
+      t0 = stat_begin();
+      if (fwrite(pc->pBuf + pc->pos, 1, (size_t) rcount, stdout) !=
+            (size_t) rcount) {
+        fprintf(stderr, "Error writing to stdout!\n");
+        status = 0;
+      }
+      stat_end(STAT_OUTPUT, t0, status ? rcount : 0);
+    }
+
+    if (status) {
+      pc->pos += rcount;
+      prog_add((int64_t) rcount);
+      rate_pace((int64_t) rcount);
+      if (count > 0) {
+        count -= (int64_t) rcount;
+      }
+    }
+  }
+
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+
+  /* Decide whether to splice -- pipes can be spliced into directly,
+   * while sockets and regular files need an intermediate pipe; other
+   * kinds of output (such as terminals) use the standard library; with
+   * --sink there is no output, so just read */
+  if (status && (count != 0) && (!pc->sink)) {
+    if (fstat(STDOUT_FILENO, &st) == 0) {
+      if (S_ISFIFO(st.st_mode)) {
+        use_sp = 1;
+        direct = 1;
+      } else if (S_ISREG(st.st_mode) || S_ISSOCK(st.st_mode)) {
+        use_sp = 1;
+      }
+    }
+  }
+
+  /* Since we are about to write directly to the output file
+   * descriptor, flush anything buffered by the standard library */
+  if (status && use_sp) {
+    if (fflush(stdout)) {
+      fprintf(stderr, "Error writing to stdout!\n");
+      status = 0;
+    }
+  }
+
+  /* Create the intermediate pipe if necessary and try to make it big
+   * enough that each splice moves a large amount of data; if the pipe
+   * can't be created, fall back to copying */
+  if (status && use_sp && (!direct)) {
+    if (pipe2(pfd, O_CLOEXEC) == 0) {
+      (void) fcntl(pfd[1], F_SETPIPE_SZ, SPLICECHUNK);
+    } else {
+      pfd[0] = -1;
+      pfd[1] = -1;
+      use_sp = 0;
+    }
+  }
+
+  /* Splice until we have everything, the connection ends, or there is
+   * an error */
+  while (status && use_sp && (count != 0)) {
+    /* Determine how much to ask for */
+    want = rate_chunk(SPLICECHUNK);
+    if ((count > 0) && (count < (int64_t) want)) {
+      want = (size_t) count;
+    }
+
+    /* Move data from the socket into the output or the pipe */
+    t0 = stat_begin();
+    moved = splice(pc->sock, NULL, direct ? STDOUT_FILENO : pfd[1], NULL,
+                    want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    stat_end(STAT_RECV, t0, (int64_t) moved);
+    if (moved < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if ((errno == EINVAL) && (!any)) {
+        /* The source doesn't support splice, which can happen with a
+         * passed file descriptor -- copy instead */
+        use_sp = 0;
+        break;
+      }
+      fprintf(stderr, "Error receiving data!\n");
+      status = 0;
+      break;
+    } else if (moved == 0) {
+      /* End of connection */
+      break;
+    }
+    got = moved;
+    any = 1;
+
+    /* If using the intermediate pipe, drain it into the output; if the
+     * output turns out not to support splice, fall back to reading the
+     * pipe back and writing it with the standard library */
+    while ((!direct) && (moved > 0)) {
+      t0 = stat_begin();
+      if (use_sp) {
+        drain = splice(pfd[0], NULL, STDOUT_FILENO, NULL, (size_t) moved,
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+        if ((drain < 0) && (errno == EINVAL)) {
+          use_sp = 0;
+          continue;
+        }
+      } else {
+        drain = read(pfd[0], pc->pBuf, (size_t) pc->cap);
+        if (drain > 0) {
+          if (fwrite(pc->pBuf, 1, (size_t) drain, stdout) !=
+                (size_t) drain) {
+            drain = -1;
+          }
+        }
+      }
+      stat_end(STAT_OUTPUT, t0, (int64_t) drain);
+
+      if (drain < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fprintf(stderr, "Error writing to stdout!\n");
+        status = 0;
+        break;
+      }
+      moved -= drain;
+    }
+
+    /* Account for what was moved */
+    if (status) {
+      prog_add((int64_t) got);
+      rate_pace((int64_t) got);
+    }
+    if (status && (count > 0)) {
+      count -= (int64_t) got;
+    }
+  }
+
+  /* Close the intermediate pipe if it was opened */
+  if (pfd[0] != -1) {
+    close(pfd[0]);
+    pfd[0] = -1;
+  }
+  if (pfd[1] != -1) {
+    close(pfd[1]);
+    pfd[1] = -1;
+  }
+
+/* ================================================================== */
+#endif
+
+  /* Copy through the buffer if we didn't (or no longer) splice */
+  while (status && (!use_sp) && (count != 0)) {
+    /* Receive more data, but no more than requested */
+    rcount = (int) rate_chunk((size_t) pc->cap);
+    if ((count > 0) && (count < (int64_t) rcount)) {
+      rcount = (int) count;
+    }
+
+    t0 = stat_begin();
+#ifdef _WIN32
+    rcount = (int) recv(pc->sock, pc->pBuf, rcount, 0);
+#else
+    rcount = (int) read(pc->sock, pc->pBuf, (size_t) rcount);
+#endif
+    stat_end(STAT_RECV, t0, rcount);
+#ifndef _WIN32
+    if ((rcount < 0) && (errno == EINTR)) {
+      continue;
+    }
+#endif
+    if (rcount < 0) {
+      fprintf(stderr, "Error receiving data!\n");
+      status = 0;
+      break;
+    } else if (rcount == 0) {
+      /* End of connection */
+      break;
+    }
+
+    /* Write all the data to stdout, unless throwing it away */
+    if (!pc->sink) {
+      t0 = stat_begin();
+      if (fwrite(pc->pBuf, 1, (size_t) rcount, stdout) !=
+            (size_t) rcount) {
+        fprintf(stderr, "Error writing to stdout!\n");
+        status = 0;
+      }
+      stat_end(STAT_OUTPUT, t0, status ? rcount : 0);
+    }
+
+    if (status) {
+      prog_add((int64_t) rcount);
+      rate_pace((int64_t) rcount);
+    }
+    if (status && (count > 0)) {
+      count -= (int64_t) rcount;
+    }
+  }
+
+  /* If a specific count was requested, it's an error if the connection
+   * ended before all of it arrived */
+  if (status && (count > 0)) {
+    fprintf(stderr, "Connection ended unexpectedly!\n");
+    status = 0;
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * relay_connect function.
+ */
+static MSOCKET relay_connect(const char *pAddrStr, const MSOPT *pOpt) {
+  int                status   = 1           ;
+  int                unixsock = 0           ;
+  MSOCKET            sock     = MSOCKET_NONE;
+  struct addrinfo *  pai      = NULL        ;
+  int64_t            deadline = 0           ;
+  int64_t            delay    = 0           ;
+#ifndef _WIN32
+  struct sockaddr_un sun                    ;
+  socklen_t          sunlen   = 0           ;
+#endif
+
+#ifndef _WIN32
+  /* Initialize structures */
+  memset(&sun, 0, sizeof(struct sockaddr_un));
+#endif
+
+  /* Check parameters */
+  if ((pAddrStr == NULL) || (pOpt == NULL)) {
+    abort();
+  }
+
+  /* Translate the address as for the main address */
+  if (strncmp(pAddrStr, "unix:", 5) == 0) {
+    unixsock = 1;
+#ifdef _WIN32
+    status = 0;
+#else
+    if (!unix_lookup(pAddrStr + 5, &sun, &sunlen)) {
+      status = 0;
+    }
+#endif
+  } else if (!lookup(pAddrStr, &pai)) {
+    status = 0;
+  }
+
+  if (!status) {
+    fprintf(stderr, "Relay address is not valid!\n");
+  }
+
+  /* Connect, with --retry keeping on trying until the deadline */
+  if (status) {
+    deadline = now_ms() + ((int64_t) pOpt->retry) * 1000;
+    delay = RETRYMIN;
+    for(;;) {
+#ifndef _WIN32
+      if (unixsock) {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ((sock != -1) &&
+            connect(sock, (const struct sockaddr *) &sun, sunlen)) {
+          close(sock);
+          sock = -1;
+        }
+      } else {
+        sock = connect_race(pai, pOpt, 1);
+      }
+#else
+      sock = connect_race(pai, pOpt, 1);
+#endif
+      if ((sock != MSOCKET_NONE) || (!retry_wait(deadline, &delay))) {
+        break;
+      }
+    }
+
+    if (sock == MSOCKET_NONE) {
+      fprintf(stderr, "Could not connect to relay address!\n");
+      status = 0;
+    }
+  }
+
+  /* Tune the connection as for a writer */
+  if (status && (!unixsock)) {
+    if (!sock_tune(sock, pOpt, 1)) {
+      sock_close(sock);
+      sock = MSOCKET_NONE;
+    }
+  }
+
+  /* Free the address list if it was looked up */
+  if (pai != NULL) {
+    freeaddrinfo(pai);
+    pai = NULL;
+  }
+
+  /* Return the connection */
+  return sock;
+}
+
+/*
+ * relay_out function.
+ */
+static int relay_out(CONNBUF *pc, MSOCKET fwd) {
+  int         status = 1 ;
+  int         fwdok  = 1 ;
+  int         rcount = 0 ;
+  int         use_sp = 0 ;
+  int64_t     t0     = 0 ;
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+  struct stat st         ;
+  int         pin[2]     ;
+  int         pout[2]    ;
+  int         direct = 0 ;
+  int         out_sp = 1 ;
+  int         any    = 0 ;
+  size_t      want   = 0 ;
+  ssize_t     moved  = 0 ;
+  ssize_t     got    = 0 ;
+  ssize_t     teed   = 0 ;
+  ssize_t     done   = 0 ;
+  ssize_t     n      = 0 ;
+/* ================================================================== */
+#endif
+
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+  pin[0]  = -1;
+  pin[1]  = -1;
+  pout[0] = -1;
+  pout[1] = -1;
+
+/* ================================================================== */
+#endif
+
+#ifndef _WIN32
+  /* The next instance going away must not end this one with SIGPIPE,
+   * since the data is still wanted here */
+  (void) signal(SIGPIPE, SIG_IGN);
+#endif
+
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+
+  /* Decide whether to splice, as for sock_to_out -- standard output
+   * that is a pipe can be teed into directly, while sockets and
+   * regular files need a second pipe; with --sink, the data is only
+   * forwarded */
+  if (pc->sink) {
+    use_sp = 1;
+  } else if (fstat(STDOUT_FILENO, &st) == 0) {
+    if (S_ISFIFO(st.st_mode)) {
+      use_sp = 1;
+      direct = 1;
+    } else if (S_ISREG(st.st_mode) || S_ISSOCK(st.st_mode)) {
+      use_sp = 1;
+    }
+  }
+
+  if (status && use_sp && (!pc->sink)) {
+    if (fflush(stdout)) {
+      fprintf(stderr, "Error writing to stdout!\n");
+      status = 0;
+    }
+  }
+
+  /* Create the pipes, falling back to copying if that fails */
+  if (status && use_sp) {
+    if (pipe2(pin, O_CLOEXEC) == 0) {
+      (void) fcntl(pin[1], F_SETPIPE_SZ, SPLICECHUNK);
+    } else {
+      pin[0] = -1;
+      pin[1] = -1;
+      use_sp = 0;
+    }
+  }
+
+  if (status && use_sp && (!pc->sink) && (!direct)) {
+    if (pipe2(pout, O_CLOEXEC) == 0) {
+      (void) fcntl(pout[1], F_SETPIPE_SZ, SPLICECHUNK);
+    } else {
+      pout[0] = -1;
+      pout[1] = -1;
+      use_sp = 0;
+    }
+  }
+
+  /* Splice until the connection ends or there is an error */
+  while (status && use_sp) {
+    /* Move data from the socket into the first pipe */
+    want = rate_chunk(SPLICECHUNK);
+    t0 = stat_begin();
+    moved = splice(pc->sock, NULL, pin[1], NULL, want,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+    stat_end(STAT_RECV, t0, (int64_t) moved);
+    if (moved < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if ((errno == EINVAL) && (!any)) {
+        use_sp = 0;
+        break;
+      }
+      fprintf(stderr, "Error receiving data!\n");
+      status = 0;
+      break;
+    } else if (moved == 0) {
+      /* End of connection */
+      break;
+    }
+    got = moved;
+    any = 1;
+
+    /* Pass on what is in the pipe, duplicating as much as tee() takes
+     * at a time to the output and then consuming that much by
+     * forwarding it */
+    while (status && (moved > 0)) {
+      teed = moved;
+      if (!pc->sink) {
+        t0 = stat_begin();
+        teed = tee(pin[0], direct ? STDOUT_FILENO : pout[1],
+                    (size_t) moved, 0);
+        if ((teed < 0) && (errno == EINTR)) {
+          continue;
+        }
+
+        /* Drain the second pipe into the output, reading it back and
+         * writing it with the standard library if the output turns out
+         * not to support splice */
+        for(done = 0; (!direct) && (teed > 0) && (done < teed); ) {
+          if (out_sp) {
+            n = splice(pout[0], NULL, STDOUT_FILENO, NULL,
+                        (size_t) (teed - done),
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+            if ((n < 0) && (errno == EINVAL)) {
+              out_sp = 0;
+              continue;
+            }
+          } else {
+            n = read(pout[0], pc->pBuf, (size_t) pc->cap);
+            if (n > 0) {
+              if (fwrite(pc->pBuf, 1, (size_t) n, stdout) != (size_t) n) {
+                n = -1;
+              }
+            }
+          }
+          if ((n < 0) && (errno == EINTR)) {
+            continue;
+          } else if (n <= 0) {
+            teed = -1;
+            break;
+          }
+          done += n;
+        }
+        stat_end(STAT_OUTPUT, t0, (int64_t) teed);
+
+        if (teed <= 0) {
+          fprintf(stderr, "Error writing to stdout!\n");
+          status = 0;
+          break;
+        }
+      }
+
+      /* Forward the duplicated data, or once forwarding has failed,
+       * just take it out of the pipe */
+      for(done = 0; done < teed; ) {
+        t0 = stat_begin();
+        if (fwdok) {
+          n = splice(pin[0], NULL, fwd, NULL, (size_t) (teed - done),
+                      SPLICE_F_MOVE | SPLICE_F_MORE);
+          stat_end(STAT_SEND, t0, (int64_t) n);
+        } else {
+          /* Take out no more than was duplicated, since the rest
+           * hasn't been written out yet */
+          want = (size_t) (teed - done);
+          if (want > (size_t) pc->cap) {
+            want = (size_t) pc->cap;
+          }
+          n = read(pin[0], pc->pBuf, want);
+        }
+        if ((n < 0) && (errno == EINTR)) {
+          continue;
+        } else if ((n <= 0) && fwdok) {
+          fprintf(stderr,
+            "Warning:  relay connection failed, no longer forwarding.\n");
+          fwdok = 0;
+          continue;
+        } else if (n <= 0) {
+          fprintf(stderr, "Error receiving data!\n");
+          status = 0;
+          break;
+        }
+        done += n;
+      }
+      moved -= teed;
+    }
+
+    /* Account for what was moved */
+    if (status) {
+      prog_add((int64_t) got);
+      rate_pace((int64_t) got);
+    }
+  }
+
+  /* Close the pipes if they were opened */
+  if (pin[0] != -1) {
+    close(pin[0]);
+    pin[0] = -1;
+  }
+  if (pin[1] != -1) {
+    close(pin[1]);
+    pin[1] = -1;
+  }
+  if (pout[0] != -1) {
+    close(pout[0]);
+    pout[0] = -1;
+  }
+  if (pout[1] != -1) {
+    close(pout[1]);
+    pout[1] = -1;
+  }
+
+/* ================================================================== */
+#endif
+
+  /* Copy through the buffer if we didn't (or no longer) splice */
+  while (status && (!use_sp)) {
+    rcount = (int) rate_chunk((size_t) pc->cap);
+
+    t0 = stat_begin();
+#ifdef _WIN32
+    rcount = (int) recv(pc->sock, pc->pBuf, rcount, 0);
+#else
+    rcount = (int) read(pc->sock, pc->pBuf, (size_t) rcount);
+#endif
+    stat_end(STAT_RECV, t0, rcount);
+#ifndef _WIN32
+    if ((rcount < 0) && (errno == EINTR)) {
+      continue;
+    }
+#endif
+    if (rcount < 0) {
+      fprintf(stderr, "Error receiving data!\n");
+      status = 0;
+      break;
+    } else if (rcount == 0) {
+      /* End of connection */
+      break;
+    }
+
+    /* Forward the data, then write it to stdout unless throwing it
+     * away */
+    if (fwdok && (!send_all(fwd, pc->pBuf, rcount, 0))) {
+      fprintf(stderr,
+        "Warning:  relay connection failed, no longer forwarding.\n");
+      fwdok = 0;
+    }
+
+    if (!pc->sink) {
+      t0 = stat_begin();
+      if (fwrite(pc->pBuf, 1, (size_t) rcount, stdout) !=
+            (size_t) rcount) {
+        fprintf(stderr, "Error writing to stdout!\n");
+        status = 0;
+      }
+      stat_end(STAT_OUTPUT, t0, status ? rcount : 0);
+    }
+
+    if (status) {
+      prog_add((int64_t) rcount);
+      rate_pace((int64_t) rcount);
+    }
+  }
+
+  /* The transfer failed if the rest of the chain missed data */
+  if (status && (!fwdok)) {
+    fprintf(stderr, "Relay didn't forward all the data!\n");
+    status = 0;
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * in_to_sock function.
+ */
+static int in_to_sock(MSOCKET sock, char *pBuf, int bufsize) {
+  int     status = 1;
+  int     rcount = 0;
+  int64_t t0     = 0;
+
+  /* Check parameters */
+  if (pBuf == NULL) {
+    abort();
+  }
+
+  /* Begin with the first read into the buffer */
+  t0 = stat_begin();
+  rcount = (int) in_read(pBuf, (size_t) bufsize);
+  stat_end(STAT_INPUT, t0, rcount);
+
+  /* Keep reading full buffers from stdin until EOF or error */
+  while (rcount == bufsize) {
+
+    /* Send the full buffer */
+    t0 = stat_begin();
+    if (send(sock, pBuf, bufsize, 0) != bufsize) {
+      fprintf(stderr, "Error sending data!\n");
+      status = 0;
+    }
+    stat_end(STAT_SEND, t0, status ? bufsize : 0);
+
+    /* Break if failure to send */
+    if (!status) {
+      break;
+    }
+    prog_add((int64_t) bufsize);
+    rate_pace((int64_t) bufsize);
+
+    /* Read more from stdin */
+    t0 = stat_begin();
+    rcount = (int) in_read(pBuf, (size_t) bufsize);
+    stat_end(STAT_INPUT, t0, rcount);
+  }
+
+  /* If reading stopped due to error, detect that, report it, and
+   * fail */
+  if (status) {
+    if (ferror(stdin)) {
+      fprintf(stderr, "Error reading from stdin!\n");
+      status = 0;
+    }
+  }
+
+  /* If we still have remainder data, write that */
+  if (status && (rcount > 0)) {
+    t0 = stat_begin();
+    if (send(sock, pBuf, rcount, 0) != rcount) {
+      fprintf(stderr, "Error sending data!\n");
+      status = 0;
+    } else {
+      prog_add((int64_t) rcount);
+    }
+    stat_end(STAT_SEND, t0, status ? rcount : 0);
+    if (status) {
+      rate_pace((int64_t) rcount);
+    }
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * duplex function.
+ */
+static int duplex(CONNBUF *pc, int bufsize) {
+  int        status  = 1   ;
+  int        started = 0   ;
+  char     * pBuf    = NULL;
+  MSDUPLEX   dx            ;
+#ifdef _WIN32
+  HANDLE     thread  = NULL;
+#else
+  pthread_t  thread        ;
+#endif
+
+  /* Initialize structures */
+  memset(&dx, 0, sizeof(MSDUPLEX));
+#ifndef _WIN32
+  memset(&thread, 0, sizeof(pthread_t));
+#endif
+
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+
+  /* The sending side needs a buffer of its own, since the receiving
+   * side uses the buffered reader's */
+  pBuf = (char *) malloc((size_t) bufsize);
+  if (pBuf == NULL) {
+    fprintf(stderr, "Couldn't allocate I/O buffer!\n");
+    status = 0;
+  }
+
+  /* Start receiving -- if that fails, the connection is shut down
+   * under the sending side, which must then get an error rather than
+   * end the process with SIGPIPE */
+  if (status) {
+#ifndef _WIN32
+    (void) signal(SIGPIPE, SIG_IGN);
+#endif
+    dx.pc     = pc;
+    dx.status = 0;
+#ifdef _WIN32
+    thread = CreateThread(NULL, 0, duplex_main, &dx, 0, NULL);
+    if (thread == NULL) {
+      status = 0;
+    }
+#else
+    if (pthread_create(&thread, NULL, duplex_main, &dx)) {
+      status = 0;
+    }
+#endif
+    if (status) {
+      started = 1;
+    } else {
+      fprintf(stderr, "Couldn't start receiving thread!\n");
+    }
+  }
+
+  /* Send, then end the sending direction, or both if sending failed
+   * -- this fails harmlessly if receiving failed and already did */
+  if (status) {
+    status = in_to_sock(pc->sock, pBuf, bufsize);
+    if (shutdown(
+        pc->sock,
+#ifdef _WIN32
+        status ? 1 /* send */ : 2 /* both */
+#else
+        status ? SHUT_WR : SHUT_RDWR
+#endif
+        ) && status) {
+      fprintf(stderr, "Warning:  socket shutdown failed.\n");
+    }
+  }
+
+  /* Wait for the other side to end its data */
+  if (started) {
+#ifdef _WIN32
+    (void) WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    thread = NULL;
+#else
+    (void) pthread_join(thread, NULL);
+#endif
+    if (!dx.status) {
+      status = 0;
+    }
+  }
+
+  if (pBuf != NULL) {
+    free(pBuf);
+    pBuf = NULL;
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * duplex_main function.
+ */
+#ifdef _WIN32
+static DWORD WINAPI duplex_main(LPVOID pArg) {
+#else
+static void *duplex_main(void *pArg) {
+#endif
+  MSDUPLEX * pdx = NULL;
+
+  pdx = (MSDUPLEX *) pArg;
+
+  /* Receive until the other side ends its data, and make sure it has
+   * all been written out */
+  pdx->status = sock_to_out(pdx->pc, -1);
+  if (pdx->status && fflush(stdout)) {
+    fprintf(stderr, "Error writing to stdout!\n");
+    pdx->status = 0;
+  }
+
+  /* If receiving failed, end both directions, so that the sending side
+   * stops at its next send instead of going on forever */
+  if (!pdx->status) {
+    (void) shutdown(
+        pdx->pc->sock,
+#ifdef _WIN32
+        2 /* both */
+#else
+        SHUT_RDWR
+#endif
+        );
+  }
+
+#ifdef _WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+/*
+ * http_upload function.
+ */
+static int http_upload(CONNBUF *pc, const char *pHdr) {
+  int          status  = 1   ;
+  int          bad     = 0   ;
+  int          chunked = 0   ;
+  int          haslen  = 0   ;
+  int          r       = 0   ;
+  int          d       = 0   ;
+  int64_t      clen    = 0   ;
+  const char * p       = NULL;
+  const char * pResp   = NULL;
+  char         val[MAXLINESIZE];
+  char         line[MAXLINESIZE];
+
+  /* Initialize buffers */
+  memset(val, 0, MAXLINESIZE);
+  memset(line, 0, MAXLINESIZE);
+
+  /* Check parameters */
+  if ((pc == NULL) || (pHdr == NULL)) {
+    abort();
+  }
+
+  /* Check for chunked transfer encoding, which is the only transfer
+   * encoding we understand */
+  if (status) {
+    r = http_field(pHdr, "Transfer-Encoding", val, MAXLINESIZE);
+    if (r > 0) {
+      if (str_ieq(val, "chunked", 8)) {
+        chunked = 1;
+      } else {
+        bad = 1;
+      }
+    } else if (r < 0) {
+      bad = 1;
+    }
+  }
+
+  /* If not chunked, get the content length, if there is one */
+  if (status && (!bad) && (!chunked)) {
+    r = http_field(pHdr, "Content-Length", val, MAXLINESIZE);
+    if (r > 0) {
+      haslen = 1;
+      clen = 0;
+      for(p = val; *p != 0; p++) {
+        if ((*p < '0') || (*p > '9')) {
+          bad = 1;
+          break;
+        }
+        d = *p - '0';
+        if (clen > (INT64_MAX - d) / 10) {
+          bad = 1;
+          break;
+        }
+        clen = (clen * 10) + (int64_t) d;
+      }
+      if (val[0] == 0) {
+        bad = 1;
+      }
+    } else if (r < 0) {
+      bad = 1;
+    }
+  }
+
+  /* If the client is waiting for permission to send the body, give it
+   * so that it doesn't pause before sending */
+  if (status && (!bad) && (chunked || (haslen && (clen > 0)))) {
+    r = http_field(pHdr, "Expect", val, MAXLINESIZE);
+    if ((r > 0) && str_ieq(val, "100-continue", 13)) {
+      pResp = "HTTP/1.1 100 Continue\r\n\r\n";
+      if (!send_all(pc->sock, pResp, (int) strlen(pResp), 0)) {
+        fprintf(stderr, "Error sending data!\n");
+        status = 0;
+      }
+    }
+  }
+
+  /* Transfer a body with a known length */
+  if (status && (!bad) && haslen) {
+    prog_expect(clen);
+    status = sock_to_out(pc, clen);
+  }
+
+  /* Transfer a chunked body */
+  if (status && (!bad) && chunked) {
+    for( ; ; ) {
+      /* Read the chunk size line */
+      if (!connbuf_line(pc, line, MAXLINESIZE)) {
+        bad = 1;
+        break;
+      }
+
+      /* Decode the hexadecimal chunk size, ignoring any chunk
+       * extensions */
+      clen = 0;
+      for(p = line; *p != 0; p++) {
+        if ((*p >= '0') && (*p <= '9')) {
+          d = *p - '0';
+        } else if ((*p >= 'a') && (*p <= 'f')) {
+          d = *p - 'a' + 10;
+        } else if ((*p >= 'A') && (*p <= 'F')) {
+          d = *p - 'A' + 10;
+        } else {
+          break;
+        }
+
+        if (clen > INT64_MAX / 16) {
+          bad = 1;
+          break;
+        }
+        clen = (clen * 16) + (int64_t) d;
+      }
+      if ((p == line) || ((*p != 0) && (*p != ';') && (*p != ' ') &&
+            (*p != '\t'))) {
+        bad = 1;
+      }
+      if (bad) {
+        break;
+      }
+
+      /* Last chunk has size zero */
+      if (clen == 0) {
+        break;
+      }
+
+      /* Transfer the chunk data */
+      if (!sock_to_out(pc, clen)) {
+        status = 0;
+        break;
+      }
+
+      /* The chunk data must be followed by an empty line */
+      if (!connbuf_line(pc, line, MAXLINESIZE)) {
+        bad = 1;
+        break;
+      }
+      if (line[0] != 0) {
+        bad = 1;
+        break;
+      }
+    }
+
+    /* Skip any trailer fields up to the empty line that ends the
+     * chunked body */
+    while (status && (!bad)) {
+      if (!connbuf_line(pc, line, MAXLINESIZE)) {
+        bad = 1;
+        break;
+      }
+      if (line[0] == 0) {
+        break;
+      }
+    }
+  }
+
+  /* Make sure everything is written out */
+  if (status && (!bad)) {
+    if (fflush(stdout)) {
+      fprintf(stderr, "Error writing to stdout!\n");
+      status = 0;
+    }
+  }
+
+  /* Report malformed requests */
+  if (status && bad) {
+    fprintf(stderr, "Malformed HTTP request!\n");
+    status = 0;
+  }
+
+  /* Send a response if the connection is still usable */
+  if (status) {
+    pResp =
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+  } else if (bad) {
+    pResp =
+      "HTTP/1.1 400 Bad Request\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+  } else {
+    pResp = NULL;
+  }
+
+  if (pResp != NULL) {
+    if (!send_all(pc->sock, pResp, (int) strlen(pResp), 0)) {
+      fprintf(stderr, "Error sending data!\n");
+      status = 0;
+    }
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * send_vec function.
+ */
+static int send_vec(MSOCKET sock, MSVEC *pv, int n) {
+  int           status = 1;
+  int           first  = 0;
+  int           i      = 0;
+  int64_t       t0     = 0;
+#ifdef _WIN32
+/* WIN32-specific --------------------------------------------------- */
+  WSABUF        wb[MAXVEC];
+  DWORD         sent   = 0;
+  DWORD         total  = 0;
+/* ================================================================== */
+#else
+/* POSIX-specific --------------------------------------------------- */
+  struct iovec  iov[MAXVEC];
+  struct msghdr mh;
+  ssize_t       sent   = 0;
+/* ================================================================== */
+#endif
+
+  /* Check parameters */
+  if ((pv == NULL) || (n < 0) || (n > MAXVEC)) {
+    abort();
+  }
+
+#ifdef _WIN32
+/* WIN32-specific --------------------------------------------------- */
+
+  /* Windows blocking sockets send everything in one call, so just
+   * gather the blocks and send them */
+  for(i = 0; i < n; i++) {
+    wb[i].buf = (char *) pv[i].pData;
+    wb[i].len = (ULONG) pv[i].len;
+    total += (DWORD) pv[i].len;
+  }
+
+  t0 = stat_begin();
+  if (WSASend(sock, wb, (DWORD) n, &sent, 0, NULL, NULL)) {
+    status = 0;
+  } else if (sent != total) {
+    status = 0;
+  }
+  stat_end(STAT_SEND, t0, status ? (int64_t) sent : 0);
+
+/* ================================================================== */
+#else
+/* POSIX-specific --------------------------------------------------- */
+
+  /* Keep sending until all blocks have been sent */
+  while (status) {
+    /* Skip blocks that have been completely sent */
+    while ((first < n) && (pv[first].len < 1)) {
+      first++;
+    }
+    if (first >= n) {
+      break;
+    }
+
+    /* Gather the remaining blocks */
+    memset(&mh, 0, sizeof(struct msghdr));
+    for(i = first; i < n; i++) {
+      iov[i - first].iov_base = (void *) pv[i].pData;
+      iov[i - first].iov_len  = pv[i].len;
+    }
+    mh.msg_iov    = iov;
+    mh.msg_iovlen = n - first;
+
+    /* Send as much as possible */
+    t0 = stat_begin();
+    sent = sendmsg(sock, &mh, 0);
+    stat_end(STAT_SEND, t0, (int64_t) sent);
+    if (sent < 0) {
+      if (errno != EINTR) {
+        status = 0;
+      }
+      continue;
+    }
+
+    /* Advance past whatever was sent */
+    for(i = first; (i < n) && (sent > 0); i++) {
+      if ((size_t) sent >= pv[i].len) {
+        sent -= (ssize_t) pv[i].len;
+        pv[i].len = 0;
+      } else {
+        pv[i].pData += sent;
+        pv[i].len -= (size_t) sent;
+        sent = 0;
+      }
+    }
+  }
+
+/* ================================================================== */
+#endif
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * http_request function.
+ */
+static int http_request(const char *pHdr, char *pMethod, int maxmethod) {
+  int          result = 0   ;
+  int          mlen   = 0   ;
+  const char * pc     = NULL;
+
+  /* Check parameters */
+  if ((pHdr == NULL) || (pMethod == NULL) || (maxmethod < 1)) {
+    abort();
+  }
+
+  /* Copy the method, which is everything up to the first space */
+  pMethod[0] = 0;
+  for(pc = pHdr; (*pc > ' ') && (*pc <= '~'); pc++) {
+    if (mlen >= maxmethod - 1) {
+      break;
+    }
+    pMethod[mlen] = *pc;
+    mlen++;
+  }
+  pMethod[mlen] = 0;
+
+  /* The method must be followed by a space and then the target */
+  if ((mlen > 0) && (*pc == ' ')) {
+    pc++;
+    if ((*pc > ' ') && (*pc <= '~')) {
+      result = 9;
+    }
+  }
+
+  /* Skip the target */
+  if (result) {
+    while ((*pc > ' ') && (*pc <= '~')) {
+      pc++;
+    }
+  }
+
+  /* If the target is followed by a version, decode it */
+  if (result && (*pc == ' ')) {
+    pc++;
+    if ((strncmp(pc, "HTTP/", 5) == 0) &&
+        (pc[5] >= '0') && (pc[5] <= '9') && (pc[6] == '.') &&
+        (pc[7] >= '0') && (pc[7] <= '9')) {
+      result = ((pc[5] - '0') * 10) + (pc[7] - '0');
+    } else {
+      result = 0;
+    }
+  }
+
+  /* Return result */
+  return result;
+}
+
+/*
+ * http_chunked function.
+ */
+static int http_chunked(MSOCKET sock, const char *pHdr) {
+  int          status  = 1   ;
+  int          version = 0   ;
+  int          head    = 0   ;
+  int          eof     = 0   ;
+  int          n       = 0   ;
+  size_t       rcount  = 0   ;
+  size_t       want    = 0   ;
+  int64_t      t0      = 0   ;
+  const char * pResp   = NULL;
+  char       * pBuf    = NULL;
+  MSVEC        vec[MAXVEC]   ;
+  char         sline[32]     ;
+  char         method[16]    ;
+
+  /* Initialize buffers */
+  memset(vec, 0, sizeof(vec));
+  memset(sline, 0, sizeof(sline));
+  memset(method, 0, sizeof(method));
+
+  /* Check parameters */
+  if (pHdr == NULL) {
+    abort();
+  }
+
+  /* Decode the request line */
+  if (status) {
+    version = http_request(pHdr, method, (int) sizeof(method));
+    if (version < 1) {
+      fprintf(stderr, "Malformed HTTP request!\n");
+      status = 0;
+    }
+  }
+
+  /* Pick the response header -- chunked transfer encoding only exists
+   * from HTTP/1.1 onwards, so older clients get unframed data that ends
+   * when the connection is closed */
+  if (status) {
+    if (strcmp(method, "HEAD") == 0) {
+      head = 1;
+    }
+
+    if (version >= 11) {
+      pResp =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    } else {
+      pResp =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    }
+  }
+
+  /* For a HEAD request, send only the header */
+  if (status && head) {
+    if (!send_all(sock, pResp, (int) strlen(pResp), 0)) {
+      fprintf(stderr, "Error sending data!\n");
+      status = 0;
+    }
+  }
+
+  /* Allocate the chunk buffer */
+  if (status && (!head)) {
+    pBuf = (char *) malloc(HTTPCHUNKSIZE);
+    if (pBuf == NULL) {
+      fprintf(stderr, "Couldn't allocate I/O buffer!\n");
+      status = 0;
+    }
+  }
+
+  /* Transfer stdin in chunks until it ends; the response header goes
+   * out with the first chunk and the last chunk marker goes out with
+   * the final data, so a short response takes a single send */
+  while (status && (!head) && (!eof)) {
+    /* Read a full chunk from stdin, unless the input ends first --
+     * with --rate, chunks are no larger than the burst */
+    want = rate_chunk(HTTPCHUNKSIZE);
+    t0 = stat_begin();
+    rcount = in_read(pBuf, want);
+    stat_end(STAT_INPUT, t0, (int64_t) rcount);
+    if (rcount < want) {
+      eof = 1;
+      if (ferror(stdin)) {
+        fprintf(stderr, "Error reading from stdin!\n");
+        status = 0;
+        break;
+      }
+    }
+
+    /* Gather the response header (first time only), the chunk size
+     * line, the data, and the chunk trailer */
+    n = 0;
+    if (pResp != NULL) {
+      vec[n].pData = pResp;
+      vec[n].len   = strlen(pResp);
+      n++;
+      pResp = NULL;
+    }
+
+    if ((version >= 11) && (rcount > 0)) {
+      sprintf(sline, "%lx\r\n", (unsigned long) rcount);
+      vec[n].pData = sline;
+      vec[n].len   = strlen(sline);
+      n++;
+    }
+
+    vec[n].pData = pBuf;
+    vec[n].len   = rcount;
+    n++;
+
+    if (version >= 11) {
+      if (rcount > 0) {
+        vec[n].pData = eof ? "\r\n0\r\n\r\n" : "\r\n";
+      } else {
+        vec[n].pData = "0\r\n\r\n";
+      }
+      vec[n].len = strlen(vec[n].pData);
+      n++;
+    }
+
+    /* Send everything */
+    if (!send_vec(sock, vec, n)) {
+      fprintf(stderr, "Error sending data!\n");
+      status = 0;
+    } else {
+      prog_add((int64_t) rcount);
+      rate_pace((int64_t) rcount);
+    }
+  }
+
+  /* Free the chunk buffer if allocated */
+  if (pBuf != NULL) {
+    free(pBuf);
+    pBuf = NULL;
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * http_file function.
+ */
+static int http_file(
+    MSOCKET      sock,
+    const char * pHdr,
+    int          fd,
+    int64_t      flen,
+    const char * pETag) {
+
+  int          status  = 1   ;
+  int          version = 0   ;
+  int          head    = 0   ;
+  int          use_sf  = 0   ;
+  int          rcount  = 0   ;
+  int          flags   = 0   ;
+  int64_t      t0      = 0   ;
+  char       * pBuf    = NULL;
+  char         method[16]    ;
+  char         resp[256]     ;
+  char         val[256]      ;
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+  ssize_t      sent    = 0   ;
+  size_t       want    = 0   ;
+/* ================================================================== */
+#endif
+
+  /* Initialize buffers */
+  memset(method, 0, sizeof(method));
+  memset(resp, 0, sizeof(resp));
+  memset(val, 0, sizeof(val));
+
+  /* Check parameters */
+  if ((pHdr == NULL) || (flen < 0) || (pETag == NULL)) {
+    abort();
+  }
+
+  /* Decode the request line */
+  if (status) {
+    version = http_request(pHdr, method, (int) sizeof(method));
+    if (version < 1) {
+      fprintf(stderr, "Malformed HTTP request!\n");
+      status = 0;
+    }
+  }
+
+  /* Generate the response header, answering in the version of the
+   * request; if the client's copy is current, answer with no body
+   * (an If-None-Match value too long for the buffer is ignored) */
+  if (status) {
+    if (strcmp(method, "HEAD") == 0) {
+      head = 1;
+    }
+
+    if ((http_field(pHdr, "If-None-Match", val, (int) sizeof(val)) > 0)
+        && etag_match(val, pETag)) {
+      head = 1;
+      sprintf(resp,
+        "HTTP/1.%d 304 Not Modified\r\n"
+        "ETag: %s\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        (version >= 11) ? 1 : 0,
+        pETag);
+
+    } else {
+      sprintf(resp,
+        "HTTP/1.%d 200 OK\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Length: %lld\r\n"
+        "ETag: %s\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        (version >= 11) ? 1 : 0,
+        (long long) flen,
+        pETag);
+    }
+  }
+
+  /* Send the response header; on Linux, tell the system more is coming
+   * so that the header goes out in the same packet as the start of the
+   * file */
+  if (status) {
+#ifdef __linux__
+    if ((!head) && (flen > 0)) {
+      flags = MSG_MORE;
+    }
+#endif
+    rcount = (int) strlen(resp);
+    if (!send_all(sock, resp, rcount, flags)) {
+      fprintf(stderr, "Error sending data!\n");
+      status = 0;
+    }
+  }
+
+  /* Skip the body for HEAD requests */
+  if (head) {
+    flen = 0;
+  }
+
+#ifdef __linux__
+/* Linux-specific --------------------------------------------------- */
+
+  /* Try to transmit the body with sendfile(), falling back to copying
+   * if the first call reports that this file can't be used with it */
+  if (status && (flen > 0)) {
+    use_sf = 1;
+  }
+
+  while (status && use_sf && (flen > 0)) {
+    want = rate_chunk(SENDFILECHUNK);
+    if (flen < (int64_t) want) {
+      want = (size_t) flen;
+    }
+
+    t0 = stat_begin();
+    sent = sendfile(sock, fd, NULL, want);
+    stat_end(STAT_SEND, t0, (int64_t) sent);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (((errno == EINVAL) || (errno == ENOSYS)) &&
+                  (use_sf == 1)) {
+        use_sf = 0;
+        break;
+      }
+      fprintf(stderr, "Error sending file!\n");
+      status = 0;
+      break;
+
+    } else if (sent == 0) {
+      fprintf(stderr, "File ended unexpectedly!\n");
+      status = 0;
+      break;
+    }
+
+    use_sf = 2;
+    flen -= (int64_t) sent;
+    prog_add((int64_t) sent);
+    rate_pace((int64_t) sent);
+  }
+
+/* ================================================================== */
+#endif
+
+  /* Copy the rest of the body through a buffer if sendfile() wasn't
+   * used */
+  if (status && (!use_sf) && (flen > 0)) {
+    pBuf = (char *) malloc(FILEBUFSIZE);
+    if (pBuf == NULL) {
+      fprintf(stderr, "Couldn't allocate I/O buffer!\n");
+      status = 0;
+    }
+  }
+
+  while (status && (!use_sf) && (flen > 0)) {
+    rcount = (int) rate_chunk(FILEBUFSIZE);
+    if (flen < (int64_t) rcount) {
+      rcount = (int) flen;
+    }
+
+    t0 = stat_begin();
+#ifdef _WIN32
+    rcount = _read(fd, pBuf, (unsigned int) rcount);
+#else
+    rcount = (int) read(fd, pBuf, (size_t) rcount);
+#endif
+    stat_end(STAT_INPUT, t0, rcount);
+#ifndef _WIN32
+    if ((rcount < 0) && (errno == EINTR)) {
+      continue;
+    }
+#endif
+    if (rcount < 0) {
+      fprintf(stderr, "Error reading from file!\n");
+      status = 0;
+      break;
+    } else if (rcount == 0) {
+      fprintf(stderr, "File ended unexpectedly!\n");
+      status = 0;
+      break;
+    }
+
+    if (!send_all(sock, pBuf, rcount, 0)) {
+      fprintf(stderr, "Error sending data!\n");
+      status = 0;
+      break;
+    }
+
+    flen -= (int64_t) rcount;
+    prog_add((int64_t) rcount);
+    rate_pace((int64_t) rcount);
+  }
+
+  /* Free the copy buffer if allocated */
+  if (pBuf != NULL) {
+    free(pBuf);
+    pBuf = NULL;
+  }
+
+  /* Return status */
+  return status;
+}
+
+/*
+ * parse_option function.
+ */
+static int parse_option(const char *pArg, MSOPT *pOpt) {
+  int          status = 1   ;
+  size_t       nlen   = 0   ;
+  const char * pVal   = NULL;
+  int64_t      size   = 0   ;
+
+  /* Check parameters */
+  if ((pArg == NULL) || (pOpt == NULL)) {
+    abort();
+  }
+
+  /* Skip the leading dashes and split off the value, if any */
+  if (strncmp(pArg, "--", 2) == 0) {
+    pArg += 2;
+  }
+
+  pVal = strchr(pArg, '=');
+  if (pVal != NULL) {
+    nlen = (size_t) (pVal - pArg);
+    pVal++;
+  } else {
+    nlen = strlen(pArg);
+  }
+
+  /* Interpret the option */
+  if ((nlen == 7) && (strncmp(pArg, "chunked", nlen) == 0)) {
+    /* --chunked takes no value */
+    if (pVal != NULL) {
+      fprintf(stderr, "Option --chunked does not take a value!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->chunked = 1;
+    }
+
+  } else if ((nlen == 7) && (strncmp(pArg, "pass-fd", nlen) == 0)) {
+    /* --pass-fd takes no value and is only available on POSIX */
+    if (pVal != NULL) {
+      fprintf(stderr, "Option --pass-fd does not take a value!\n");
+      status = 0;
+    }
+#ifdef _WIN32
+    if (status) {
+      fprintf(stderr, "Option --pass-fd not supported on this platform!\n");
+      status = 0;
+    }
+#endif
+    if (status) {
+      pOpt->pass_fd = 1;
+    }
+
+  } else if ((nlen == 8) && (strncmp(pArg, "fastopen", nlen) == 0)) {
+    /* --fastopen takes no value */
+    if (pVal != NULL) {
+      fprintf(stderr, "Option --fastopen does not take a value!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->fastopen = 1;
+    }
+
+  } else if (((nlen == 6) && (strncmp(pArg, "sndbuf", nlen) == 0)) ||
+             ((nlen == 6) && (strncmp(pArg, "rcvbuf", nlen) == 0))) {
+    /* --sndbuf and --rcvbuf require a size */
+    if ((!parse_size(pVal, MAXSOCKBUF, &size)) || (size < 1)) {
+      fprintf(stderr, "Option --%.6s requires a valid size!\n", pArg);
+      status = 0;
+    }
+    if (status) {
+      if (pArg[0] == 's') {
+        pOpt->sndbuf = (int) size;
+      } else {
+        pOpt->rcvbuf = (int) size;
+      }
+    }
+
+  } else if ((nlen == 10) && (strncmp(pArg, "congestion", nlen) == 0)) {
+    /* --congestion requires an algorithm name */
+    if ((pVal == NULL) || (*pVal == 0)) {
+      fprintf(stderr, "Option --congestion requires a name!\n");
+      status = 0;
+    }
+#ifndef TCP_CONGESTION
+    if (status) {
+      fprintf(stderr,
+        "Option --congestion not supported on this platform!\n");
+      status = 0;
+    }
+#endif
+    if (status) {
+      pOpt->pCongestion = pVal;
+    }
+
+  } else if ((nlen == 13) && (strncmp(pArg, "notsent-lowat", nlen) == 0)) {
+    /* --notsent-lowat requires a size */
+    if ((!parse_size(pVal, MAXSOCKBUF, &size)) || (size < 1)) {
+      fprintf(stderr, "Option --notsent-lowat requires a valid size!\n");
+      status = 0;
+    }
+#ifndef TCP_NOTSENT_LOWAT
+    if (status) {
+      fprintf(stderr,
+        "Option --notsent-lowat not supported on this platform!\n");
+      status = 0;
+    }
+#endif
+    if (status) {
+      pOpt->notsent_lowat = (int) size;
+    }
+
+  } else if ((nlen == 7) && (strncmp(pArg, "autobuf", nlen) == 0)) {
+    /* --autobuf requires a rate, and is only available on Linux, where
+     * the round-trip time can be read back */
+    if ((!parse_size(pVal, MAXRATE, &size)) || (size < 1)) {
+      fprintf(stderr, "Option --autobuf requires a valid rate!\n");
+      status = 0;
+    }
+#ifndef __linux__
+    if (status) {
+      fprintf(stderr, "Option --autobuf not supported on this platform!\n");
+      status = 0;
+    }
+#endif
+    if (status) {
+      pOpt->autobuf = size;
+    }
+
+  } else if ((nlen == 4) && (strncmp(pArg, "rate", nlen) == 0)) {
+    /* --rate requires a rate, optionally followed by a colon and the
+     * burst size */
+    if (!parse_rate(pVal, &(pOpt->rate), &(pOpt->burst))) {
+      fprintf(stderr, "Option --rate requires a valid rate!\n");
+      status = 0;
+    }
+
+  } else if ((nlen == 7) && (strncmp(pArg, "control", nlen) == 0)) {
+    /* --control requires a path and is only available on POSIX */
+    if ((pVal == NULL) || (*pVal == 0)) {
+      fprintf(stderr, "Option --control requires a path!\n");
+      status = 0;
+    }
+#ifdef _WIN32
+    if (status) {
+      fprintf(stderr, "Option --control not supported on this platform!\n");
+      status = 0;
+    }
+#endif
+    if (status) {
+      pOpt->pControl = pVal;
+    }
+
+  } else if ((nlen == 8) && (strncmp(pArg, "progress", nlen) == 0)) {
+    /* --progress takes no value */
+    if (pVal != NULL) {
+      fprintf(stderr, "Option --progress does not take a value!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->progress = 1;
+    }
+
+  } else if ((nlen == 10) && (strncmp(pArg, "stats-json", nlen) == 0)) {
+    /* --stats-json takes an optional path */
+    if ((pVal != NULL) && (*pVal == 0)) {
+      fprintf(stderr, "Option --stats-json requires a path after =!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->stats  = 1;
+      pOpt->pStats = pVal;
+    }
+
+  } else if ((nlen == 10) && (strncmp(pArg, "phase-hist", nlen) == 0)) {
+    /* --phase-hist requires a path */
+    if ((pVal == NULL) || (*pVal == 0)) {
+      fprintf(stderr, "Option --phase-hist requires a path!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->pPhaseHist = pVal;
+    }
+
+  } else if ((nlen == 6) && (strncmp(pArg, "source", nlen) == 0)) {
+    /* --source requires "zero", "random", or a percentage */
+    if ((pVal == NULL) || (*pVal == 0)) {
+      status = 0;
+    } else if (strcmp(pVal, "zero") == 0) {
+      pOpt->srcrandom = 0;
+    } else if (strcmp(pVal, "random") == 0) {
+      pOpt->srcrandom = 100;
+    } else {
+      pOpt->srcrandom = 0;
+      for( ; *pVal != 0; pVal++) {
+        if ((*pVal < '0') || (*pVal > '9') ||
+            (pOpt->srcrandom > (100 - (*pVal - '0')) / 10)) {
+          status = 0;
+          break;
+        }
+        pOpt->srcrandom = (pOpt->srcrandom * 10) + (*pVal - '0');
+      }
+    }
+    if (status) {
+      pOpt->source = 1;
+    } else {
+      fprintf(stderr, "Option --source requires zero, random, or a "
+                      "percentage!\n");
+    }
 
-/* ================================================================== */
-#endif
+  } else if ((nlen == 5) && (strncmp(pArg, "bytes", nlen) == 0)) {
+    /* --bytes requires a size */
+    if ((!parse_size(pVal, INT64_MAX, &size)) || (size < 1)) {
+      fprintf(stderr, "Option --bytes requires a valid size!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->bytes = size;
+    }
 
-  /* Initialize buffers */
-  memset(abuf, 0, MAXAPSIZE);
-  memset(pbuf, 0, MAXAPSIZE);
+  } else if ((nlen == 4) && (strncmp(pArg, "sink", nlen) == 0)) {
+    /* --sink takes no value */
+    if (pVal != NULL) {
+      fprintf(stderr, "Option --sink does not take a value!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->sink = 1;
+    }
 
-  /* Check parameters */
-  if ((pAddrStr == NULL) || (pAddr == NULL)) {
-    abort();
-  }
+  } else if ((nlen == 7) && (strncmp(pArg, "bufsize", nlen) == 0)) {
+    /* --bufsize requires a size */
+    if ((!parse_size(pVal, MAXBUFSIZE, &size)) || (size < 1)) {
+      fprintf(stderr, "Option --bufsize requires a valid size!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->bufsize = (int) size;
+    }
 
-  /* Make sure passed address doesn't exceed one less than MAXAPSIZE
-   * so that it will fit within the buffers */
-  if (status) {
-    if (strlen(pAddrStr) > (MAXAPSIZE - 1)) {
+  } else if ((nlen == 5) && (strncmp(pArg, "bench", nlen) == 0)) {
+    /* --bench takes no value and is only available on POSIX */
+    if (pVal != NULL) {
+      fprintf(stderr, "Option --bench does not take a value!\n");
       status = 0;
     }
-  }
+#ifdef _WIN32
+    if (status) {
+      fprintf(stderr, "Option --bench not supported on this platform!\n");
+      status = 0;
+    }
+#endif
+    if (status) {
+      pOpt->bench = 1;
+    }
 
-  /* Split the address string into numeric address and port components
-   * across a colon character -- first get the numeric address */
-  if (status) {
-    /* Copy everything up to colon or end of string into abuf --
-     * this won't overflow because we verified total size
-     * previously */
-    pw = abuf;
-    for(pc = pAddrStr; (*pc != 0) && (*pc != ':'); pc++) {
-      *pw = *pc;
-      pw++;
+  } else if ((nlen == 6) && (strncmp(pArg, "fanout", nlen) == 0)) {
+    /* --fanout requires a number of readers and is only available on
+     * POSIX */
+    if ((!parse_size(pVal, MAXFANOUT, &size)) || (size < 1) ||
+        (strspn(pVal, "0123456789") != strlen(pVal))) {
+      fprintf(stderr, "Option --fanout requires a number of readers!\n");
+      status = 0;
+    }
+#ifdef _WIN32
+    if (status) {
+      fprintf(stderr, "Option --fanout not supported on this platform!\n");
+      status = 0;
+    }
+#endif
+    if (status) {
+      pOpt->fanout = (int) size;
     }
 
-    /* Make sure we stopped on a colon character, consuming it if we
-     * did and failing otherwise */
-    if (*pc == ':') {
-      pc++;
+  } else if ((nlen == 4) && (strncmp(pArg, "slow", nlen) == 0)) {
+    /* --slow requires "stall" or "drop" */
+    if ((pVal != NULL) && (strcmp(pVal, "stall") == 0)) {
+      pOpt->drop = 0;
+    } else if ((pVal != NULL) && (strcmp(pVal, "drop") == 0)) {
+      pOpt->drop = 1;
     } else {
+      fprintf(stderr, "Option --slow requires stall or drop!\n");
       status = 0;
     }
-  }
 
-  /* Now get the port */
-  if (status) {
-    pw = pbuf;
-    for( ; *pc != 0; pc++) {
-      *pw = *pc;
-      pw++;
+  } else if ((nlen == 6) && (strncmp(pArg, "duplex", nlen) == 0)) {
+    /* --duplex takes no value */
+    if (pVal != NULL) {
+      fprintf(stderr, "Option --duplex does not take a value!\n");
+      status = 0;
+    }
+    if (status) {
+      pOpt->duplex = 1;
     }
-  }
 
-  /* Fail if either field is empty or contains characters apart from
-   * the dot (address buffer only) or ASCII decimal digits */
-  if (status) {
-    /* Check for empty fields */
-    if ((abuf[0] == 0) || (pbuf[0] == 0)) {
+  } else if ((nlen == 5) && (strncmp(pArg, "relay", nlen) == 0)) {
+    /* --relay requires an address */
+    if ((pVal == NULL) || (*pVal == 0)) {
+      fprintf(stderr, "Option --relay requires an address!\n");
       status = 0;
     }
-
-    /* Check character ranges */
     if (status) {
-      for(pc = abuf; *pc != 0; pc++) {
-        if ((*pc != '.') && ((*pc < '0') || (*pc > '9'))) {
-          status = 0;
-        }
-      }
+      pOpt->pRelay = pVal;
     }
 
+  } else if ((nlen == 5) && (strncmp(pArg, "retry", nlen) == 0)) {
+    /* --retry requires a whole number of seconds */
+    if ((pVal == NULL) || (*pVal == 0)) {
+      fprintf(stderr, "Option --retry requires a number of seconds!\n");
+      status = 0;
+    }
     if (status) {
-      for(pc = pbuf; *pc != 0; pc++) {
-        if ((*pc < '0') || (*pc > '9')) {
+      pOpt->retry = 0;
+      for( ; *pVal != 0; pVal++) {
+        if ((*pVal < '0') || (*pVal > '9') ||
+            (pOpt->retry > (MAXRETRY - (*pVal - '0')) / 10)) {
+          fprintf(stderr, "Option --retry is not valid!\n");
           status = 0;
+          break;
         }
+        pOpt->retry = (pOpt->retry * 10) + (*pVal - '0');
       }
     }
-  }
-
-#ifdef _WIN32
-/* WIN32-specific --------------------------------------------------- */
 
-  /* Translate the address buffer into an IP address */
-  if (status) {
-    ulipaddr = inet_addr(abuf);
-    if (ulipaddr == INADDR_NONE) {
+  } else if ((nlen == 4) && (strncmp(pArg, "file", nlen) == 0)) {
+    /* --file requires a path */
+    if ((pVal == NULL) || (*pVal == 0)) {
+      fprintf(stderr, "Option --file requires a path!\n");
       status = 0;
     }
+    if (status) {
+      pOpt->pFile = pVal;
+    }
+
+  } else {
+    fprintf(stderr, "Unrecognized option!\n");
+    status = 0;
   }
 
-  /* Manually translate the port buffer into a port number */
-  if (status) {
-    /* Read each character in the port buffer */
-    usport = 0;
-    for(pc = pbuf; *pc != 0; pc++) {
-      /* Multiply port value by 10, watching out for overflow */
-      if (usport <= (0xffff / 10)) {
-        usport *= (unsigned short) 10;
-      } else {
-        status = 0;
-      }
+  /* Return status */
+  return status;
+}
 
-      /* Translate current character into decimal value */
-      if (status) {
-        if ((*pc >= '0') && (*pc <= '9')) {
-          c = (*pc) - '0';
-        } else {
-          status = 0;
-        }
-      }
+/*
+ * parse_size function.
+ */
+static int parse_size(const char *pVal, int64_t max, int64_t *pSize) {
+  int     status = 1;
+  int64_t unit   = 1;
+  int64_t v      = 0;
 
-      /* Add the decimal value into the port */
-      if (status) {
-        usport += (unsigned short) c;
-      }
+  /* Check parameters */
+  if (pSize == NULL) {
+    abort();
+  }
 
-      /* If there was an error, break */
-      if (!status) {
-        break;
-      }
+  if ((pVal == NULL) || (*pVal < '0') || (*pVal > '9')) {
+    status = 0;
+  }
+
+  /* Read the digits, stopping before the value could overflow */
+  for( ; status && (*pVal >= '0') && (*pVal <= '9'); pVal++) {
+    if (v > (max - (*pVal - '0')) / 10) {
+      status = 0;
+    } else {
+      v = (v * 10) + (*pVal - '0');
     }
   }
 
-  /* Change the port number into network byte order */
-  if (status) {
-    usport = htons(usport);
+  /* Apply the unit suffix, if any, which must end the value */
+  if (status && (*pVal != 0)) {
+    if ((*pVal == 'K') || (*pVal == 'k')) {
+      unit = INT64_C(1) << 10;
+    } else if ((*pVal == 'M') || (*pVal == 'm')) {
+      unit = INT64_C(1) << 20;
+    } else if ((*pVal == 'G') || (*pVal == 'g')) {
+      unit = INT64_C(1) << 30;
+    } else {
+      status = 0;
+    }
+    if (status && (pVal[1] != 0)) {
+      status = 0;
+    }
+  }
+
+  if (status && (v > max / unit)) {
+    status = 0;
   }
 
-  /* Manually fill in the address structure */
   if (status) {
-    memset(pAddr, 0, sizeof(struct sockaddr_in));
-    pAddr->sin_family           = (short) AF_INET ;
-    pAddr->sin_port             =         usport  ;
-    pAddr->sin_addr.S_un.S_addr =         ulipaddr;
+    *pSize = v * unit;
   }
 
-/* ================================================================== */
-#endif
+  /* Return status */
+  return status;
+}
 
-#ifndef _WIN32
-/* POSIX-specific --------------------------------------------------- */
+/*
+ * parse_rate function.
+ */
+static int parse_rate(const char *pVal, int64_t *pRate, int64_t *pBurst) {
+  int          status = 1   ;
+  const char * pBurstVal = NULL;
+  char         rbuf[32]     ;
 
-  /* Set the hint structure */
-  if (status) {
-    hint.ai_family = AF_INET;
-    hint.ai_socktype = SOCK_STREAM;
-    hint.ai_flags = AI_NUMERICHOST;
-    hint.ai_protocol = IPPROTO_TCP;
+  /* Check parameters */
+  if ((pRate == NULL) || (pBurst == NULL)) {
+    abort();
   }
 
-  /* Attempt to translate the address */
+  memset(rbuf, 0, sizeof(rbuf));
+  *pBurst = 0;
+
+  /* Split off the burst size, if any */
+  if (pVal == NULL) {
+    status = 0;
+  }
   if (status) {
-    if (getaddrinfo(abuf, pbuf, &hint, &pi)) {
+    pBurstVal = strchr(pVal, ':');
+    if (pBurstVal == NULL) {
+      pBurstVal = pVal + strlen(pVal);
+    }
+    if ((size_t) (pBurstVal - pVal) >= sizeof(rbuf)) {
       status = 0;
+    } else {
+      memcpy(rbuf, pVal, (size_t) (pBurstVal - pVal));
     }
   }
 
-  /* If translation was successful, make sure address length matches
-   * passed address structure */
   if (status) {
-    if (pi->ai_addrlen != sizeof(struct sockaddr_in)) {
+    if ((!parse_size(rbuf, MAXRATE, pRate)) || (*pRate < 1)) {
       status = 0;
     }
   }
 
-  /* If we're still good, copy the address to the result and free the
-   * lookup structures */
-  if (status) {
-    memcpy(pAddr, pi->ai_addr, sizeof(struct sockaddr_in));
-    freeaddrinfo(pi);
-    pi = NULL;
+  if (status && (*pBurstVal == ':')) {
+    if ((!parse_size(pBurstVal + 1, MAXRATE, pBurst)) || (*pBurst < 1)) {
+      status = 0;
+    }
   }
 
-/* ================================================================== */
-#endif
-
   /* Return status */
   return status;
 }
@@ -492,16 +8432,40 @@ static int lookup(const char *pAddrStr, struct sockaddr_in *pAddr) {
 /*
  * mspeak function.
  */
-static int mspeak(int server, int write, int fh, const char *pAddrStr) {
+static int mspeak(
+    int          server,
+    int          write,
+    int          fh,
+    const char * pAddrStr,
+    const MSOPT * pOpt) {
 
   int                status =  1            ;
   int                conup  =  0            ;
-  struct sockaddr_in sai                    ;
+  struct addrinfo *  pai    = NULL          ;
   char *             iobuf  = NULL          ;
+  char *             hbuf   = NULL          ;
   int                rcount =  0            ;
-  int                lf_flg =  0            ;
-  int                ht_brk =  0            ;
+  int                trunc  =  0            ;
   int                i      =  0            ;
+  int                fd     = -1            ;
+  int64_t            flen   =  0            ;
+  CONNBUF            cb                     ;
+  char               etag[64]               ;
+  int                unixsock = 0           ;
+  int64_t            deadline = 0           ;
+  int64_t            delay  =  0            ;
+  int                bufsize = IOBUFSIZE    ;
+  int *              pFan   = NULL          ;
+  int                nfan   =  0            ;
+  MSOCKET            fwd    = MSOCKET_NONE  ;
+#ifdef _WIN32
+  struct _stati64    st                     ;
+#else
+  struct stat        st                     ;
+  struct sockaddr_un sun                    ;
+  socklen_t          sunlen = 0             ;
+  int                bound  = 0             ;
+#endif
 #ifdef _WIN32
   SOCKET             sock   = INVALID_SOCKET;
   SOCKET             sserv  = INVALID_SOCKET;
@@ -511,29 +8475,94 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
 #endif
 
   /* Initialize structures */
-  memset(&sai, 0, sizeof(struct sockaddr_in));
+  memset(&cb, 0, sizeof(CONNBUF));
+  memset(&st, 0, sizeof(st));
+  memset(etag, 0, sizeof(etag));
+#ifndef _WIN32
+  memset(&sun, 0, sizeof(struct sockaddr_un));
+#endif
 
   /* Check parameters */
-  if (pAddrStr == NULL) {
+  if ((pAddrStr == NULL) || (pOpt == NULL)) {
     abort();
   }
 
-  if (fh && ((!server) || (!write))) {
+  /* If we are serving a file, open it and get its length before doing
+   * anything on the network, so that problems are reported right
+   * away */
+  if (status && (pOpt->pFile != NULL)) {
+#ifdef _WIN32
+    fd = _open(pOpt->pFile, _O_RDONLY | _O_BINARY);
+#else
+    fd = open(pOpt->pFile, O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd == -1) {
+      fprintf(stderr, "Couldn't open input file!\n");
+      status = 0;
+    }
+
+    if (status) {
+#ifdef _WIN32
+      if (_fstati64(fd, &st) || ((st.st_mode & _S_IFMT) != _S_IFREG)) {
+#else
+      if (fstat(fd, &st) || (!S_ISREG(st.st_mode))) {
+#endif
+        fprintf(stderr, "Input file is not a regular file!\n");
+        status = 0;
+      }
+    }
+
+    /* The entity tag is built from the inode number, length, and
+     * modification time, which together change whenever the file is
+     * modified or replaced */
+    if (status) {
+      flen = (int64_t) st.st_size;
+      prog_expect(flen);
+      sprintf(etag, "\"%llx-%llx-%llx\"",
+        (unsigned long long) st.st_ino,
+        (unsigned long long) st.st_size,
+        (unsigned long long) st.st_mtime);
+    }
+  }
+
+  if (fh && (!server)) {
     abort();
   }
 
-  /* First off, we need to translate the address string into a socket
-   * address */
-  if (status) {
-    if (!lookup(pAddrStr, &sai)) {
+  /* First off, we need to translate the address string into socket
+   * addresses -- a "unix:" address is a Unix domain socket path */
+  if (status && (strncmp(pAddrStr, "unix:", 5) == 0)) {
+    unixsock = 1;
+#ifdef _WIN32
+    fprintf(stderr, "Unix domain sockets not supported on this platform!\n");
+    status = 0;
+#else
+    if (!unix_lookup(pAddrStr + 5, &sun, &sunlen)) {
+      fprintf(stderr, "Address is not valid!\n");
+      status = 0;
+    }
+#endif
+
+  } else if (status) {
+    if (!lookup(pAddrStr, &pai)) {
       fprintf(stderr, "Address is not valid!\n");
       status = 0;
     }
   }
 
-  /* Next, get a socket for communication */
   if (status) {
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    phase_end(PHASE_LOOKUP);
+  }
+
+  /* Next, in server mode, get a socket for the most preferred address
+   * -- in client mode, a new socket is opened for each connection
+   * attempt */
+  if (status && server) {
+    if (unixsock) {
+      sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    } else {
+      sock = socket(pai->ai_family, pai->ai_socktype, pai->ai_protocol);
+    }
 
 #ifdef _WIN32
     if (sock == INVALID_SOCKET) {
@@ -568,7 +8597,7 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
    * p. 580 of Advanced Programming in the UNIX Environment, 2nd ed.,
    * by W. Richard Stevens and Stephen A. Rago, to handle a quirk of
    * TCP */
-  if (status && server) {
+  if (status && server && (!unixsock)) {
     i = 1;
     if (setsockopt(
         sserv,
@@ -587,27 +8616,116 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
     }
   }
 
+  /* A server listening on an IPv6 address also accepts IPv4 clients
+   * (as IPv4-mapped addresses), so that listening on [::] covers both
+   * families -- this is the default on some systems but not others, so
+   * set it explicitly, and don't fail if the system doesn't allow it */
+  if (status && server && (!unixsock) && (pai->ai_family == AF_INET6)) {
+    i = 0;
+    if (setsockopt(
+        sserv,
+        IPPROTO_IPV6,
+        IPV6_V6ONLY,
+#ifdef _WIN32
+        (const char *) &i,
+        (int) sizeof(int)
+#else
+        &i,
+        (socklen_t) sizeof(int)
+#endif
+      )) {
+      fprintf(stderr, "Warning:  couldn't enable dual-stack listening.\n");
+    }
+  }
+
   /* We need to connect with the other instance now -- this depends on
    * whether we are in server or client mode */
-  if (status && server) {
+  if (status && server && unixsock) {
+#ifndef _WIN32
+    /* Server mode on a Unix domain socket -- remove a socket left
+     * behind at the path by an earlier server, but nothing else, and
+     * then bind the server socket */
+    if (lstat(sun.sun_path, &st) == 0) {
+      if (S_ISSOCK(st.st_mode)) {
+        (void) unlink(sun.sun_path);
+      }
+    }
+
+    if (bind(sserv, (const struct sockaddr *) &sun, sunlen)) {
+      fprintf(stderr,
+        "Could not bind server socket to address!\n");
+      status = 0;
+    } else {
+      bound = 1;
+    }
+#endif
+
+  } else if (status && server) {
     /* Server mode -- first we need to bind the server socket */
     if (bind(
         sserv,
-        (const struct sockaddr *) &sai,
+        pai->ai_addr,
 #ifdef _WIN32
-        (int) sizeof(struct sockaddr_in)
+        (int) pai->ai_addrlen
 #else
-        (socklen_t) sizeof(struct sockaddr_in)
+        pai->ai_addrlen
 #endif
         )) {
       fprintf(stderr,
         "Could not bind server socket to address!\n");
       status = 0;
     }
+  }
+
+  /* With --fastopen, let clients send data with their handshake, and
+   * if the client is the one to speak first (because it is writing, or
+   * is sending an HTTP request), don't bother waking up to accept the
+   * connection until its data has arrived; either failing is not an
+   * error, since the connection still works without it */
+  if (status && server && pOpt->fastopen) {
+#ifdef TCP_FASTOPEN
+    i = FASTOPENQLEN;
+    if (setsockopt(
+        sserv,
+        IPPROTO_TCP,
+        TCP_FASTOPEN,
+#ifdef _WIN32
+        (const char *) &i,
+        (int) sizeof(int)
+#else
+        &i,
+        (socklen_t) sizeof(int)
+#endif
+      )) {
+      fprintf(stderr, "Warning:  couldn't enable TCP Fast Open.\n");
+    }
+#else
+    fprintf(stderr,
+      "Warning:  TCP Fast Open not supported on this platform.\n");
+#endif
+
+#ifdef TCP_DEFER_ACCEPT
+    if ((!write) || fh) {
+      i = DEFERSECS;
+      if (setsockopt(sserv, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                      &i, (socklen_t) sizeof(int))) {
+        fprintf(stderr, "Warning:  couldn't enable deferred accept.\n");
+      }
+    }
+#endif
+  }
 
+  /* The buffer sizes must be set before listening, so that accepted
+   * connections inherit them in time for the window scale to be
+   * negotiated */
+  if (status && server && (!unixsock)) {
+    sock_bufs(sserv, pOpt->sndbuf, pOpt->rcvbuf);
+  }
+
+  if (status && server) {
     /* Next, put the server socket in listening mode */
     if (status) {
-      if (listen(sserv, 1)) {
+      if (listen(sserv, (pOpt->fanout > 1) ? pOpt->fanout : 1)) {
         fprintf(stderr,
           "Could not listen for incoming connections!\n");
         status = 0;
@@ -632,6 +8750,9 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
        * connection is active; else, report error */
       if (status) {
         conup = 1;
+        if (pOpt->fanout < 1) {
+          phase_end(PHASE_CONNECT);
+        }
       } else {
         fprintf(stderr,
           "Could not accept the incoming connection!\n");
@@ -639,9 +8760,47 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
       }
     }
 
+#ifndef _WIN32
+    /* With --fanout, wait for the rest of the readers, and keep all of
+     * them in the reader table, which fan_send() takes over */
+    if (status && (pOpt->fanout > 0)) {
+      pFan = (int *) malloc(sizeof(int) * (size_t) pOpt->fanout);
+      if (pFan == NULL) {
+        fprintf(stderr, "Couldn't allocate reader table!\n");
+        status = 0;
+      }
+
+      if (status) {
+        pFan[0] = sock;
+        nfan  = 1;
+        sock  = -1;
+        conup = 0;
+        while (nfan < pOpt->fanout) {
+          pFan[nfan] = accept(sserv, NULL, NULL);
+          if (pFan[nfan] == -1) {
+            fprintf(stderr,
+              "Could not accept the incoming connection!\n");
+            status = 0;
+            break;
+          }
+          nfan++;
+        }
+      }
+
+      if (status) {
+        phase_end(PHASE_CONNECT);
+      }
+    }
+#endif
+
     /* Finally, regardless of whether we succeeded or not, close the
      * server socket as we won't be accepting any further
-     * connections */
+     * connections, and remove the path of a Unix domain socket */
+#ifndef _WIN32
+    if (bound) {
+      (void) unlink(sun.sun_path);
+    }
+#endif
 #ifdef _WIN32
     if (closesocket(sserv)) {
       fprintf(stderr, "Warning:  problem closing socket.\n");
@@ -655,16 +8814,33 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
 #endif
 
   } else if (status && (!server)) {
-    /* Client mode -- use connect() on sock */
-    if (connect(
-        sock,
-        (const struct sockaddr *) &sai,
-#ifdef _WIN32
-        (int) sizeof(struct sockaddr_in)
+    /* Client mode -- connect to the Unix domain socket, or to
+     * whichever address of the server answers first; with --retry,
+     * keep trying with backoff until the deadline, in case the server
+     * hasn't started listening yet */
+    deadline = now_ms() + ((int64_t) pOpt->retry) * 1000;
+    delay = RETRYMIN;
+    for(;;) {
+#ifndef _WIN32
+      if (unixsock) {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ((sock != -1) &&
+            connect(sock, (const struct sockaddr *) &sun, sunlen)) {
+          close(sock);
+          sock = -1;
+        }
+      } else {
+        sock = connect_race(pai, pOpt, write);
+      }
 #else
-        (socklen_t) sizeof(struct sockaddr_in)
+      sock = connect_race(pai, pOpt, write);
 #endif
-        )) {
+      if ((sock != MSOCKET_NONE) || (!retry_wait(deadline, &delay))) {
+        break;
+      }
+    }
+
+    if (sock == MSOCKET_NONE) {
       fprintf(stderr, "Could not connect to server!\n");
       status = 0;
     }
@@ -672,74 +8848,107 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
     /* If succeeded, set flag indicating connection is up */
     if (status) {
       conup = 1;
+      phase_end(PHASE_CONNECT);
+    }
+  }
+
+  /* Apply the TCP tuning that needs a connection, to each reader with
+   * --fanout */
+  for(i = 0; status && (!unixsock) && (i < nfan); i++) {
+    if (!sock_tune(pFan[i], pOpt, write)) {
+      status = 0;
+    }
+  }
+  if (status && (!unixsock) && conup) {
+    if (!sock_tune(sock, pOpt, write)) {
+      status = 0;
+    }
+  }
+
+  /* With --relay, connect to the next instance in the chain */
+  if (status && (pOpt->pRelay != NULL)) {
+    fwd = relay_connect(pOpt->pRelay, pOpt);
+    if (fwd == MSOCKET_NONE) {
+      status = 0;
     }
   }
 
-  /* Allocate the I/O buffer */
+  /* Start pacing the transfer -- even without a rate, since one may be
+   * set with --control; with --fanout, the input is paced instead of
+   * any one connection */
   if (status) {
-    iobuf = (char *) malloc(IOBUFSIZE);
+    rate_start(sock, write, (!unixsock) && conup);
+  }
+
+  /* Start reporting progress, now that the connection is up */
+  if (status) {
+    prog_begin();
+  }
+
+  /* Allocate the I/O buffer, in the block size from --bufsize if
+   * given */
+  if (status) {
+    if (pOpt->bufsize > 0) {
+      bufsize = pOpt->bufsize;
+    }
+    iobuf = (char *) malloc((size_t) bufsize);
     if (iobuf == NULL) {
       fprintf(stderr, "Couldn't allocate I/O buffer!\n");
       status = 0;
     }
     if (status) {
-      memset(iobuf, 0, IOBUFSIZE);
+      memset(iobuf, 0, (size_t) bufsize);
+    }
+  }
+
+  /* In fake HTTP mode, we also need a buffer for the request
+   * header */
+  if (status && fh) {
+    hbuf = (char *) malloc(MAXHDRSIZE);
+    if (hbuf == NULL) {
+      fprintf(stderr, "Couldn't allocate header buffer!\n");
+      status = 0;
+    }
+    if (status) {
+      memset(hbuf, 0, MAXHDRSIZE);
     }
   }
 
+  /* Set up the buffered reader on the connected socket, using the I/O
+   * buffer */
+  if (status) {
+    cb.sock = sock;
+    cb.pBuf = iobuf;
+    cb.cap  = bufsize;
+    cb.pos  = 0;
+    cb.lim  = 0;
+    cb.sink = pOpt->sink;
+  }
+
   /* We've got sock connected and ready for I/O with the other party
    * and our I/O buffer -- our first step is if we are in fake HTTP
    * mode, we have to read with ASCII CR characters filtered out until
    * either two ASCII LF characters in a row are encountered or the
    * input ends (whichever occurs first) */
   if (status && fh) {
-    /* First receive operation */
-    rcount = (int) recv(sock, iobuf, IOBUFSIZE, 0);
-
-    /* Keep processing until error or end of data */
-    while (rcount > 0) {
-      /* Process all the newly received data */
-      for(i = 0; i < rcount; i++) {
-        /* Ignore CR characters */
-        if (iobuf[i] == ASCII_CR) {
-          continue;
-        }
-
-        /* Handling varies depending on if character is LF or
-         * not */
-        if (iobuf[i] == ASCII_LF) {
-          /* LF character -- if lf_flg already set, we got two
-           * line breaks in a row, so set ht_brk to indicate
-           * fake HTTP reading should stop and break out of
-           * this inner loop; else, set lf_flg */
-          if (lf_flg) {
-            ht_brk = 1;
-            break;
-          } else {
-            lf_flg = 1;
-          }
-
-        } else {
-          /* Not an LF character -- reset the LF flag */
-          lf_flg = 0;
-        }
-      }
-
-      /* Break out of this loop if we've encountered two line
-       * breaks in a row in the inner loop */
-      if (ht_brk) {
-        break;
-      }
+    rcount = connbuf_header(&cb, hbuf, MAXHDRSIZE, &trunc);
+    phase_end(PHASE_HEADER);
 
-      /* Read more data */
-      rcount = (int) recv(sock, iobuf, IOBUFSIZE, 0);
+    /* Fail if we stopped processing on account of an I/O error */
+    if (rcount < 0) {
+      fprintf(stderr,
+        "Read error during fake HTTP handling!\n");
+      status = 0;
     }
 
-    /* Fail if we stopped processing on account of an I/O error */
-    if (status) {
-      if (rcount < 0) {
-        fprintf(stderr,
-          "Read error during fake HTTP handling!\n");
+    /* In read mode, we need the whole header and the connection must
+     * still be open for the body and the response */
+    if (status && (!write)) {
+      if (rcount == 0) {
+        fprintf(stderr, "Incomplete HTTP request!\n");
+        status = 0;
+      } else if (trunc) {
+        fprintf(stderr, "HTTP request header is too large!\n");
         status = 0;
       }
     }
@@ -749,80 +8958,79 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
    * mode, if requested -- what's left is to either send stdin through
    * socket (write mode) or receive stdout through socket (read mode),
    * using the I/O buffer as an intermediary */
-  if (status && write) {
-    /* Write mode -- transfer stdin through socket; begin with the
-     * first read from stdin into the I/O buffer */
-    rcount = (int) fread(iobuf, 1, IOBUFSIZE, stdin);
+  if (status && pOpt->pass_fd) {
+#ifndef _WIN32
+    /* Passing standard input over a Unix domain socket -- the reader
+     * transfers the data itself */
+    if (write) {
+      status = pass_fd_write(&sock);
+    } else {
+      status = pass_fd_read(&cb);
+    }
+#endif
 
-    /* Keep reading full buffers from stdin until EOF or error */
-    while (rcount == IOBUFSIZE) {
+  } else if (status && (pFan != NULL)) {
+#ifndef _WIN32
+    /* Write mode with --fanout -- send stdin (or the --source data) to
+     * all of the readers */
+    status = fan_send(pFan, nfan, bufsize, pOpt->drop, !unixsock);
+#endif
 
-      /* Send the full buffer */
-      if (send(sock, iobuf, IOBUFSIZE, 0) != IOBUFSIZE) {
-        fprintf(stderr, "Error sending data!\n");
-        status = 0;
-      }
+  } else if (status && write && (pOpt->pFile != NULL)) {
+    /* Fake HTTP write mode serving a file -- generate the response and
+     * transmit the file */
+    status = http_file(sock, hbuf, fd, flen, etag);
 
-      /* Break if failure to send */
-      if (!status) {
-        break;
-      }
+  } else if (status && write && pOpt->chunked) {
+    /* Fake HTTP write mode with a generated response -- transfer stdin
+     * through socket with chunked framing */
+    status = http_chunked(sock, hbuf);
 
-      /* Read more from stdin */
-      rcount = (int) fread(iobuf, 1, IOBUFSIZE, stdin);
-    }
+  } else if (status && pOpt->duplex) {
+    /* Duplex mode -- transfer stdin (or the --source data) through
+     * socket and socket through stdout at the same time */
+    status = duplex(&cb, bufsize);
 
-    /* If reading stopped due to error, detect that, report it, and
-     * fail */
-    if (status) {
-      if (ferror(stdin)) {
-        fprintf(stderr, "Error reading from stdin!\n");
-        status = 0;
-      }
-    }
+  } else if (status && write) {
+    /* Write mode -- transfer stdin (or the --source data) through
+     * socket */
+    status = in_to_sock(sock, iobuf, bufsize);
 
-    /* If we still have remainder data, write that */
-    if (status && (rcount > 0)) {
-      if (send(sock, iobuf, rcount, 0) != rcount) {
-        fprintf(stderr, "Error sending data!\n");
-        status = 0;
-      }
-    }
+  } else if (status && fh) {
+    /* Fake HTTP read mode -- transfer the request body through stdout
+     * and then respond to the client */
+    status = http_upload(&cb, hbuf);
 
-  } else {
-    /* Read mode -- transfer socket through stdout; begin with the
-     * first read from socket into the I/O buffer */
-    rcount = (int) recv(sock, iobuf, IOBUFSIZE, 0);
-
-    /* Keep reading until no more to receive or error */
-    while (rcount > 0) {
-      /* Write all the data to stdout */
-      if (fwrite(iobuf, 1, rcount, stdout) != rcount) {
-        fprintf(stderr, "Error writing to stdout!\n");
-        status = 0;
-      }
+  } else if (status && (fwd != MSOCKET_NONE)) {
+    /* Read mode with --relay -- transfer socket through stdout and on
+     * to the next instance until the other side closes the
+     * connection */
+    status = relay_out(&cb, fwd);
 
-      /* Break if there was an error */
-      if (!status) {
-        break;
-      }
+  } else if (status) {
+    /* Read mode -- transfer socket through stdout until the other side
+     * closes the connection */
+    status = sock_to_out(&cb, -1);
+  }
 
-      /* Read more from sock */
-      rcount = (int) recv(sock, iobuf, IOBUFSIZE, 0);
+  /* Make sure everything received has been written out */
+  if (status && (!write)) {
+    if (fflush(stdout)) {
+      fprintf(stderr, "Error writing to stdout!\n");
+      status = 0;
     }
+  }
 
-    /* If we stopped on account of a socket read error, detect that
-     * and report it */
-    if (status) {
-      if (rcount < 0) {
-        fprintf(stderr, "Error receiving data!\n");
-        status = 0;
-      }
-    }
+  /* Record the state of the TCP connection for --stats-json while it
+   * is still open */
+  if (conup && (!unixsock)) {
+    stat_tcp(sock);
   }
 
-  /* If connection is open, shut it down */
-  if (conup) {
+  /* If connection is open, shut it down -- with --duplex, both
+   * directions have already been ended, and the other side may be
+   * gone, and pass_fd_write may have reset and closed it already */
+  if (conup && (!pOpt->duplex) && (sock != MSOCKET_NONE)) {
     if (shutdown(
         sock,
 #ifdef _WIN32
@@ -835,12 +9043,52 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
     }
   }
 
-  /* Free the I/O buffer if it is allocated */
+  /* Shut down and close the connection to the next instance of a
+   * --relay chain, which then sees the end of the data -- this fails
+   * harmlessly if that connection already failed */
+  if (fwd != MSOCKET_NONE) {
+    (void) shutdown(
+        fwd,
+#ifdef _WIN32
+        2 /* both */
+#else
+        SHUT_RDWR
+#endif
+        );
+    sock_close(fwd);
+    fwd = MSOCKET_NONE;
+  }
+
+  /* Free the buffers if they are allocated */
   if (iobuf != NULL) {
     free(iobuf);
     iobuf = NULL;
   }
 
+  if (hbuf != NULL) {
+    free(hbuf);
+    hbuf = NULL;
+  }
+
+  /* Close the input file if it is open */
+  if (fd != -1) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+    fd = -1;
+  }
+
+  /* Free the address list if it was looked up */
+  if (pai != NULL) {
+    freeaddrinfo(pai);
+    pai = NULL;
+  }
+
+  /* Stop pacing through the socket before closing it */
+  rate_stop();
+
   /* Close the sockets if they are open */
 #ifdef _WIN32
   if (sock != INVALID_SOCKET) {
@@ -866,6 +9114,16 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
       fprintf(stderr, "Warning:  problem closing socket.\n");
     }
   }
+
+  /* Reset the connections of the --fanout readers that fan_send()
+   * didn't get to, so that they fail, and free the reader table */
+  if (pFan != NULL) {
+    for(i = 0; i < nfan; i++) {
+      sock_reset(pFan[i]);
+    }
+    free(pFan);
+    pFan = NULL;
+  }
 #endif
 
   /* Return status */
@@ -883,25 +9141,30 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
  * argc must be the number of arguments, and argv must be an array of
  * pointers to the null-terminated arguments.
  *
- * There must be exactly three arguments.  The first argument is the
- * conventional module name, and then the second and third arguments are
- * two command-line parameters.  The first argument is ignored.  The
- * second argument must be two or three characters, one of which is a
- * case-sensitive match for "s" or "c", the other of which is a
- * case-sensitive match for "r" or "w", and the third (if present) is
- * a case-sensitive match for "h" (order does not matter).  "h" may only
- * be used if "sw" mode is specified, or an error message will be
- * displayed.  The third program argument should be a IPv4 address/port
- * combination that the platform-specific translation function will be
- * able to interpret.
+ * Apart from "--" options, there must be exactly three arguments.  The
+ * first argument is the conventional module name, and then the second
+ * and third arguments are two command-line parameters.  The first
+ * argument is ignored.  The second argument must be two or three
+ * characters, one of which is a case-sensitive match for "s" or "c",
+ * the other of which is a case-sensitive match for "r" or "w", and the
+ * third (if present) is a case-sensitive match for "h" (order does not
+ * matter).  "h" may only be used if "s" mode is specified, or an error
+ * message will be displayed.  The third program argument should be a
+ * host name, IPv4, or IPv6 address/port combination that the
+ * platform-specific translation function will be able to interpret.
+ *
+ * Any argument that begins with "--" is an option rather than one of
+ * the parameters described above.  Options may appear anywhere after
+ * the module name.
  *
  * See the program documentation at the top of this source file for
  * further information about the meaning of these parameters.
  *
  * If there are not exactly three arguments, an error message is
  * displayed and the function returns failure.  If the second argument
- * can't be parsed, an error message is displayed and the function
- * returns failure.  Otherwise, the function calls through to mspeak
+ * or an option can't be parsed, or an option is not allowed with the
+ * given flags, an error message is displayed and the function returns
+ * failure.  Otherwise, the function calls through to mspeak
  * with the arguments set as parsed from the command line.
  *
  * If less than two arguments are passed (that is, no extra command line
@@ -930,7 +9193,7 @@ static int mspeak(int server, int write, int fh, const char *pAddrStr) {
  *
  *   - If argv is NULL
  *
- *   - If argc is three and the second or third parameter is NULL
+ *   - If any parameter after the first is NULL
  *
  * Undefined behavior:
  *
@@ -944,7 +9207,13 @@ int main(int argc, char *argv[]) {
   int server      = -1  ; /* -1 means not specified yet */
   int write       = -1  ; /* -1 means not specified yet */
   int fh          = -1  ; /* -1 means not specified yet */
+  int i           =  0  ;
+  int ran         =  0  ;
   const char * pc = NULL;
+  const char * pFlags = NULL;
+  const char * pTcpOpt = NULL;
+  const char * pAddr  = NULL;
+  MSOPT        opt          ;
 #ifdef _WIN32
 /* WIN32-specific --------------------------------------------------- */
   int     sock_init = 0;
@@ -962,6 +9231,9 @@ int main(int argc, char *argv[]) {
 /* ================================================================== */
 #endif
 
+  /* Initialize structures */
+  memset(&opt, 0, sizeof(MSOPT));
+
   /* Check parameters */
   if (argv == NULL) {
     abort();
@@ -972,9 +9244,12 @@ int main(int argc, char *argv[]) {
    */
   if (argc < 2) {
     fprintf(stderr,
-"Syntax: mspeak [flags] [address/port]\n"
+"Syntax: mspeak [flags] [address/port] [options]\n"
 "\n"
-"Address/port is IPv4, such as 192.168.1.10:32\n"
+"Address/port is IPv4, such as 192.168.1.10:32, IPv6 in\n"
+"brackets, such as [2001:db8::10]:32, a host name, such as\n"
+"example.com:32, unix:/path for a Unix domain socket, or\n"
+"shm:name for shared memory\n"
 "\n"
 "Flags are:\n"
 "\n"
@@ -986,7 +9261,34 @@ int main(int argc, char *argv[]) {
 "\n"
 "Either r/w must be specified.\n"
 "Either c/s must be specified.\n"
-"h is optional but only allowed with sw.\n"
+"h is optional but only allowed with s.\n"
+"\n"
+"Options are:\n"
+"\n"
+"  --chunked   - generate a chunked HTTP response (swh only)\n"
+"  --file=path - serve a file as an HTTP response (swh only)\n"
+"  --pass-fd   - pass stdin itself over a unix: address\n"
+"  --retry=N   - keep trying to connect for N seconds (client)\n"
+"  --fastopen  - use TCP Fast Open and deferred accept\n"
+"  --sndbuf=N  - set the socket send buffer size (K/M/G)\n"
+"  --rcvbuf=N  - set the socket receive buffer size (K/M/G)\n"
+"  --congestion=NAME    - use the named congestion control\n"
+"  --notsent-lowat=N    - limit unsent data in the send buffer\n"
+"  --autobuf=N - size buffers for N bytes/second at the RTT\n"
+"  --rate=N[:B] - limit to N bytes/second in bursts of B\n"
+"  --control=path       - take rate changes on a Unix socket\n"
+"  --progress  - report progress on stderr every second\n"
+"  --stats-json[=path] - write transfer statistics at the end\n"
+"  --phase-hist=path    - add phase times to a histogram file\n"
+"  --source=PATTERN     - send zero, random, or N%% random data\n"
+"  --bytes=N   - how much --source sends (K/M/G)\n"
+"  --sink      - throw the received data away\n"
+"  --bufsize=N - move data in blocks of N bytes (K/M/G)\n"
+"  --bench     - run the loopback benchmark (no flags/address)\n"
+"  --fanout=N  - send the same data to N readers (sw only)\n"
+"  --slow=stall|drop    - wait for or drop slow --fanout readers\n"
+"  --relay=address      - also forward the data to address (r only)\n"
+"  --duplex    - send stdin and receive to stdout at once\n"
 "\n"
 "Superuser privilege may be required to listen on a\n"
 "low-numbered port.\n"
@@ -996,25 +9298,59 @@ int main(int argc, char *argv[]) {
     status = 0;
   }
 
-  /* Fail if not exactly three arguments */
+  /* Separate the options from the flags and address, interpreting each
+   * option as it is encountered */
   if (status) {
-    if (argc != 3) {
-      fprintf(stderr, "Expecting two additional arguments!\n");
+    for(i = 1; i < argc; i++) {
+      /* Check argument */
+      if (argv[i] == NULL) {
+        abort();
+      }
+
+      /* Options begin with "--" and the rest are the parameters in
+       * order */
+      if (strncmp(argv[i], "--", 2) == 0) {
+        status = parse_option(argv[i], &opt);
+      } else if (pFlags == NULL) {
+        pFlags = argv[i];
+      } else if (pAddr == NULL) {
+        pAddr = argv[i];
+      } else {
+        pAddr = NULL;
+        break;
+      }
+
+      /* Break if there was an error */
+      if (!status) {
+        break;
+      }
+    }
+  }
+
+  /* The benchmark takes neither flags nor address -- it runs as a
+   * client writer for the purpose of checking the options */
+  if (status && opt.bench) {
+    if ((pFlags != NULL) || (pAddr != NULL)) {
+      fprintf(stderr, "Option --bench takes no flags or address!\n");
       status = 0;
+    } else {
+      pFlags = "cw";
+      pAddr  = "127.0.0.1:0";
     }
   }
 
-  /* Check arguments */
+  /* Fail if not exactly two parameters */
   if (status) {
-    if ((argv[1] == NULL) || (argv[2] == NULL)) {
-      abort();
+    if ((pFlags == NULL) || (pAddr == NULL)) {
+      fprintf(stderr, "Expecting two additional arguments!\n");
+      status = 0;
     }
   }
 
   /* Intepret the flags */
   if (status) {
     /* Go through each character */
-    for(pc = argv[1]; *pc != 0; pc++) {
+    for(pc = pFlags; *pc != 0; pc++) {
       /* Find the right flag */
       if (*pc == 'r') {
         /* Read flag -- set write to zero if not yet set,
@@ -1096,17 +9432,176 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  /* Error if fake HTTP is specified when not in server write mode */
+  /* Error if fake HTTP is specified when not in server mode */
   if (status) {
     if (fh) {
-      if ((!server) || (!write)) {
+      if (!server) {
         fprintf(stderr,
-          "Fake HTTP only allowed in server write mode!\n");
+          "Fake HTTP only allowed in server mode!\n");
         status = 0;
       }
     }
   }
 
+  /* Error if options are given that don't apply to the mode */
+  if (status) {
+    if (opt.chunked && ((!fh) || (!write))) {
+      fprintf(stderr,
+        "Option --chunked only allowed in fake HTTP write mode!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if ((opt.pFile != NULL) && ((!fh) || (!write))) {
+      fprintf(stderr,
+        "Option --file only allowed in fake HTTP write mode!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if ((opt.pFile != NULL) && opt.chunked) {
+      fprintf(stderr,
+        "Options --file and --chunked can't be combined!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if ((opt.retry > 0) && server && (opt.pRelay == NULL)) {
+      fprintf(stderr,
+        "Option --retry only allowed in client mode or with --relay!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    pTcpOpt = NULL;
+    if (opt.fastopen) {
+      pTcpOpt = "--fastopen";
+    } else if (opt.sndbuf > 0) {
+      pTcpOpt = "--sndbuf";
+    } else if (opt.rcvbuf > 0) {
+      pTcpOpt = "--rcvbuf";
+    } else if (opt.pCongestion != NULL) {
+      pTcpOpt = "--congestion";
+    } else if (opt.notsent_lowat > 0) {
+      pTcpOpt = "--notsent-lowat";
+    } else if (opt.autobuf > 0) {
+      pTcpOpt = "--autobuf";
+    }
+    if ((pTcpOpt != NULL) && ((strncmp(pAddr, "unix:", 5) == 0) ||
+                              (strncmp(pAddr, "shm:", 4) == 0))) {
+      fprintf(stderr,
+        "Option %s only allowed with TCP addresses!\n", pTcpOpt);
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if (fh && (strncmp(pAddr, "shm:", 4) == 0)) {
+      fprintf(stderr,
+        "Fake HTTP not possible with a shm: address!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if (opt.pass_fd && (fh || (strncmp(pAddr, "unix:", 5) != 0))) {
+      fprintf(stderr,
+        "Option --pass-fd only allowed with a unix: address "
+        "and without fake HTTP!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if (((opt.rate > 0) || (opt.pControl != NULL)) &&
+        (opt.pass_fd || (strncmp(pAddr, "shm:", 4) == 0))) {
+      fprintf(stderr,
+        "Options --rate and --control not possible with --pass-fd or a "
+        "shm: address!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if (opt.source &&
+        ((!write) || (opt.pFile != NULL) || opt.pass_fd)) {
+      fprintf(stderr,
+        "Option --source only allowed in write mode, and not with "
+        "--file or --pass-fd!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if ((opt.bytes > 0) && (!opt.source) && (!opt.bench)) {
+      fprintf(stderr,
+        "Option --bytes only allowed with --source or --bench!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if (opt.sink && write) {
+      fprintf(stderr, "Option --sink only allowed in read mode!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if ((opt.fanout > 0) &&
+        ((!server) || (!write) || fh || opt.pass_fd ||
+          (strncmp(pAddr, "shm:", 4) == 0))) {
+      fprintf(stderr,
+        "Option --fanout only allowed in server write mode, and not "
+        "with fake HTTP, --pass-fd, or a shm: address!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if ((opt.pRelay != NULL) &&
+        (write || fh || opt.pass_fd || (strncmp(pAddr, "shm:", 4) == 0))) {
+      fprintf(stderr,
+        "Option --relay only allowed in read mode, and not with fake "
+        "HTTP, --pass-fd, or a shm: address!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if (opt.duplex &&
+        (fh || opt.pass_fd || (strncmp(pAddr, "shm:", 4) == 0) ||
+          (opt.fanout > 0) || (opt.pRelay != NULL) || (opt.rate > 0) ||
+          (opt.pControl != NULL))) {
+      fprintf(stderr,
+        "Option --duplex not possible with fake HTTP, --pass-fd, a shm: "
+        "address, --fanout, --relay, --rate, or --control!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if (opt.drop && (opt.fanout < 1)) {
+      fprintf(stderr, "Option --slow only allowed with --fanout!\n");
+      status = 0;
+    }
+  }
+
+  if (status) {
+    if (opt.bench &&
+        (opt.progress || opt.stats || (opt.pPhaseHist != NULL) ||
+          (opt.rate > 0) || (opt.pControl != NULL) || opt.duplex)) {
+      fprintf(stderr,
+        "Options --progress, --stats-json, --phase-hist, --rate, "
+        "--control, and --duplex can't be combined with --bench!\n");
+      status = 0;
+    }
+  }
+
 #ifdef _WIN32
 /* WIN32-specific --------------------------------------------------- */
 
@@ -1154,9 +9649,74 @@ int main(int argc, char *argv[]) {
 /* ================================================================== */
 #endif
 
-  /* Call through to the main mspeak function */
+  /* Set up the pacer, and on POSIX take rate changes while the
+   * transfer runs if there is a rate or a control socket */
+  if (status) {
+    rate_init(&opt);
+  }
+
+#ifndef _WIN32
+  if (status && ((opt.rate > 0) || (opt.pControl != NULL))) {
+    status = ctl_start(&opt);
+  }
+#endif
+
+  /* Set up progress reporting if requested, which starts once the
+   * connection is up -- the writer passing its input with --pass-fd
+   * doesn't see the data, so it doesn't report */
+  if (status && opt.progress && (!(opt.pass_fd && write))) {
+    prog_start(write && (!opt.duplex));
+  }
+
+  /* Generate the data to send if requested -- the benchmark does this
+   * itself for each transfer */
+  if (status && opt.source && (!opt.bench)) {
+    status = src_start(&opt);
+  }
+
+  /* Start timing the phases of the run, and collecting statistics if
+   * requested */
   if (status) {
-    status = mspeak(server, write, fh, argv[2]);
+    phase_start();
+    ran = 1;
+    if (opt.stats) {
+      stats.on    = 1;
+      stats.start = now_ns();
+    }
+  }
+
+  /* Call through to the benchmark, the main mspeak function, or the
+   * shared-memory version for a "shm:" address */
+  if (status && opt.bench) {
+#ifndef _WIN32
+    status = bench(&opt);
+#endif
+  } else if (status && (strncmp(pAddr, "shm:", 4) == 0)) {
+#ifdef __linux__
+    status = shm_speak(server, write, pAddr + 4, &opt);
+#else
+    fprintf(stderr, "Shared memory not supported on this platform!\n");
+    status = 0;
+#endif
+  } else if (status) {
+    status = mspeak(server, write, fh, pAddr, &opt);
+  }
+
+  prog_stop();
+  src_stop();
+#ifndef _WIN32
+  ctl_stop();
+#endif
+
+  /* Report the statistics and phase times of the run */
+  if (ran) {
+    phase_end(PHASE_TOTAL);
+    if (stats.on) {
+      stat_write(opt.pStats, pFlags, status);
+    }
+    if (opt.pPhaseHist != NULL) {
+      phase_hist(opt.pPhaseHist);
+    }
   }
 
 #ifdef _WIN32